@@ -1,11 +1,26 @@
 #include "FormulaAST.h"
 
+#ifdef SPREADSHEET_WITH_ANTLR
 #include "FormulaBaseListener.h"
 #include "FormulaLexer.h"
 #include "FormulaParser.h"
+#endif
 
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define SPREADSHEET_SSE2
+#endif
+
+#include <algorithm>
 #include <cassert>
+#include <cerrno>
+#include <charconv>
+#include <climits>
+#include <cmath>
+#include <cstdlib>
 #include <functional>
+#include <iterator>
+#include <limits>
 #include <memory>
 #include <optional>
 #include <sstream>
@@ -73,22 +88,25 @@ namespace ASTImpl {
              {PR_NONE,  PR_NONE,  PR_NONE,  PR_NONE,  PR_NONE, PR_NONE},
     };
 
+    using Program = std::vector<Instruction>;
+
     class Expr {
     public:
-        using Accessor = std::function<double(Position)>;
-
         virtual ~Expr() = default;
 
-        virtual void Print(std::ostream &out) const = 0;
+        // cell positions are stored relative to the formula origin and are
+        // printed shifted by it
+        virtual void Print(std::ostream &out, Position origin) const = 0;
 
-        virtual void DoPrintFormula(std::ostream &out, ExprPrecedence precedence) const = 0;
+        virtual void DoPrintFormula(std::ostream &out, ExprPrecedence precedence, Position origin) const = 0;
 
-        [[nodiscard]] virtual double Evaluate(Accessor callback) const = 0;
+        // appends the postfix code of the subtree to the program
+        virtual void Compile(Program &program) const = 0;
 
         // higher is tighter
         [[nodiscard]] virtual ExprPrecedence GetPrecedence() const = 0;
 
-        void PrintFormula(std::ostream &out, ExprPrecedence parent_precedence,
+        void PrintFormula(std::ostream &out, ExprPrecedence parent_precedence, Position origin,
                           bool right_child = false) const {
             auto precedence = GetPrecedence();
             auto mask = right_child ? PR_RIGHT : PR_LEFT;
@@ -97,7 +115,7 @@ namespace ASTImpl {
                 out << '(';
             }
 
-            DoPrintFormula(out, precedence);
+            DoPrintFormula(out, precedence, origin);
 
             if (parens_needed) {
                 out << ')';
@@ -120,18 +138,18 @@ namespace ASTImpl {
                     : type_(type), lhs_(std::move(lhs)), rhs_(std::move(rhs)) {
             }
 
-            void Print(std::ostream &out) const override {
+            void Print(std::ostream &out, Position origin) const override {
                 out << '(' << static_cast<char>(type_) << ' ';
-                lhs_->Print(out);
+                lhs_->Print(out, origin);
                 out << ' ';
-                rhs_->Print(out);
+                rhs_->Print(out, origin);
                 out << ')';
             }
 
-            void DoPrintFormula(std::ostream &out, ExprPrecedence precedence) const override {
-                lhs_->PrintFormula(out, precedence);
+            void DoPrintFormula(std::ostream &out, ExprPrecedence precedence, Position origin) const override {
+                lhs_->PrintFormula(out, precedence, origin);
                 out << static_cast<char>(type_);
-                rhs_->PrintFormula(out, precedence, /* right_child = */ true);
+                rhs_->PrintFormula(out, precedence, origin, /* right_child = */ true);
             }
 
             [[nodiscard]] ExprPrecedence GetPrecedence() const override {
@@ -151,25 +169,28 @@ namespace ASTImpl {
                 }
             }
 
-            [[nodiscard]] double Evaluate(Accessor accessor) const override {
-                double rhs_evaluate = rhs_->Evaluate(accessor);
+            void Compile(Program &program) const override {
+                lhs_->Compile(program);
+                rhs_->Compile(program);
+                Instruction instruction{};
                 switch (type_) {
                     case Add:
-                        return lhs_->Evaluate(accessor) + rhs_evaluate;
+                        instruction.op = Instruction::Op::Add;
+                        break;
                     case Subtract:
-                        return lhs_->Evaluate(accessor) - rhs_evaluate;
+                        instruction.op = Instruction::Op::Subtract;
+                        break;
                     case Multiply:
-                        return lhs_->Evaluate(accessor) * rhs_evaluate;
+                        instruction.op = Instruction::Op::Multiply;
+                        break;
                     case Divide:
-                        if (rhs_evaluate == 0) {
-                            throw FormulaError{FormulaError::Category::Div0};
-                        }
-                        return lhs_->Evaluate(accessor) / rhs_evaluate;
+                        instruction.op = Instruction::Op::Divide;
+                        break;
                     default:
                         // have to do this because VC++ has a buggy warning
                         assert(false);
-                        return static_cast<ExprPrecedence>(INT_MAX);;
                 }
+                program.push_back(instruction);
             }
 
         private:
@@ -190,31 +211,27 @@ namespace ASTImpl {
                     : type_(type), operand_(std::move(operand)) {
             }
 
-            void Print(std::ostream &out) const override {
+            void Print(std::ostream &out, Position origin) const override {
                 out << '(' << static_cast<char>(type_) << ' ';
-                operand_->Print(out);
+                operand_->Print(out, origin);
                 out << ')';
             }
 
-            void DoPrintFormula(std::ostream &out, ExprPrecedence precedence) const override {
+            void DoPrintFormula(std::ostream &out, ExprPrecedence precedence, Position origin) const override {
                 out << static_cast<char>(type_);
-                operand_->PrintFormula(out, precedence);
+                operand_->PrintFormula(out, precedence, origin);
             }
 
             [[nodiscard]] ExprPrecedence GetPrecedence() const override {
                 return EP_UNARY;
             }
 
-            [[nodiscard]] double Evaluate(Accessor callback) const override {
-                switch (type_) {
-                    case UnaryPlus:
-                        return operand_->Evaluate(callback);
-                    case UnaryMinus:
-                        return -operand_->Evaluate(callback);
-                    default:
-                        // have to do this because VC++ has a buggy warning
-                        assert(false);
-                        return static_cast<ExprPrecedence>(INT_MAX);
+            void Compile(Program &program) const override {
+                operand_->Compile(program);
+                if (type_ == UnaryMinus) {
+                    Instruction instruction{};
+                    instruction.op = Instruction::Op::Negate;
+                    program.push_back(instruction);
                 }
             }
 
@@ -223,31 +240,42 @@ namespace ASTImpl {
             std::unique_ptr<Expr> operand_;
         };
 
+        void PrintCell(std::ostream &out, Position cell) {
+            if (!cell.IsValid()) {
+                FormulaError fe(FormulaError::Category::Ref);
+                out << fe;
+            } else {
+                out << cell.ToString();
+            }
+        }
+
         class CellExpr final : public Expr {
         public:
             explicit CellExpr(const Position *cell)
                     : cell_(cell) {
             }
 
-            void Print(std::ostream &out) const override {
-                if (!cell_->IsValid()) {
-                    FormulaError fe(FormulaError::Category::Ref);
-                    out << fe;
-                } else {
-                    out << cell_->ToString();
-                }
+            [[nodiscard]] const Position *GetCell() const {
+                return cell_;
+            }
+
+            void Print(std::ostream &out, Position origin) const override {
+                PrintCell(out, Translate(*cell_, origin));
             }
 
-            void DoPrintFormula(std::ostream &out, ExprPrecedence /* precedence */) const override {
-                Print(out);
+            void DoPrintFormula(std::ostream &out, ExprPrecedence /* precedence */, Position origin) const override {
+                Print(out, origin);
             }
 
             [[nodiscard]] ExprPrecedence GetPrecedence() const override {
                 return EP_ATOM;
             }
 
-            [[nodiscard]] double Evaluate(Accessor callback) const override {
-                return callback(*cell_);
+            void Compile(Program &program) const override {
+                Instruction instruction{};
+                instruction.op = Instruction::Op::PushCell;
+                instruction.cell = *cell_;
+                program.push_back(instruction);
             }
 
         private:
@@ -260,11 +288,11 @@ namespace ASTImpl {
                     : value_(value) {
             }
 
-            void Print(std::ostream &out) const override {
+            void Print(std::ostream &out, Position /* origin */) const override {
                 out << value_;
             }
 
-            void DoPrintFormula(std::ostream &out, ExprPrecedence /* precedence */) const override {
+            void DoPrintFormula(std::ostream &out, ExprPrecedence /* precedence */, Position /* origin */) const override {
                 out << value_;
             }
 
@@ -272,14 +300,403 @@ namespace ASTImpl {
                 return EP_ATOM;
             }
 
-            [[nodiscard]] double Evaluate(Accessor callback) const override {
-                return value_;
+            void Compile(Program &program) const override {
+                Instruction instruction{};
+                instruction.op = Instruction::Op::PushNumber;
+                instruction.number = value_;
+                program.push_back(instruction);
             }
 
         private:
             double value_;
         };
 
+        // A range of cells, only valid as an argument of a function. A range
+        // of a single cell is printed as that cell.
+        class RangeExpr final : public Expr {
+        public:
+            // the corners point into the cell list of the formula, as in CellExpr
+            RangeExpr(const Position *first, const Position *last)
+                    : first_(first), last_(last) {
+            }
+
+            void Print(std::ostream &out, Position origin) const override {
+                PrintCell(out, Translate(*first_, origin));
+                if (!(*first_ == *last_)) {
+                    out << ':';
+                    PrintCell(out, Translate(*last_, origin));
+                }
+            }
+
+            void DoPrintFormula(std::ostream &out, ExprPrecedence /* precedence */, Position origin) const override {
+                Print(out, origin);
+            }
+
+            [[nodiscard]] ExprPrecedence GetPrecedence() const override {
+                return EP_ATOM;
+            }
+
+            void Compile(Program &program) const override {
+                Instruction instruction{};
+                instruction.op = Instruction::Op::AccumulateRange;
+                instruction.range = {*first_, *last_};
+                program.push_back(instruction);
+            }
+
+        private:
+            const Position *first_;
+            const Position *last_;
+        };
+
+        using Function = Instruction::Function;
+
+        constexpr std::pair<Function, std::string_view> FUNCTION_NAMES[] = {
+                {Function::Sum,     "SUM"},
+                {Function::Min,     "MIN"},
+                {Function::Max,     "MAX"},
+                {Function::Average, "AVERAGE"},
+                {Function::Count,   "COUNT"},
+        };
+
+        std::string_view GetFunctionName(Function function) {
+            for (const auto &[candidate, name]: FUNCTION_NAMES) {
+                if (candidate == function) {
+                    return name;
+                }
+            }
+            assert(false);
+            return {};
+        }
+
+        std::optional<Function> FindFunction(std::string_view name) {
+            for (const auto &[function, candidate]: FUNCTION_NAMES) {
+                if (candidate == name) {
+                    return function;
+                }
+            }
+            return std::nullopt;
+        }
+
+        // An aggregate function of ranges and values: SUM(A1:B10,C1*2).
+        class FunctionExpr final : public Expr {
+        public:
+            FunctionExpr(Function function, std::vector<std::unique_ptr<Expr>> args)
+                    : function_(function), args_(std::move(args)) {
+            }
+
+            void Print(std::ostream &out, Position origin) const override {
+                out << '(' << GetFunctionName(function_);
+                for (const auto &arg: args_) {
+                    out << ' ';
+                    arg->Print(out, origin);
+                }
+                out << ')';
+            }
+
+            void DoPrintFormula(std::ostream &out, ExprPrecedence /* precedence */, Position origin) const override {
+                out << GetFunctionName(function_) << '(';
+                bool first = true;
+                for (const auto &arg: args_) {
+                    if (!first) {
+                        out << ',';
+                    }
+                    first = false;
+                    // a bare cell argument is parsed as a one-cell range, so a
+                    // parenthesised one keeps its parentheses to stay a cell
+                    if (dynamic_cast<const CellExpr *>(arg.get())) {
+                        out << '(';
+                        arg->PrintFormula(out, EP_ATOM, origin);
+                        out << ')';
+                    } else {
+                        arg->PrintFormula(out, EP_ATOM, origin);
+                    }
+                }
+                out << ')';
+            }
+
+            [[nodiscard]] ExprPrecedence GetPrecedence() const override {
+                return EP_ATOM;
+            }
+
+            void Compile(Program &program) const override {
+                Instruction instruction{};
+                instruction.op = Instruction::Op::BeginAggregate;
+                program.push_back(instruction);
+                for (const auto &arg: args_) {
+                    // a range feeds the aggregate by itself, a value is pushed first
+                    arg->Compile(program);
+                    if (!dynamic_cast<const RangeExpr *>(arg.get())) {
+                        instruction.op = Instruction::Op::AccumulateValue;
+                        program.push_back(instruction);
+                    }
+                }
+                instruction.op = Instruction::Op::EndAggregate;
+                instruction.function = function_;
+                program.push_back(instruction);
+            }
+
+        private:
+            Function function_;
+            std::vector<std::unique_ptr<Expr>> args_;
+        };
+
+        // Hand-written recursive descent parser for the Formula.g4 grammar.
+        // Works directly on the input view: tokens are never copied, and the
+        // only allocations are the AST nodes themselves.
+        //
+        //   main    : expr EOF
+        //   expr    : term (('+' | '-') term)*
+        //   term    : unary (('*' | '/') unary)*
+        //   unary   : ('+' | '-') unary | primary
+        //   primary : '(' expr ')' | CELL | NUMBER | NAME '(' arg (',' arg)* ')'
+        //   arg     : CELL ':' CELL | expr
+        //
+        // Unary operators bind tighter than binary ones and binary operators
+        // are left-associative, exactly as in the ANTLR grammar. Functions and
+        // ranges are an extension the ANTLR grammar does not have. NAME is
+        // [A-Z]+ not followed by a digit, otherwise it would be a CELL.
+        class Parser {
+        public:
+            explicit Parser(std::string_view text)
+                    : text_(text) {
+            }
+
+            std::unique_ptr<Expr> ParseMain() {
+                auto root = ParseExpr();
+                SkipSpaces();
+                if (pos_ != text_.size()) {
+                    throw ParsingError("Error when parsing: unexpected '" + std::string(1, text_[pos_]) + "'");
+                }
+                return root;
+            }
+
+            std::forward_list<Position> MoveCells() {
+                return std::move(cells_);
+            }
+
+        private:
+            static bool IsSpace(char c) {
+                return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+            }
+
+            static bool IsDigit(char c) {
+                return c >= '0' && c <= '9';
+            }
+
+            static bool IsUpper(char c) {
+                return c >= 'A' && c <= 'Z';
+            }
+
+            void SkipSpaces() {
+                while (pos_ < text_.size() && IsSpace(text_[pos_])) {
+                    ++pos_;
+                }
+            }
+
+            // returns the next significant character or '\0' at the end of input
+            char Peek() {
+                SkipSpaces();
+                return pos_ < text_.size() ? text_[pos_] : '\0';
+            }
+
+            bool DigitAt(size_t pos) const {
+                return pos < text_.size() && IsDigit(text_[pos]);
+            }
+
+            size_t SkipDigits(size_t pos) const {
+                while (DigitAt(pos)) {
+                    ++pos;
+                }
+                return pos;
+            }
+
+            std::unique_ptr<Expr> ParseExpr() {
+                auto lhs = ParseTerm();
+                for (char c = Peek(); c == '+' || c == '-'; c = Peek()) {
+                    ++pos_;
+                    auto type = c == '+' ? BinaryOpExpr::Add : BinaryOpExpr::Subtract;
+                    lhs = std::make_unique<BinaryOpExpr>(type, std::move(lhs), ParseTerm());
+                }
+                return lhs;
+            }
+
+            std::unique_ptr<Expr> ParseTerm() {
+                auto lhs = ParseUnary();
+                for (char c = Peek(); c == '*' || c == '/'; c = Peek()) {
+                    ++pos_;
+                    auto type = c == '*' ? BinaryOpExpr::Multiply : BinaryOpExpr::Divide;
+                    lhs = std::make_unique<BinaryOpExpr>(type, std::move(lhs), ParseUnary());
+                }
+                return lhs;
+            }
+
+            std::unique_ptr<Expr> ParseUnary() {
+                char c = Peek();
+                if (c == '+' || c == '-') {
+                    ++pos_;
+                    auto type = c == '+' ? UnaryOpExpr::UnaryPlus : UnaryOpExpr::UnaryMinus;
+                    return std::make_unique<UnaryOpExpr>(type, ParseUnary());
+                }
+                return ParsePrimary();
+            }
+
+            std::unique_ptr<Expr> ParsePrimary() {
+                char c = Peek();
+                if (c == '(') {
+                    ++pos_;
+                    auto expr = ParseExpr();
+                    if (Peek() != ')') {
+                        throw ParsingError("Error when parsing: missing ')'");
+                    }
+                    ++pos_;
+                    return expr;
+                }
+                if (IsUpper(c)) {
+                    size_t end = pos_;
+                    while (end < text_.size() && IsUpper(text_[end])) {
+                        ++end;
+                    }
+                    return DigitAt(end) ? ParseCell() : ParseFunction(end);
+                }
+                if (IsDigit(c) || c == '.') {
+                    return ParseNumber();
+                }
+                if (c == '\0') {
+                    throw ParsingError("Error when parsing: unexpected end of formula");
+                }
+                throw ParsingError("Error when lexing: unexpected '" + std::string(1, c) + "'");
+            }
+
+            // CELL: [A-Z]+[0-9]+
+            std::unique_ptr<Expr> ParseCell() {
+                size_t end = pos_;
+                while (end < text_.size() && IsUpper(text_[end])) {
+                    ++end;
+                }
+                if (!DigitAt(end)) {
+                    throw ParsingError("Error when lexing: invalid token '" + std::string(text_.substr(pos_, end - pos_)) + "'");
+                }
+                end = SkipDigits(end);
+
+                auto value_str = text_.substr(pos_, end - pos_);
+                pos_ = end;
+                auto value = Position::FromString(value_str);
+                if (!value.IsValid()) {
+                    throw FormulaException("Invalid position: " + std::string(value_str));
+                }
+
+                cells_.push_front(value);
+                return std::make_unique<CellExpr>(&cells_.front());
+            }
+
+            // NAME '(' arg (',' arg)* ')', the name ends at name_end
+            std::unique_ptr<Expr> ParseFunction(size_t name_end) {
+                auto name = text_.substr(pos_, name_end - pos_);
+                auto function = FindFunction(name);
+                if (!function) {
+                    throw ParsingError("Error when parsing: unknown function '" + std::string(name) + "'");
+                }
+                pos_ = name_end;
+                if (Peek() != '(') {
+                    throw ParsingError("Error when parsing: missing '(' after " + std::string(name));
+                }
+                ++pos_;
+
+                std::vector<std::unique_ptr<Expr>> args;
+                args.push_back(ParseArgument());
+                while (Peek() == ',') {
+                    ++pos_;
+                    args.push_back(ParseArgument());
+                }
+                if (Peek() != ')') {
+                    throw ParsingError("Error when parsing: missing ')'");
+                }
+                ++pos_;
+                return std::make_unique<FunctionExpr>(*function, std::move(args));
+            }
+
+            // A single cell argument becomes a one-cell range, so that an empty
+            // cell is skipped by the function however it is written.
+            std::unique_ptr<Expr> ParseArgument() {
+                const bool starts_with_cell = IsUpper(Peek());
+                auto arg = ParseExpr();
+                const auto *cell = dynamic_cast<const CellExpr *>(arg.get());
+                if (!starts_with_cell || !cell) {
+                    return arg;
+                }
+                if (Peek() != ':') {
+                    return std::make_unique<RangeExpr>(cell->GetCell(), cell->GetCell());
+                }
+                ++pos_;
+                if (!IsUpper(Peek())) {
+                    throw ParsingError("Error when parsing: invalid range");
+                }
+                ParseCell();
+
+                // the corners are the two most recent cells, stored as the
+                // top left and the bottom right ones
+                Position &last = cells_.front();
+                Position &first = *std::next(cells_.begin());
+                const Position top_left{std::min(first.row, last.row), std::min(first.col, last.col)};
+                const Position bottom_right{std::max(first.row, last.row), std::max(first.col, last.col)};
+                first = top_left;
+                last = bottom_right;
+                return std::make_unique<RangeExpr>(&first, &last);
+            }
+
+            // NUMBER: UINT EXPONENT? | UINT? '.' UINT EXPONENT?
+            std::unique_ptr<Expr> ParseNumber() {
+                size_t end = SkipDigits(pos_);
+                if (end < text_.size() && text_[end] == '.') {
+                    if (!DigitAt(end + 1)) {
+                        throw ParsingError("Error when lexing: invalid number");
+                    }
+                    end = SkipDigits(end + 1);
+                }
+                // the exponent belongs to the number only if it is complete,
+                // otherwise the lexer stops before 'e' and fails on it
+                if (end < text_.size() && (text_[end] == 'e' || text_[end] == 'E')) {
+                    size_t exponent = end + 1;
+                    if (exponent < text_.size() && (text_[exponent] == '+' || text_[exponent] == '-')) {
+                        ++exponent;
+                    }
+                    if (DigitAt(exponent)) {
+                        end = SkipDigits(exponent);
+                    }
+                }
+
+                auto value_str = text_.substr(pos_, end - pos_);
+                pos_ = end;
+                return std::make_unique<NumberExpr>(ParseDouble(value_str));
+            }
+
+            static double ParseDouble(std::string_view str) {
+                double value = 0;
+                auto [ptr, ec] = std::from_chars(str.data(), str.data() + str.size(), value);
+                if (ec == std::errc::result_out_of_range) {
+                    // underflow is accepted as it was with stream extraction,
+                    // overflow is an error
+                    std::string copy(str);
+                    value = std::strtod(copy.c_str(), nullptr);
+                    if (std::isinf(value)) {
+                        ec = std::errc::invalid_argument;
+                    } else {
+                        ec = std::errc{};
+                        ptr = str.data() + str.size();
+                    }
+                }
+                if (ec != std::errc{} || ptr != str.data() + str.size()) {
+                    throw ParsingError("Invalid number: " + std::string(str));
+                }
+                return value;
+            }
+
+            std::string_view text_;
+            size_t pos_ = 0;
+            std::forward_list<Position> cells_;
+        };
+
+#ifdef SPREADSHEET_WITH_ANTLR
         class ParseASTListener final : public FormulaBaseListener {
         public:
             std::unique_ptr<Expr> MoveRoot() {
@@ -379,11 +796,24 @@ namespace ASTImpl {
                 throw ParsingError("Error when lexing: " + msg);
             }
         };
+#endif
 
     }  // namespace
 }  // namespace ASTImpl
 
+FormulaAST ParseFormulaAST(std::string_view in_str, Position origin) {
+    ASTImpl::Parser parser(in_str);
+    auto root = parser.ParseMain();
+    return FormulaAST(std::move(root), parser.MoveCells(), origin);
+}
+
 FormulaAST ParseFormulaAST(std::istream &in) {
+    std::string in_str{std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>()};
+    return ParseFormulaAST(std::string_view(in_str));
+}
+
+#ifdef SPREADSHEET_WITH_ANTLR
+FormulaAST ParseFormulaASTWithAntlr(std::istream &in) {
     using namespace antlr4;
 
     ANTLRInputStream input(in);
@@ -407,32 +837,325 @@ FormulaAST ParseFormulaAST(std::istream &in) {
     return FormulaAST(listener.MoveRoot(), listener.MoveCells());
 }
 
-FormulaAST ParseFormulaAST(const std::string &in_str) {
+FormulaAST ParseFormulaASTWithAntlr(const std::string &in_str) {
     std::istringstream in(in_str);
-    return ParseFormulaAST(in);
+    return ParseFormulaASTWithAntlr(in);
 }
+#endif
 
-void FormulaAST::PrintCells(std::ostream &out) const {
+void FormulaAST::PrintCells(std::ostream &out, Position origin) const {
     for (auto cell: cells_) {
-        out << cell.ToString() << ' ';
+        out << Translate(cell, origin).ToString() << ' ';
     }
 }
 
-void FormulaAST::Print(std::ostream &out) const {
-    root_expr_->Print(out);
+void FormulaAST::Print(std::ostream &out, Position origin) const {
+    root_expr_->Print(out, origin);
 }
 
-void FormulaAST::PrintFormula(std::ostream &out) const {
-    root_expr_->PrintFormula(out, ASTImpl::EP_ATOM);
+void FormulaAST::PrintFormula(std::ostream &out, Position origin) const {
+    root_expr_->PrintFormula(out, ASTImpl::EP_ATOM, origin);
 }
 
-double FormulaAST::Execute(FormulaAST::Accessor callback) const {
-    return root_expr_->Evaluate(std::move(callback));
+namespace {
+    // If an operand of a binary operation is an error, stores the error into lhs
+    // and returns true. The right operand wins, as it used to be evaluated first.
+    inline bool PropagateError(double &lhs, double rhs) {
+        if (IsFormulaError(rhs)) {
+            lhs = rhs;
+            return true;
+        }
+        return IsFormulaError(lhs);
+    }
+
+    // Running state of an aggregate function.
+    struct Aggregate {
+        double sum = 0;
+        double min = std::numeric_limits<double>::infinity();
+        double max = -std::numeric_limits<double>::infinity();
+        double count = 0;
+        double error = 0;  // the first boxed error met, if any
+        bool has_error = false;
+    };
+
+    // Folds a run of values into the aggregate. A NaN, i.e. a skipped cell or
+    // an error, compares false and drops out of the sum, the count and the
+    // extremes. The main loop only notes that an error may be present, by the
+    // high half of the signature, and the run is searched for the first error
+    // after it. The compiler does not vectorize the NaN selects by itself, so
+    // where SSE2 is available the main loop is written with intrinsics.
+    void Accumulate(Aggregate &aggregate, const double *values, size_t size) {
+        double sum = 0;
+        double count = 0;
+        double min = aggregate.min;
+        double max = aggregate.max;
+        bool maybe_error = false;
+        size_t i = 0;
+#ifdef SPREADSHEET_SSE2
+        if (size >= 4) {
+            // two independent accumulators of two lanes each
+            const __m128d ones = _mm_set1_pd(1.0);
+            constexpr int SIGN_MASK_HIGH = static_cast<int>(ASTImpl::ERROR_SIGN_MASK >> 32);
+            constexpr int SIGNATURE_HIGH = static_cast<int>(ASTImpl::ERROR_SIGNATURE >> 32);
+            // the low halves are masked to zero and never match 1
+            const __m128i mask = _mm_set_epi32(SIGN_MASK_HIGH, 0, SIGN_MASK_HIGH, 0);
+            const __m128i signature = _mm_set_epi32(SIGNATURE_HIGH, 1, SIGNATURE_HIGH, 1);
+            __m128i errors = _mm_setzero_si128();
+            __m128d sums[2] = {_mm_setzero_pd(), _mm_setzero_pd()};
+            __m128d counts[2] = {_mm_setzero_pd(), _mm_setzero_pd()};
+            __m128d mins[2] = {_mm_set1_pd(min), _mm_set1_pd(min)};
+            __m128d maxs[2] = {_mm_set1_pd(max), _mm_set1_pd(max)};
+            for (; i + 4 <= size; i += 4) {
+                for (int k = 0; k < 2; ++k) {
+                    const __m128d value = _mm_loadu_pd(values + i + 2 * k);
+                    const __m128d is_number = _mm_cmpord_pd(value, value);
+                    sums[k] = _mm_add_pd(sums[k], _mm_and_pd(value, is_number));
+                    counts[k] = _mm_add_pd(counts[k], _mm_and_pd(ones, is_number));
+                    // the second operand is returned for a NaN
+                    mins[k] = _mm_min_pd(value, mins[k]);
+                    maxs[k] = _mm_max_pd(value, maxs[k]);
+                    const __m128i high = _mm_and_si128(_mm_castpd_si128(value), mask);
+                    errors = _mm_or_si128(errors, _mm_cmpeq_epi32(high, signature));
+                }
+            }
+            maybe_error = _mm_movemask_epi8(errors) != 0;
+            alignas(16) double lanes[4][2];
+            _mm_store_pd(lanes[0], _mm_add_pd(sums[0], sums[1]));
+            _mm_store_pd(lanes[1], _mm_add_pd(counts[0], counts[1]));
+            _mm_store_pd(lanes[2], _mm_min_pd(mins[0], mins[1]));
+            _mm_store_pd(lanes[3], _mm_max_pd(maxs[0], maxs[1]));
+            sum = lanes[0][0] + lanes[0][1];
+            count = lanes[1][0] + lanes[1][1];
+            min = std::min(lanes[2][0], lanes[2][1]);
+            max = std::max(lanes[3][0], lanes[3][1]);
+        }
+#endif
+        for (; i < size; ++i) {
+            const double value = values[i];
+            if (value == value) {
+                sum += value;
+                count += 1;
+                min = std::min(min, value);
+                max = std::max(max, value);
+            } else {
+                maybe_error = maybe_error || IsFormulaError(value);
+            }
+        }
+
+        aggregate.sum += sum;
+        aggregate.count += count;
+        aggregate.min = min;
+        aggregate.max = max;
+
+        if (!aggregate.has_error && maybe_error) {
+            for (size_t j = 0; j < size; ++j) {
+                if (IsFormulaError(values[j])) {
+                    aggregate.error = values[j];
+                    aggregate.has_error = true;
+                    break;
+                }
+            }
+        }
+    }
+
+    // COUNT counts numbers and ignores errors, the other functions fail
+    // with the first error among their arguments.
+    double Finish(const Aggregate &aggregate, ASTImpl::Instruction::Function function) {
+        using Function = ASTImpl::Instruction::Function;
+        if (function == Function::Count) {
+            return aggregate.count;
+        }
+        if (aggregate.has_error) {
+            return aggregate.error;
+        }
+        const bool empty = aggregate.count == 0;
+        switch (function) {
+            case Function::Sum:
+                return aggregate.sum;
+            case Function::Min:
+                return empty ? 0 : aggregate.min;
+            case Function::Max:
+                return empty ? 0 : aggregate.max;
+            case Function::Average:
+                return empty ? BoxFormulaError(FormulaError{FormulaError::Category::Div0})
+                             : aggregate.sum / aggregate.count;
+            default:
+                assert(false);
+                return 0;
+        }
+    }
+
+    void AccumulateRange(Aggregate &aggregate, Position first, Position last, const FormulaAST::Accessor &accessor,
+                         const FormulaAST::RangeAccessor &range_accessor) {
+        if (!first.IsValid() || !last.IsValid()) {
+            const double error = BoxFormulaError(FormulaError{FormulaError::Category::Ref});
+            Accumulate(aggregate, &error, 1);
+            return;
+        }
+        if (range_accessor) {
+            range_accessor(first, last, [&aggregate](const double *values, size_t size) {
+                Accumulate(aggregate, values, size);
+            });
+            return;
+        }
+        std::vector<double> column(last.row - first.row + 1);
+        for (int col = first.col; col <= last.col; ++col) {
+            for (int row = first.row; row <= last.row; ++row) {
+                column[row - first.row] = accessor({row, col});
+            }
+            Accumulate(aggregate, column.data(), column.size());
+        }
+    }
+}  // namespace
+
+double FormulaAST::Execute(const Accessor &accessor, Position origin, const RangeAccessor &range_accessor) const {
+    using Op = ASTImpl::Instruction::Op;
+
+    // typical formulas fit into the local buffer, deep ones fall back to the heap
+    constexpr size_t LOCAL_STACK_SIZE = 32;
+    double local_stack[LOCAL_STACK_SIZE];
+    std::vector<double> heap_stack;
+    double *stack = local_stack;
+    if (max_stack_depth_ > LOCAL_STACK_SIZE) {
+        heap_stack.resize(max_stack_depth_);
+        stack = heap_stack.data();
+    }
+    // functions being evaluated, innermost last
+    std::vector<Aggregate> aggregates;
+
+    double *top = stack;  // points past the topmost value
+    for (const auto &instruction: program_) {
+        switch (instruction.op) {
+            case Op::PushNumber:
+                *top++ = instruction.number;
+                break;
+            case Op::PushCell:
+                *top++ = accessor(Translate(instruction.cell, origin));
+                break;
+            case Op::Add:
+                --top;
+                if (!PropagateError(top[-1], *top)) {
+                    top[-1] += *top;
+                }
+                break;
+            case Op::Subtract:
+                --top;
+                if (!PropagateError(top[-1], *top)) {
+                    top[-1] -= *top;
+                }
+                break;
+            case Op::Multiply:
+                --top;
+                if (!PropagateError(top[-1], *top)) {
+                    top[-1] *= *top;
+                }
+                break;
+            case Op::Divide:
+                --top;
+                if (IsFormulaError(*top)) {
+                    top[-1] = *top;
+                } else if (*top == 0) {
+                    top[-1] = BoxFormulaError(FormulaError{FormulaError::Category::Div0});
+                } else if (!IsFormulaError(top[-1])) {
+                    top[-1] /= *top;
+                }
+                break;
+            case Op::Negate:
+                top[-1] = -top[-1];
+                break;
+            case Op::BeginAggregate:
+                aggregates.emplace_back();
+                break;
+            case Op::AccumulateValue:
+                --top;
+                Accumulate(aggregates.back(), top, 1);
+                break;
+            case Op::AccumulateRange:
+                AccumulateRange(aggregates.back(), Translate(instruction.range.first, origin),
+                                Translate(instruction.range.last, origin), accessor, range_accessor);
+                break;
+            case Op::EndAggregate:
+                *top++ = Finish(aggregates.back(), instruction.function);
+                aggregates.pop_back();
+                break;
+        }
+    }
+    assert(top == stack + 1);
+    return top[-1];
 }
 
-FormulaAST::FormulaAST(std::unique_ptr<ASTImpl::Expr> root_expr, std::forward_list<Position> cells)
+FormulaAST::FormulaAST(std::unique_ptr<ASTImpl::Expr> root_expr, std::forward_list<Position> cells,
+                       Position origin)
         : root_expr_(std::move(root_expr)), cells_(std::move(cells)) {
-    cells_.sort();  // to avoid sorting in GetReferencedCells
+    using Op = ASTImpl::Instruction::Op;
+
+    // CellExpr and RangeExpr nodes point into cells_, so this relocates the whole tree
+    for (auto &cell: cells_) {
+        cell = {cell.row - origin.row, cell.col - origin.col};
+    }
+
+    root_expr_->Compile(program_);
+
+    size_t depth = 0;
+    for (const auto &instruction: program_) {
+        switch (instruction.op) {
+            case Op::PushCell:
+                cell_refs_.push_back(instruction.cell);
+                max_stack_depth_ = std::max(max_stack_depth_, ++depth);
+                break;
+            case Op::PushNumber:
+            case Op::EndAggregate:
+                max_stack_depth_ = std::max(max_stack_depth_, ++depth);
+                break;
+            case Op::Negate:
+            case Op::BeginAggregate:
+                break;
+            case Op::AccumulateRange:
+                // a range stays a single reference however many cells it covers
+                ranges_.push_back(instruction.range);
+                break;
+            default:
+                --depth;
+        }
+    }
+    cells_.sort();  // to avoid sorting in PrintCells
+
+    std::sort(cell_refs_.begin(), cell_refs_.end());
+    cell_refs_.erase(std::unique(cell_refs_.begin(), cell_refs_.end()), cell_refs_.end());
+    auto range_less = [](const ASTImpl::Instruction::Range &lhs, const ASTImpl::Instruction::Range &rhs) {
+        return lhs.first < rhs.first || (lhs.first == rhs.first && lhs.last < rhs.last);
+    };
+    auto range_equal = [](const ASTImpl::Instruction::Range &lhs, const ASTImpl::Instruction::Range &rhs) {
+        return lhs.first == rhs.first && lhs.last == rhs.last;
+    };
+    std::sort(ranges_.begin(), ranges_.end(), range_less);
+    ranges_.erase(std::unique(ranges_.begin(), ranges_.end(), range_equal), ranges_.end());
+}
+
+bool FormulaAST::HasSameProgram(const FormulaAST &other) const {
+    using Op = ASTImpl::Instruction::Op;
+    return std::equal(program_.begin(), program_.end(), other.program_.begin(), other.program_.end(),
+                      [](const ASTImpl::Instruction &lhs, const ASTImpl::Instruction &rhs) {
+                          if (lhs.op != rhs.op) {
+                              return false;
+                          }
+                          switch (lhs.op) {
+                              case Op::PushNumber:
+                                  return ASTImpl::ToBits(lhs.number) == ASTImpl::ToBits(rhs.number);
+                              case Op::PushCell:
+                                  return lhs.cell == rhs.cell;
+                              case Op::AccumulateRange:
+                                  return lhs.range.first == rhs.range.first && lhs.range.last == rhs.range.last;
+                              case Op::EndAggregate:
+                                  return lhs.function == rhs.function;
+                              default:
+                                  return true;
+                          }
+                      });
 }
 
+FormulaAST::FormulaAST(FormulaAST&&) noexcept = default;
+
+FormulaAST& FormulaAST::operator=(FormulaAST&&) noexcept = default;
+
 FormulaAST::~FormulaAST() = default;
\ No newline at end of file
@@ -1,14 +1,122 @@
 #pragma once
 
-#include "FormulaLexer.h"
 #include "common.h"
 
+#include <cstdint>
+#include <cstring>
 #include <forward_list>
 #include <functional>
+#include <iosfwd>
+#include <memory>
 #include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
 
 namespace ASTImpl {
     class Expr;
+
+    // A single instruction of the compiled formula. The program is stored
+    // in postfix order and executed by a stack machine, see FormulaAST::Execute.
+    struct Instruction {
+        enum class Op : std::uint8_t {
+            PushNumber,  // push the literal
+            PushCell,    // push the value of the referenced cell
+            Add,
+            Subtract,
+            Multiply,
+            Divide,
+            Negate,
+            BeginAggregate,   // start accumulating the arguments of a function
+            AccumulateValue,  // pop a value into the innermost function
+            AccumulateRange,  // feed the cells of the range into the innermost function
+            EndAggregate,     // finish the innermost function and push its result
+        };
+
+        enum class Function : std::uint8_t {
+            Sum,
+            Min,
+            Max,
+            Average,
+            Count,
+        };
+
+        struct Range {
+            Position first;
+            Position last;
+        };
+
+        Op op;
+        Function function = Function::Sum;  // only for EndAggregate
+        union {
+            double number = 0;
+            Position cell;
+            Range range;
+        };
+    };
+}
+
+// Formula errors travel through evaluation as values rather than exceptions:
+// an error is boxed into a quiet NaN whose payload carries a signature and the
+// error category. Arithmetic never produces this payload by itself, and the
+// evaluator checks operands before applying an operation, so a boxed error
+// cannot be confused with a NaN computed by the formula.
+namespace ASTImpl {
+    constexpr std::uint64_t ERROR_SIGN_MASK = 0x7FFFFFFFFFFFFF00ull;
+    constexpr std::uint64_t ERROR_SIGNATURE = 0x7FF8BADF0E000000ull;
+
+    inline std::uint64_t ToBits(double value) {
+        std::uint64_t bits;
+        std::memcpy(&bits, &value, sizeof(bits));
+        return bits;
+    }
+
+    inline double FromBits(std::uint64_t bits) {
+        double value;
+        std::memcpy(&value, &bits, sizeof(value));
+        return value;
+    }
+}
+
+inline double BoxFormulaError(FormulaError error) {
+    return ASTImpl::FromBits(ASTImpl::ERROR_SIGNATURE | static_cast<std::uint64_t>(error.GetCategory()));
+}
+
+// the sign bit is ignored, so negation keeps an error intact
+inline bool IsFormulaError(double value) {
+    return (ASTImpl::ToBits(value) & ASTImpl::ERROR_SIGN_MASK) == ASTImpl::ERROR_SIGNATURE;
+}
+
+inline FormulaError UnboxFormulaError(double value) {
+    return FormulaError(static_cast<FormulaError::Category>(ASTImpl::ToBits(value) & 0xFF));
+}
+
+// Cells without a numeric value reach the evaluator as NaNs with these
+// payloads, which differ from the error signature: a reference reads an
+// empty cell as 0 and text as #VALUE!, aggregates skip both.
+namespace ASTImpl {
+    constexpr std::uint64_t EMPTY_CELL_BITS = 0x7FF8000000000001ull;
+    constexpr std::uint64_t TEXT_CELL_BITS = 0x7FF8000000000002ull;
+}
+
+inline double EmptyCellValue() {
+    return ASTImpl::FromBits(ASTImpl::EMPTY_CELL_BITS);
+}
+
+inline double TextCellValue() {
+    return ASTImpl::FromBits(ASTImpl::TEXT_CELL_BITS);
+}
+
+inline bool IsEmptyCellValue(double value) {
+    return ASTImpl::ToBits(value) == ASTImpl::EMPTY_CELL_BITS;
+}
+
+inline bool IsTextCellValue(double value) {
+    return ASTImpl::ToBits(value) == ASTImpl::TEXT_CELL_BITS;
+}
+
+inline Position Translate(Position offset, Position origin) {
+    return {origin.row + offset.row, origin.col + offset.col};
 }
 
 class ParsingError : public std::runtime_error {
@@ -17,19 +125,45 @@ class ParsingError : public std::runtime_error {
 
 class FormulaAST {
 public:
+    // returns the value of a cell or a boxed error
     using Accessor = std::function<double(Position)>;
 
+    // Receives the values of a contiguous run of cells of one column.
+    using RangeVisitor = std::function<void(const double* values, size_t size)>;
+
+    // Calls the visitor with the values of the cells of the range first:last,
+    // column by column, each column top to bottom and possibly in several
+    // runs. Cells that aggregates skip, i.e. empty ones and text that is not
+    // a number, are passed as a NaN that is not a boxed error, such as
+    // EmptyCellValue() and TextCellValue(); runs of empty cells may also be
+    // left out.
+    using RangeAccessor = std::function<void(Position first, Position last, const RangeVisitor& visitor)>;
+
+    // Cell positions are stored relative to origin, so formulas that differ
+    // only by a shift, such as =A1*2 in B1 and =A2*2 in B2, get identical
+    // ASTs. With the default origin the positions are absolute.
     explicit FormulaAST(std::unique_ptr<ASTImpl::Expr> root_expr,
-                        std::forward_list<Position> cells);
-    FormulaAST(FormulaAST&&) = default;
-    FormulaAST& operator=(FormulaAST&&) = default;
+                        std::forward_list<Position> cells,
+                        Position origin = {0, 0});
+    FormulaAST(FormulaAST&&) noexcept;
+    FormulaAST& operator=(FormulaAST&&) noexcept;
     ~FormulaAST();
     
-    [[nodiscard]] double Execute(Accessor callback) const;
-    void PrintCells(std::ostream& out) const;
-    void Print(std::ostream& out) const;
-    void PrintFormula(std::ostream& out) const;
+    // Evaluates the formula. Never throws FormulaError: if the formula or one of
+    // the cells it depends on fails, the result is the boxed error. Without a
+    // range accessor the cells of ranges are read one by one through accessor.
+    [[nodiscard]] double Execute(const Accessor &accessor, Position origin = {0, 0},
+                                 const RangeAccessor &range_accessor = nullptr) const;
+    void PrintCells(std::ostream& out, Position origin = {0, 0}) const;
+    void Print(std::ostream& out, Position origin = {0, 0}) const;
+    void PrintFormula(std::ostream& out, Position origin = {0, 0}) const;
+
+    // true if both formulas compile to the same program, i.e. compute the
+    // same function of the same relative cells
+    [[nodiscard]] bool HasSameProgram(const FormulaAST& other) const;
 
+    // positions relative to the origin of the cells and the range corners
+    // written in the formula; sorted, but may contain duplicates
     std::forward_list<Position>& GetCells() {
         return cells_;
     }
@@ -38,15 +172,44 @@ public:
         return cells_;
     }
 
+    // cells referenced one by one, not through a range, relative to the
+    // origin; sorted, without duplicates
+    [[nodiscard]] const std::vector<Position>& GetCellReferences() const {
+        return cell_refs_;
+    }
+
+    // ranges relative to the origin, without duplicates; a range is never
+    // expanded into its cells, so its size does not matter
+    [[nodiscard]] const std::vector<ASTImpl::Instruction::Range>& GetRanges() const {
+        return ranges_;
+    }
+
 private:
     std::unique_ptr<ASTImpl::Expr> root_expr_;
 
+    // the formula compiled once at construction; evaluation runs over
+    // this flat program instead of walking the tree
+    std::vector<ASTImpl::Instruction> program_;
+    size_t max_stack_depth_ = 0;
+
     // physically stores cells so that they can be
     // efficiently traversed without going through
     // the whole AST
     std::forward_list<Position> cells_;
+
+    std::vector<Position> cell_refs_;
+    std::vector<ASTImpl::Instruction::Range> ranges_;
 };
 
+// Parse a formula with the hand-written parser. Throw FormulaException or
+// ParsingError on invalid input.
+FormulaAST ParseFormulaAST(std::string_view in_str, Position origin = {0, 0});
 FormulaAST ParseFormulaAST(std::istream& in);
-FormulaAST ParseFormulaAST(const std::string& in_str);
+
+#ifdef SPREADSHEET_WITH_ANTLR
+// The ANTLR-generated parser, kept as a reference implementation for
+// differential testing of ParseFormulaAST.
+FormulaAST ParseFormulaASTWithAntlr(std::istream& in);
+FormulaAST ParseFormulaASTWithAntlr(const std::string& in_str);
+#endif
   
\ No newline at end of file
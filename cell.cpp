@@ -1,173 +1,126 @@
 #include "cell.h"
 
-#include <string>
-#include <optional>
-
-Cell::Cell(Sheet &sheet)
-        : sheet_(sheet), impl_(std::make_unique<EmptyImpl>()) {
-}
+#include "FormulaAST.h"
+#include "sheet.h"
 
-void Cell::Set(std::string text) {
-
-    if (text == impl_->GetText()) {
-        return;
-    }
+#include <cstring>
+#include <string>
 
-    std::unique_ptr<Impl> copy_impl;
+static_assert(sizeof(Cell) <= 24, "Cell is meant to stay a compact record");
 
-    if (text.size() > 1 && text.front() == FORMULA_SIGN) {
-        try {
-            copy_impl = std::make_unique<FormulaImpl>(text.substr(1));
-        } catch (std::exception &) {
-            throw FormulaException("Formula error");
-        }
+Cell::~Cell() {
+    Clear();
+}
 
-        auto refs = copy_impl->GetReferencedCells();
-        std::unordered_set<const Cell *> checked_refs;
-        if (HasCircularDependency(this, refs, checked_refs)) {
-            throw CircularDependencyException{"Circular dependency"};
+Cell::Value Cell::GetValue() const {
+    switch (kind_) {
+        case Kind::Empty:
+            return std::string();
+        case Kind::ShortText:
+        case Kind::LongText: {
+            std::string_view text = GetTextView();
+            if (!text.empty() && text.front() == ESCAPE_SIGN) {
+                text.remove_prefix(1);
+            }
+            return std::string(text);
         }
+        case Kind::Formula:
+            break;
     }
-
-    // Удалим старые зависимости
-    RemoveOldDeps();
-
-    if (text.empty()) {
-        impl_ = std::make_unique<EmptyImpl>();
-    } else if (text.size() > 1 && text.front() == FORMULA_SIGN) {
-        impl_ = std::move(copy_impl);
-    } else {
-        impl_ = std::make_unique<TextImpl>(std::move(text));
+    const auto *formula = GetPointer<FormulaCell>();
+    if (IsDirty()) {
+        formula->sheet.Recalculate(*this);
     }
-
-    // Добавим новые зависимости
-    AddNewDeps();
-
-    ClearCacheOfDependentCells();
-}
-
-Cell::Value Cell::GetValue() const {
-    if (cache_ == std::nullopt) {
-        cache_ = impl_->GetValue(sheet_);
+    const double number = formula->sheet.GetNumber(formula->pos);
+    if (IsFormulaError(number)) {
+        return UnboxFormulaError(number);
     }
-    return cache_.value();
+    return number;
 }
 
 std::string Cell::GetText() const {
-    return impl_->GetText();
+    return std::string(GetTextView());
 }
 
 std::vector<Position> Cell::GetReferencedCells() const {
-    return impl_->GetReferencedCells();
-}
-
-bool Cell::IsReferenced() const {
-    return !GetReferencedCells().empty();
-}
-
-void Cell::ClearCache() {
-    cache_.reset();
-}
-
-void Cell::ClearCacheOfDependentCells() {
-    for (Cell *dep: deps_) {
-        if (dep && dep->cache_.has_value()) {
-            dep->ClearCacheOfDependentCells();
-            dep->ClearCache();
-        }
+    if (kind_ == Kind::Formula) {
+        const auto *formula = GetPointer<FormulaCell>();
+        return formula->sheet.GetReferencedCells(*formula->formula);
     }
-    ClearCache();
-}
-
-void Cell::RemoveOldDeps() {
-    for (const Position &pos: impl_->GetReferencedCells()) {
-        auto *p_cell = PosToCell(pos);
-        if (p_cell) {
-            p_cell->deps_.erase(this);
-        }
+    return {};
+}
+
+std::string_view Cell::GetTextView() const {
+    switch (kind_) {
+        case Kind::ShortText:
+            return {data_, short_size_};
+        case Kind::LongText:
+            return *GetPointer<std::string>();
+        case Kind::Formula:
+            return GetPointer<FormulaCell>()->text;
+        default:
+            return {};
     }
 }
 
-void Cell::AddNewDeps() {
-    for (Position ref: impl_->GetReferencedCells()) {
-        auto p_cell = PosToCell(ref);
-        if (!p_cell) {
-            sheet_.SetCell(ref, "");
-            p_cell = PosToCell(ref);
-        }
-        p_cell->deps_.insert(this);
-    }
+bool Cell::IsEmpty() const {
+    return kind_ == Kind::Empty;
 }
 
-bool Cell::HasCircularDependency(const Cell *p_begin_cell, const std::vector<Position> &refs,
-                                 std::unordered_set<const Cell *> &checked_refs) const {
-    for (Position pos: refs) {
-        auto p_cell = PosToCell(pos);
-        if (p_cell) {
-            if (checked_refs.count(p_cell)) continue;
-            if (p_begin_cell == p_cell
-                || p_cell->HasCircularDependency(p_begin_cell, p_cell->GetReferencedCells(), checked_refs)) {
-                return true;
-            }
-            checked_refs.insert(p_cell);
-        }
-    }
-    return false;
+const FormulaCell *Cell::GetFormula() const {
+    return kind_ == Kind::Formula ? GetPointer<FormulaCell>() : nullptr;
 }
 
-Cell *Cell::PosToCell(Position pos) const {
-    const CellInterface *p_cell = sheet_.GetCell(pos);
-    if (p_cell) {
-        return dynamic_cast<Cell *>(const_cast<CellInterface *>(p_cell));
+bool Cell::IsDirty() const {
+    if (kind_ != Kind::Formula) {
+        return false;
     }
-    return nullptr;
-}
-
-std::vector<Position> Impl::GetReferencedCells() const {
-    return empty_vector_;
+    const auto *formula = GetPointer<FormulaCell>();
+    return !formula->sheet.IsValueValid(formula->pos);
 }
 
-CellInterface::Value EmptyImpl::GetValue(const Sheet &sheet) const {
-    return empty_text_;
+std::uint32_t Cell::GetVisitMark() const {
+    std::uint32_t mark;
+    std::memcpy(&mark, data_ + VISIT_OFFSET, sizeof(mark));
+    return mark;
 }
 
-std::string EmptyImpl::GetText() const {
-    return empty_text_;
+void Cell::SetVisitMark(std::uint32_t mark) const {
+    std::memcpy(data_ + VISIT_OFFSET, &mark, sizeof(mark));
 }
 
-TextImpl::TextImpl(std::string text)
-        : text_(std::move(text)) {
+void Cell::Evaluate() const {
+    const auto *formula = GetPointer<FormulaCell>();
+    auto value = formula->formula->Evaluate(formula->sheet);
+    const double number = std::holds_alternative<double>(value) ? std::get<double>(value)
+                                                                : BoxFormulaError(std::get<FormulaError>(value));
+    formula->sheet.StoreValue(formula->pos, number);
 }
 
-CellInterface::Value TextImpl::GetValue(const Sheet &sheet) const {
-    if (!text_.empty() && text_.front() == ESCAPE_SIGN) {
-        return text_.substr(1);
-    } else {
-        return text_;
+void Cell::Clear() {
+    if (kind_ == Kind::LongText) {
+        delete GetPointer<std::string>();
+    } else if (kind_ == Kind::Formula) {
+        delete GetPointer<FormulaCell>();
     }
+    kind_ = Kind::Empty;
 }
 
-std::string TextImpl::GetText() const {
-    return text_;
-}
-
-FormulaImpl::FormulaImpl(const std::string &text)
-        : formula_(ParseFormula(text)) {
-}
-
-CellInterface::Value FormulaImpl::GetValue(const Sheet &sheet) const {
-    auto formula_evaluate = formula_->Evaluate(sheet);
-    if (std::holds_alternative<double>(formula_evaluate)) {
-        return std::get<double>(formula_evaluate);
+void Cell::SetText(std::string_view text) {
+    Clear();
+    if (text.size() <= SHORT_TEXT_CAPACITY) {
+        std::memcpy(data_, text.data(), text.size());
+        short_size_ = static_cast<std::uint8_t>(text.size());
+        kind_ = Kind::ShortText;
     } else {
-        return std::get<FormulaError>(formula_evaluate);
+        SetPointer(new std::string(text));
+        kind_ = Kind::LongText;
     }
 }
 
-std::string FormulaImpl::GetText() const {
-    return '=' + formula_->GetExpression();
-}
-
-std::vector<Position> FormulaImpl::GetReferencedCells() const {
-    return formula_->GetReferencedCells();
+void Cell::SetFormula(std::unique_ptr<FormulaCell> formula) {
+    Clear();
+    SetPointer(formula.release());
+    kind_ = Kind::Formula;
+    SetVisitMark(0);
 }
@@ -2,103 +2,110 @@
 
 #include "common.h"
 #include "formula.h"
-#include "sheet.h"
 
-#include <cassert>
-#include <deque>
-#include <functional>
+#include <cstdint>
+#include <cstring>
 #include <memory>
-#include <queue>
-#include <stack>
-#include <unordered_set>
-#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
 
 class Sheet;
 
-class Impl;
+// Формула ячейки и всё, что нужно для её вычисления. Хранится вне
+// компактной записи Cell.
+struct FormulaCell {
+    const Sheet &sheet;
+    Position pos;
+    std::unique_ptr<FormulaInterface> formula;
+    // каноническая запись формулы, вычисляется один раз при разборе
+    std::string text;
+    // Место формулы в топологическом порядке листа: формула стоит после всех
+    // формул, на которые ссылается. Поддерживает Sheet.
+    mutable std::int64_t order = 0;
+};
 
+// Ячейка листа: компактная запись с тегом вида содержимого. Короткий текст
+// хранится прямо в записи, длинный текст и формула — в отдельных объектах.
+// Значение хранится в колоночной копии блока (см. CellStorage), а связи
+// между ячейками — в листе, поэтому ячейка без формулы не знает ни листа,
+// ни своей позиции. Содержимое задаёт лист, см. Sheet::SetCell.
 class Cell : public CellInterface {
 public:
-    explicit Cell(Sheet &sheet);
+    Cell() = default;
+
+    Cell(const Cell &) = delete;
 
-    ~Cell() override = default;
+    Cell &operator=(const Cell &) = delete;
 
-    void Set(std::string text);
+    ~Cell() override;
 
     Value GetValue() const override;
 
     std::string GetText() const override;
 
+    // Ячейки формулы, см. Sheet::GetReferencedCells.
     std::vector<Position> GetReferencedCells() const override;
 
-    bool IsReferenced() const;
-
-private:
-    bool HasCircularDependency(const Cell *p_begin_cell, const std::vector<Position> &refs,
-                               std::unordered_set<const Cell *> &checked_refs) const;
-
-    void ClearCache();
-
-    void ClearCacheOfDependentCells();
-
-    void RemoveOldDeps();
-
-    void AddNewDeps();
-
-    Cell *PosToCell(Position pos) const;
-
-    Sheet &sheet_;
-    std::unique_ptr<Impl> impl_;
-    std::unordered_set<Cell *> deps_;
-    mutable std::optional<Value> cache_;
-};
-
-class Impl {
-public:
-    virtual ~Impl() = default;
-
-    [[nodiscard]] virtual CellInterface::Value GetValue(const Sheet &sheet) const = 0;
+    // Текст ячейки без копирования.
+    [[nodiscard]] std::string_view GetTextView() const;
 
-    [[nodiscard]] virtual std::string GetText() const = 0;
+    [[nodiscard]] bool IsEmpty() const;
 
-    [[nodiscard]] virtual std::vector<Position> GetReferencedCells() const;
+    // Формула ячейки или nullptr, если в ячейке нет формулы.
+    [[nodiscard]] const FormulaCell *GetFormula() const;
 
-private:
-    std::vector<Position> empty_vector_;
-};
-
-class EmptyImpl : public Impl {
-public:
-    [[nodiscard]] CellInterface::Value GetValue(const Sheet &sheet) const override;
-
-    [[nodiscard]] std::string GetText() const override;
-
-private:
-    std::string empty_text_;
-};
-
-class TextImpl : public Impl {
-public:
-    explicit TextImpl(std::string text);
+    // Значение формулы ещё не вычислено. Текст и пустая ячейка вычислены всегда.
+    [[nodiscard]] bool IsDirty() const;
 
-    [[nodiscard]] CellInterface::Value GetValue(const Sheet &sheet) const override;
+    // Метка, которую обход графа ставит на ячейку с формулой. У новой
+    // формулы метка нулевая.
+    [[nodiscard]] std::uint32_t GetVisitMark() const;
 
-    [[nodiscard]] std::string GetText() const override;
+    void SetVisitMark(std::uint32_t mark) const;
 
-private:
-    std::string text_;
-};
-
-class FormulaImpl : public Impl {
-public:
-    explicit FormulaImpl(const std::string &text);
+    // Вычисляет значение формулы и сохраняет его в листе. Ячейки, от которых
+    // зависит формула, должны быть уже вычислены, см. Sheet::Recalculate.
+    void Evaluate() const;
 
-    [[nodiscard]] CellInterface::Value GetValue(const Sheet &sheet) const override;
+    void Clear();
 
-    [[nodiscard]] std::string GetText() const override;
+    void SetText(std::string_view text);
 
-    [[nodiscard]] std::vector<Position> GetReferencedCells() const override;
+    void SetFormula(std::unique_ptr<FormulaCell> formula);
 
 private:
-    std::unique_ptr<FormulaInterface> formula_;
+    enum class Kind : std::uint8_t {
+        Empty,
+        ShortText,
+        LongText,
+        Formula,
+    };
+
+    static constexpr size_t SHORT_TEXT_CAPACITY = 14;
+
+    // Указатель на длинный текст или формулу, хранящийся в начале data_.
+    template<typename T>
+    [[nodiscard]] T *GetPointer() const {
+        T *pointer;
+        std::memcpy(&pointer, data_, sizeof(pointer));
+        return pointer;
+    }
+
+    template<typename T>
+    void SetPointer(T *pointer) {
+        std::memcpy(data_, &pointer, sizeof(pointer));
+    }
+
+    // Метка обхода ячейки с формулой лежит в data_ сразу за указателем.
+    static constexpr size_t VISIT_OFFSET = sizeof(void *);
+
+    static_assert(VISIT_OFFSET + sizeof(std::uint32_t) <= SHORT_TEXT_CAPACITY);
+
+    // Короткий текст или указатель, см. kind_. Размер и тег занимают
+    // выравнивание после data_, поэтому запись помещается в 24 байта.
+    // Меняется в константных методах только метка обхода.
+    alignas(void *) mutable char data_[SHORT_TEXT_CAPACITY];
+    std::uint8_t short_size_ = 0;
+    Kind kind_ = Kind::Empty;
 };
@@ -0,0 +1,138 @@
+#include "cell_storage.h"
+
+CellStorage::Block::Block() {
+    values.fill(EmptyCellValue());
+    for (auto &bits: valid) {
+        bits.store(~std::uint64_t{0}, std::memory_order_relaxed);
+    }
+}
+
+Cell &CellStorage::Emplace(Position pos) {
+    auto &block = blocks_[BlockKey(pos)];
+    if (!block) {
+        block = std::make_unique<Block>();
+    }
+    auto &slot = block->cells[IndexInBlock(pos)];
+    if (!slot) {
+        // значение новой пустой ячейки совпадает со значением отсутствующей
+        slot = AllocateCell();
+        ++block->count;
+    }
+    return *slot;
+}
+
+Cell *CellStorage::Get(Position pos) const {
+    const Block *block = FindBlock(BlockKey(pos));
+    if (!block) {
+        return nullptr;
+    }
+    return block->cells[IndexInBlock(pos)];
+}
+
+bool CellStorage::Erase(Position pos) {
+    auto it = blocks_.find(BlockKey(pos));
+    if (it == blocks_.end()) {
+        return false;
+    }
+    auto &slot = it->second->cells[IndexInBlock(pos)];
+    if (!slot) {
+        return false;
+    }
+    slot->Clear();
+    free_cells_.push_back(slot);
+    slot = nullptr;
+    ResetValue(*it->second, pos);
+    SetPrintable(*it->second, pos, false);
+    if (--it->second->count == 0) {
+        blocks_.erase(it);
+    }
+    return true;
+}
+
+void CellStorage::SetPrintable(Position pos, bool printable) {
+    SetPrintable(*blocks_.at(BlockKey(pos)), pos, printable);
+}
+
+Size CellStorage::GetSize() const {
+    if (rows_.empty()) {
+        return {};
+    }
+    return {rows_.rbegin()->first + 1, cols_.rbegin()->first + 1};
+}
+
+void CellStorage::StoreValue(Position pos, double value) const {
+    const Block *block = FindBlock(BlockKey(pos));
+    block->values[ValueIndexInBlock(pos)] = value;
+    block->valid[pos.col % BLOCK_SIZE].fetch_or(RowBit(pos), std::memory_order_relaxed);
+}
+
+double CellStorage::GetNumber(Position pos) const {
+    const Block *block = FindBlock(BlockKey(pos));
+    if (!block) {
+        return EmptyCellValue();
+    }
+    if (!(block->valid[pos.col % BLOCK_SIZE].load(std::memory_order_relaxed) & RowBit(pos))) {
+        // значение вычисляется через ячейку и само попадает в блок
+        (void) block->cells[IndexInBlock(pos)]->GetValue();
+    }
+    return block->values[ValueIndexInBlock(pos)];
+}
+
+bool CellStorage::InvalidateValue(Position pos) const {
+    const Block *block = FindBlock(BlockKey(pos));
+    return block->valid[pos.col % BLOCK_SIZE].fetch_and(~RowBit(pos), std::memory_order_relaxed) & RowBit(pos);
+}
+
+bool CellStorage::IsValueValid(Position pos) const {
+    const Block *block = FindBlock(BlockKey(pos));
+    return !block || (block->valid[pos.col % BLOCK_SIZE].load(std::memory_order_relaxed) & RowBit(pos));
+}
+
+void CellStorage::ResetValue(const Block &block, Position pos) {
+    block.values[ValueIndexInBlock(pos)] = EmptyCellValue();
+    block.valid[pos.col % BLOCK_SIZE].fetch_or(RowBit(pos), std::memory_order_relaxed);
+}
+
+void CellStorage::SetPrintable(Block &block, Position pos, bool printable) {
+    std::uint64_t &bits = block.printable[pos.col % BLOCK_SIZE];
+    if (static_cast<bool>(bits & RowBit(pos)) == printable) {
+        return;
+    }
+    bits ^= RowBit(pos);
+    if (printable) {
+        Increment(rows_, pos.row);
+        Increment(cols_, pos.col);
+    } else {
+        Decrement(rows_, pos.row);
+        Decrement(cols_, pos.col);
+    }
+}
+
+Cell *CellStorage::AllocateCell() {
+    if (free_cells_.empty()) {
+        chunks_.push_back(std::make_unique<Cell[]>(CELLS_PER_CHUNK));
+        Cell *chunk = chunks_.back().get();
+        for (int i = CELLS_PER_CHUNK - 1; i >= 0; --i) {
+            free_cells_.push_back(chunk + i);
+        }
+    }
+    Cell *cell = free_cells_.back();
+    free_cells_.pop_back();
+    return cell;
+}
+
+const CellStorage::Block *CellStorage::FindBlock(int key) const {
+    auto it = blocks_.find(key);
+    return it == blocks_.end() ? nullptr : it->second.get();
+}
+
+void CellStorage::Increment(std::map<int, int> &counters, int index) {
+    ++counters[index];
+}
+
+void CellStorage::Decrement(std::map<int, int> &counters, int index) {
+    auto it = counters.find(index);
+    if (--it->second == 0) {
+        counters.erase(it);
+    }
+}
@@ -0,0 +1,356 @@
+#pragma once
+
+#include "FormulaAST.h"
+#include "cell.h"
+#include "common.h"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+// Разреженное хранилище ячеек листа.
+// Лист разбит на квадратные блоки BLOCK_SIZE x BLOCK_SIZE. Память выделяется
+// только под блоки, в которых есть хотя бы одна ячейка, поэтому расход памяти
+// растёт с числом занятых ячеек, а не с размером ограничивающего прямоугольника.
+// Сами ячейки выделяются пачками по CELLS_PER_CHUNK из пула хранилища,
+// освобождённые ячейки переиспользуются.
+//
+// Кроме ячеек, блок хранит теневую копию их значений в числовой форме (см.
+// NumericSource) в виде плотного массива double по колонкам и битовую маску
+// вычисленных значений. Отрезок колонки внутри блока лежит в памяти
+// подряд, поэтому диапазоны читаются без обращения к отдельным ячейкам.
+class CellStorage {
+public:
+    static const int BLOCK_SIZE = 64;
+
+    static const int CELLS_PER_CHUNK = 1024;
+
+    // Возвращает ячейку, при необходимости создавая пустую ячейку и блок.
+    Cell &Emplace(Position pos);
+
+    [[nodiscard]] Cell *Get(Position pos) const;
+
+    // Удаляет ячейку. Блок, в котором не осталось ячеек, освобождается.
+    // Возвращает false, если ячейки не было.
+    bool Erase(Position pos);
+
+    // Отмечает, входит ли ячейка в печатную область, то есть непуст ли её
+    // текст. Ячейка должна существовать. Новая ячейка в печатную область не
+    // входит: пустые ячейки, на которые ссылаются формулы, её не расширяют.
+    void SetPrintable(Position pos, bool printable);
+
+    // Ограничивающий прямоугольник ячеек печатной области. Поддерживается
+    // инкрементально, поэтому вызов не требует обхода ячеек.
+    [[nodiscard]] Size GetSize() const;
+
+    // Вызывает func(col, cell) для всех ячеек строки row с col < max_cols
+    // в порядке возрастания col.
+    template<typename Func>
+    void ForEachInRow(int row, int max_cols, Func func) const;
+
+    // Вызывает func(pos, cell) для всех ячеек, включая пустые, по строкам,
+    // а в строке — в порядке возрастания колонок.
+    template<typename Func>
+    void ForEachOrdered(Func func) const;
+
+    // Вызывает func(cell) для всех ячеек в произвольном порядке.
+    template<typename Func>
+    void ForEach(Func func) const;
+
+    // Вызывает func(pos, cell) для всех ячеек диапазона first:last в
+    // произвольном порядке. Время зависит от числа занятых блоков, которые
+    // задевает диапазон, а не от его размера.
+    template<typename Func>
+    void ForEachInRange(Position first, Position last, Func func) const;
+
+    // То же для ячеек диапазона с невычисленными значениями; они находятся
+    // по битовым маскам блоков, без обращения к остальным ячейкам.
+    template<typename Func>
+    void ForEachInvalidInRange(Position first, Position last, Func func) const;
+
+    // Запоминает числовую форму значения ячейки. Ячейка должна существовать.
+    // Может вызываться из разных потоков для разных ячеек.
+    void StoreValue(Position pos, double value) const;
+
+    // Числовая форма значения ячейки; невычисленная ячейка вычисляется.
+    [[nodiscard]] double GetNumber(Position pos) const;
+
+    // Отмечает, что значение ячейки больше не вычислено. Возвращает true,
+    // если до этого значение было вычислено.
+    bool InvalidateValue(Position pos) const;
+
+    [[nodiscard]] bool IsValueValid(Position pos) const;
+
+    // Вызывает visitor(values, size) для значений ячеек диапазона first:last
+    // по колонкам отрезками не длиннее BLOCK_SIZE. Невычисленные ячейки
+    // диапазона предварительно вычисляются. Отрезки незанятых блоков, в
+    // которых все ячейки пусты, пропускаются, поэтому время зависит от числа
+    // занятых блоков диапазона, а не от его размера.
+    template<typename Visitor>
+    void VisitRange(Position first, Position last, Visitor visitor) const;
+
+private:
+    struct Block {
+        Block();
+
+        std::array<Cell *, BLOCK_SIZE * BLOCK_SIZE> cells{};
+        int count = 0;
+
+        // Значения ячеек, values[col * BLOCK_SIZE + row]; у отсутствующих
+        // ячеек это EmptyCellValue(). Бит row в valid[col] сброшен, если ячейка есть, но её
+        // значение не вычислено. Биты меняются атомарно, потому что соседние
+        // ячейки могут вычисляться в разных потоках.
+        mutable std::array<double, BLOCK_SIZE * BLOCK_SIZE> values;
+        mutable std::array<std::atomic<std::uint64_t>, BLOCK_SIZE> valid;
+
+        // Бит row в printable[col] установлен, если ячейка входит в печатную
+        // область.
+        std::array<std::uint64_t, BLOCK_SIZE> printable{};
+    };
+
+    static_assert(BLOCK_SIZE == 64, "valid bits of a block column are stored in std::uint64_t");
+
+    static const int BLOCKS_PER_ROW = (Position::MAX_COLS + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    static const int BLOCKS_PER_COL = (Position::MAX_ROWS + BLOCK_SIZE - 1) / BLOCK_SIZE;
+
+    static int BlockKey(int block_row, int block_col) {
+        return block_row * BLOCKS_PER_ROW + block_col;
+    }
+
+    static int BlockKey(Position pos) {
+        return BlockKey(pos.row / BLOCK_SIZE, pos.col / BLOCK_SIZE);
+    }
+
+    static int IndexInBlock(Position pos) {
+        return (pos.row % BLOCK_SIZE) * BLOCK_SIZE + pos.col % BLOCK_SIZE;
+    }
+
+    static int ValueIndexInBlock(Position pos) {
+        return (pos.col % BLOCK_SIZE) * BLOCK_SIZE + pos.row % BLOCK_SIZE;
+    }
+
+    static std::uint64_t RowBit(Position pos) {
+        return std::uint64_t{1} << (pos.row % BLOCK_SIZE);
+    }
+
+    [[nodiscard]] const Block *FindBlock(int key) const;
+
+    // Вызывает func(block_row, block_col, block) для занятых блоков, которые
+    // задевает диапазон first:last. Если блоков диапазона больше, чем занятых
+    // блоков листа, просматриваются занятые блоки.
+    template<typename Func>
+    void ForEachBlockInRange(Position first, Position last, Func func) const;
+
+    // Сбрасывает теневое значение ячейки к значению отсутствующей ячейки.
+    static void ResetValue(const Block &block, Position pos);
+
+    void SetPrintable(Block &block, Position pos, bool printable);
+
+    Cell *AllocateCell();
+
+    static void Increment(std::map<int, int> &counters, int index);
+
+    static void Decrement(std::map<int, int> &counters, int index);
+
+    std::unordered_map<int, std::unique_ptr<Block>> blocks_;
+
+    // Пул ячеек: блоки ссылаются на ячейки, которыми владеют пачки.
+    std::vector<std::unique_ptr<Cell[]>> chunks_;
+    std::vector<Cell *> free_cells_;
+
+    // Количество ячеек печатной области в каждой строке и колонке. Размер печатной
+    // области определяется наибольшими ключами, которые находятся за O(1),
+    // а обновление при добавлении или удалении ячейки стоит O(log n).
+    std::map<int, int> rows_;
+    std::map<int, int> cols_;
+};
+
+template<typename Func>
+void CellStorage::ForEachInRow(int row, int max_cols, Func func) const {
+    const int block_row = row / BLOCK_SIZE;
+    const int row_offset = (row % BLOCK_SIZE) * BLOCK_SIZE;
+    for (int block_col = 0; block_col * BLOCK_SIZE < max_cols; ++block_col) {
+        const Block *block = FindBlock(BlockKey(block_row, block_col));
+        if (!block) {
+            continue;
+        }
+        const int first_col = block_col * BLOCK_SIZE;
+        const int last_col = std::min(first_col + BLOCK_SIZE, max_cols);
+        for (int col = first_col; col < last_col; ++col) {
+            const Cell *cell = block->cells[row_offset + col - first_col];
+            if (cell) {
+                func(col, *cell);
+            }
+        }
+    }
+}
+
+template<typename Func>
+void CellStorage::ForEachOrdered(Func func) const {
+    std::vector<int> keys;
+    keys.reserve(blocks_.size());
+    for (const auto &[key, block]: blocks_) {
+        keys.push_back(key);
+    }
+    std::sort(keys.begin(), keys.end());
+    for (size_t begin = 0, end = 0; begin < keys.size(); begin = end) {
+        const int block_row = keys[begin] / BLOCKS_PER_ROW;
+        while (end < keys.size() && keys[end] / BLOCKS_PER_ROW == block_row) {
+            ++end;
+        }
+        for (int row = block_row * BLOCK_SIZE; row < (block_row + 1) * BLOCK_SIZE; ++row) {
+            for (size_t i = begin; i < end; ++i) {
+                const int first_col = keys[i] % BLOCKS_PER_ROW * BLOCK_SIZE;
+                const Block &block = *blocks_.at(keys[i]);
+                for (int col = first_col; col < first_col + BLOCK_SIZE; ++col) {
+                    const Position pos{row, col};
+                    if (const Cell *cell = block.cells[IndexInBlock(pos)]) {
+                        func(pos, *cell);
+                    }
+                }
+            }
+        }
+    }
+}
+
+template<typename Func>
+void CellStorage::ForEach(Func func) const {
+    for (const auto &[key, block]: blocks_) {
+        for (const Cell *cell: block->cells) {
+            if (cell) {
+                func(*cell);
+            }
+        }
+    }
+}
+
+template<typename Func>
+void CellStorage::ForEachInRange(Position first, Position last, Func func) const {
+    ForEachBlockInRange(first, last, [&](int block_row, int block_col, const Block &block) {
+        const int row_begin = std::max(first.row, block_row * BLOCK_SIZE);
+        const int row_end = std::min(last.row + 1, (block_row + 1) * BLOCK_SIZE);
+        const int col_begin = std::max(first.col, block_col * BLOCK_SIZE);
+        const int col_end = std::min(last.col + 1, (block_col + 1) * BLOCK_SIZE);
+        for (int row = row_begin; row < row_end; ++row) {
+            for (int col = col_begin; col < col_end; ++col) {
+                const Position pos{row, col};
+                const Cell *cell = block.cells[IndexInBlock(pos)];
+                if (cell) {
+                    func(pos, *cell);
+                }
+            }
+        }
+    });
+}
+
+template<typename Func>
+void CellStorage::ForEachInvalidInRange(Position first, Position last, Func func) const {
+    ForEachBlockInRange(first, last, [&](int block_row, int block_col, const Block &block) {
+        const int row_begin = std::max(first.row, block_row * BLOCK_SIZE) - block_row * BLOCK_SIZE;
+        const int row_end = std::min(last.row + 1, (block_row + 1) * BLOCK_SIZE) - block_row * BLOCK_SIZE;
+        const int col_begin = std::max(first.col, block_col * BLOCK_SIZE);
+        const int col_end = std::min(last.col + 1, (block_col + 1) * BLOCK_SIZE);
+        const int size = row_end - row_begin;
+        const std::uint64_t mask = (size == BLOCK_SIZE ? ~std::uint64_t{0} : (std::uint64_t{1} << size) - 1)
+                                   << row_begin;
+        for (int col = col_begin; col < col_end; ++col) {
+            std::uint64_t invalid = ~block.valid[col % BLOCK_SIZE].load(std::memory_order_relaxed) & mask;
+            for (int row = block_row * BLOCK_SIZE; invalid; ++row, invalid >>= 1) {
+                if (invalid & 1) {
+                    const Position pos{row, col};
+                    func(pos, *block.cells[IndexInBlock(pos)]);
+                }
+            }
+        }
+    });
+}
+
+template<typename Func>
+void CellStorage::ForEachBlockInRange(Position first, Position last, Func func) const {
+    const int first_block_row = first.row / BLOCK_SIZE;
+    const int last_block_row = last.row / BLOCK_SIZE;
+    const int first_block_col = first.col / BLOCK_SIZE;
+    const int last_block_col = last.col / BLOCK_SIZE;
+    const auto block_count = static_cast<size_t>(last_block_row - first_block_row + 1) *
+                             static_cast<size_t>(last_block_col - first_block_col + 1);
+    if (block_count > blocks_.size()) {
+        for (const auto &[key, block]: blocks_) {
+            const int block_row = key / BLOCKS_PER_ROW;
+            const int block_col = key % BLOCKS_PER_ROW;
+            if (first_block_row <= block_row && block_row <= last_block_row &&
+                first_block_col <= block_col && block_col <= last_block_col) {
+                func(block_row, block_col, *block);
+            }
+        }
+        return;
+    }
+    for (int block_row = first_block_row; block_row <= last_block_row; ++block_row) {
+        for (int block_col = first_block_col; block_col <= last_block_col; ++block_col) {
+            if (const Block *block = FindBlock(BlockKey(block_row, block_col))) {
+                func(block_row, block_col, *block);
+            }
+        }
+    }
+}
+
+template<typename Visitor>
+void CellStorage::VisitRange(Position first, Position last, Visitor visitor) const {
+    auto visit_run = [&visitor](const Block &block, int col, int row, int run_end) {
+        const int col_in_block = col % BLOCK_SIZE;
+        const int row_in_block = row % BLOCK_SIZE;
+        const int size = run_end - row;
+        const std::uint64_t mask = (size == BLOCK_SIZE ? ~std::uint64_t{0} : (std::uint64_t{1} << size) - 1)
+                                   << row_in_block;
+        if ((block.valid[col_in_block].load(std::memory_order_relaxed) & mask) != mask) {
+            // значения вычисляются через ячейку и сами попадают в блок
+            for (int r = row_in_block; r < row_in_block + size; ++r) {
+                const Cell *cell = block.cells[r * BLOCK_SIZE + col_in_block];
+                if (cell) {
+                    (void) cell->GetValue();
+                }
+            }
+        }
+        visitor(&block.values[col_in_block * BLOCK_SIZE + row_in_block], static_cast<size_t>(size));
+    };
+
+    const auto block_rows = static_cast<size_t>(last.row / BLOCK_SIZE - first.row / BLOCK_SIZE + 1);
+    if (static_cast<size_t>(last.col - first.col + 1) * block_rows <= blocks_.size()) {
+        for (int col = first.col; col <= last.col; ++col) {
+            for (int row = first.row; row <= last.row;) {
+                const int run_end = std::min((row / BLOCK_SIZE + 1) * BLOCK_SIZE, last.row + 1);
+                if (const Block *block = FindBlock(BlockKey(Position{row, col}))) {
+                    visit_run(*block, col, row, run_end);
+                }
+                row = run_end;
+            }
+        }
+        return;
+    }
+
+    // В большом разреженном диапазоне занятые блоки дешевле найти перебором
+    // и упорядочить по колонкам блоков, а в колонке — сверху вниз
+    std::vector<std::pair<int, const Block *>> blocks;
+    ForEachBlockInRange(first, last, [&blocks](int block_row, int block_col, const Block &block) {
+        blocks.emplace_back(block_col * BLOCKS_PER_COL + block_row, &block);
+    });
+    std::sort(blocks.begin(), blocks.end());
+    for (size_t begin = 0, end = 0; begin < blocks.size(); begin = end) {
+        const int block_col = blocks[begin].first / BLOCKS_PER_COL;
+        while (end < blocks.size() && blocks[end].first / BLOCKS_PER_COL == block_col) {
+            ++end;
+        }
+        const int col_end = std::min(last.col + 1, (block_col + 1) * BLOCK_SIZE);
+        for (int col = std::max(first.col, block_col * BLOCK_SIZE); col < col_end; ++col) {
+            for (size_t i = begin; i < end; ++i) {
+                const int block_row = blocks[i].first % BLOCKS_PER_COL;
+                visit_run(*blocks[i].second, col, std::max(first.row, block_row * BLOCK_SIZE),
+                          std::min(last.row + 1, (block_row + 1) * BLOCK_SIZE));
+            }
+        }
+    }
+}
@@ -0,0 +1,182 @@
+#include "delimited_import.h"
+
+#include <algorithm>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+namespace {
+    // Размер куска, которым читается ввод, и число ячеек в пакете SetCells.
+    const size_t CHUNK_SIZE = 1 << 20;
+    const size_t BATCH_CELLS = 1 << 16;
+
+    // Читает ввод кусками в собственный буфер и выдаёт записи целиком, не
+    // копируя их. Перевод строки внутри поля в кавычках запись не
+    // заканчивает. Кавычки разбираются так же, как в SplitRecord: поле в
+    // кавычках открывает только кавычка в начале поля, а внутри поля
+    // удвоенная кавычка означает саму кавычку.
+    class RecordReader {
+    public:
+        RecordReader(std::istream &input, DelimitedFormat format)
+                : input_(input), delimiter_(format.delimiter), quote_(format.quote), buffer_(CHUNK_SIZE) {
+        }
+
+        // Следующая запись без завершающего перевода строки. Запись живёт до
+        // следующего вызова. Возвращает false, когда ввод закончился.
+        bool Next(std::string_view &record) {
+            while (true) {
+                const char *data = buffer_.data();
+                const auto *newline = static_cast<const char *>(std::memchr(data + scanned_, '\n', end_ - scanned_));
+                const size_t stop = newline ? newline - data : end_;
+                const size_t scanned = quote_ != '\0' ? ScanQuotes(stop, newline != nullptr) : stop;
+                if (newline && !in_quotes_) {
+                    record = Take(stop, stop + 1);
+                    return true;
+                }
+                scanned_ = newline ? stop + 1 : scanned;
+                if (!newline && !Fill()) {
+                    if (begin_ == end_) {
+                        return false;
+                    }
+                    record = Take(end_, end_);
+                    return true;
+                }
+            }
+        }
+
+    private:
+        // Обновляет in_quotes_ по кавычкам отрезка [scanned_, stop) и
+        // возвращает, докуда отрезок разобран. Кавычка в поле в конце
+        // недочитанного отрезка (complete == false) может оказаться первой
+        // половиной удвоенной, поэтому разбор останавливается перед ней.
+        size_t ScanQuotes(size_t stop, bool complete) {
+            const char *data = buffer_.data();
+            size_t i = scanned_;
+            while (true) {
+                const auto *found = static_cast<const char *>(std::memchr(data + i, quote_, stop - i));
+                if (!found) {
+                    return stop;
+                }
+                const size_t quote = found - data;
+                if (!in_quotes_) {
+                    in_quotes_ = quote == begin_ || data[quote - 1] == delimiter_;
+                    i = quote + 1;
+                } else if (quote + 1 < stop && data[quote + 1] == quote_) {
+                    i = quote + 2;
+                } else if (quote + 1 == stop && !complete) {
+                    return quote;
+                } else {
+                    in_quotes_ = false;
+                    i = quote + 1;
+                }
+            }
+        }
+
+        // Выдаёт запись [begin_, stop) без "\r" в конце, следующая запись
+        // начнётся с next.
+        std::string_view Take(size_t stop, size_t next) {
+            std::string_view record(buffer_.data() + begin_, stop - begin_);
+            if (!record.empty() && record.back() == '\r') {
+                record.remove_suffix(1);
+            }
+            begin_ = next;
+            scanned_ = next;
+            in_quotes_ = false;
+            return record;
+        }
+
+        // Сдвигает недочитанную запись в начало буфера и дочитывает ввод.
+        // Запись длиннее буфера удваивает буфер.
+        bool Fill() {
+            if (begin_ > 0) {
+                std::memmove(buffer_.data(), buffer_.data() + begin_, end_ - begin_);
+                end_ -= begin_;
+                scanned_ -= begin_;
+                begin_ = 0;
+            }
+            if (end_ == buffer_.size()) {
+                buffer_.resize(buffer_.size() * 2);
+            }
+            input_.read(buffer_.data() + end_, static_cast<std::streamsize>(buffer_.size() - end_));
+            const auto count = static_cast<size_t>(input_.gcount());
+            end_ += count;
+            return count > 0;
+        }
+
+        std::istream &input_;
+        const char delimiter_;
+        const char quote_;
+        std::vector<char> buffer_;
+        // недочитанная часть буфера [begin_, end_); до scanned_ переводов
+        // строки вне кавычек нет, и in_quotes_ описывает позицию scanned_
+        size_t begin_ = 0;
+        size_t end_ = 0;
+        size_t scanned_ = 0;
+        bool in_quotes_ = false;
+    };
+
+    size_t FindOrEnd(std::string_view text, size_t from, char c) {
+        const auto *found = static_cast<const char *>(std::memchr(text.data() + from, c, text.size() - from));
+        return found ? found - text.data() : text.size();
+    }
+
+    // Добавляет в cells непустые поля записи row.
+    void SplitRecord(std::string_view record, int row, DelimitedFormat format,
+                     std::vector<std::pair<Position, std::string>> &cells) {
+        int col = 0;
+        for (size_t begin = 0; begin <= record.size(); ++col) {
+            if (format.quote == '\0' || begin == record.size() || record[begin] != format.quote) {
+                const size_t end = FindOrEnd(record, begin, format.delimiter);
+                if (end > begin) {
+                    cells.emplace_back(Position{row, col}, std::string(record.substr(begin, end - begin)));
+                }
+                begin = end + 1;
+                continue;
+            }
+
+            // Поле в кавычках; текст после закрывающей кавычки до
+            // разделителя добавляется как есть
+            std::string field;
+            size_t i = begin + 1;
+            while (i < record.size()) {
+                const size_t quote = FindOrEnd(record, i, format.quote);
+                field.append(record, i, quote - i);
+                i = quote + 1;
+                if (i < record.size() && record[i] == format.quote) {
+                    field += format.quote;
+                    ++i;
+                } else {
+                    break;
+                }
+            }
+            i = std::min(i, record.size());
+            const size_t end = FindOrEnd(record, i, format.delimiter);
+            field.append(record, i, end - i);
+            if (!field.empty()) {
+                cells.emplace_back(Position{row, col}, std::move(field));
+            }
+            begin = end + 1;
+        }
+    }
+}  // namespace
+
+size_t ImportDelimited(Sheet &sheet, std::istream &input, DelimitedFormat format, size_t threads) {
+    RecordReader reader(input, format);
+    std::vector<std::pair<Position, std::string>> cells;
+    size_t count = 0;
+    std::string_view record;
+    for (int row = 0; reader.Next(record); ++row) {
+        SplitRecord(record, row, format, cells);
+        if (cells.size() >= BATCH_CELLS) {
+            count += cells.size();
+            sheet.SetCells(std::move(cells), threads);
+            cells.clear();
+            cells.reserve(BATCH_CELLS);
+        }
+    }
+    count += cells.size();
+    sheet.SetCells(std::move(cells), threads);
+    return count;
+}
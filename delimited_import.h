@@ -0,0 +1,31 @@
+#pragma once
+
+#include "sheet.h"
+
+#include <cstddef>
+#include <istream>
+
+// Формат текста с разделителями.
+struct DelimitedFormat {
+    char delimiter = ',';
+    // Поле, которое начинается с кавычки, может содержать разделители и
+    // переводы строк, а кавычка внутри него удваивается. '\0' — кавычек в
+    // формате нет.
+    char quote = '"';
+};
+
+inline constexpr DelimitedFormat CSV_FORMAT{',', '"'};
+inline constexpr DelimitedFormat TSV_FORMAT{'\t', '\0'};
+
+// Загружает в лист текст с разделителями, начиная с ячейки A1: запись
+// становится строкой листа, поле — ячейкой. Записи разделяются "\n" или
+// "\r\n", пустые поля ячеек не создают. Поле задаёт ячейку так же, как
+// SetCell: текст, начинающийся с FORMULA_SIGN, становится формулой, а
+// ESCAPE_SIGN в начале поля остаётся экранирующим символом текста.
+//
+// Ввод читается большими кусками и не держится в памяти целиком, а ячейки
+// задаются пакетами через Sheet::SetCells на threads потоках. При ошибке
+// бросается исключение SetCells; пакеты, загруженные до неё, остаются в
+// листе. Возвращает число заданных ячеек.
+size_t ImportDelimited(Sheet &sheet, std::istream &input, DelimitedFormat format = CSV_FORMAT,
+                       size_t threads = 1);
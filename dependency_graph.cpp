@@ -0,0 +1,198 @@
+#include "dependency_graph.h"
+
+#include <algorithm>
+#include <cstring>
+
+DependencyGraph::~DependencyGraph() {
+    Clear();
+}
+
+void DependencyGraph::AddEdge(Position from, Position to) {
+    std::uint32_t node = FindNode(from);
+    if (node == 0) {
+        node = AllocateNode(from);
+    }
+    const std::uint32_t index = node - 1;
+    List &list = nodes_[index];
+    if (list.size == list.capacity) {
+        Grow(list);
+    }
+    const std::uint32_t slot = list.size++;
+    list.Data()[slot] = Key(to);
+    if (list.indexed) {
+        slots_.emplace(SlotKey(index, Key(to)), slot);
+    }
+}
+
+void DependencyGraph::RemoveEdge(Position from, Position to) {
+    auto block_it = blocks_.find(BlockKey(from));
+    if (block_it == blocks_.end()) {
+        return;
+    }
+    std::uint32_t &head = block_it->second->heads[IndexInBlock(from)];
+    if (head == 0) {
+        return;
+    }
+    const std::uint32_t index = head - 1;
+    List &list = nodes_[index];
+    if (!list.indexed && list.size > INDEXED_SIZE) {
+        BuildIndex(index);
+    }
+    std::uint32_t *keys = list.Data();
+    const std::uint32_t key = Key(to);
+
+    std::uint32_t slot;
+    if (list.indexed) {
+        auto it = slots_.find(SlotKey(index, key));
+        if (it == slots_.end()) {
+            return;
+        }
+        slot = it->second;
+        slots_.erase(it);
+    } else {
+        // рёбра чаще удаляются вскоре после добавления, поэтому ищем с конца
+        slot = list.size;
+        while (slot > 0 && keys[slot - 1] != key) {
+            --slot;
+        }
+        if (slot == 0) {
+            return;
+        }
+        --slot;
+    }
+
+    // на место удалённого ребра переносится последнее
+    const std::uint32_t last = --list.size;
+    if (slot != last) {
+        keys[slot] = keys[last];
+        if (list.indexed) {
+            slots_[SlotKey(index, keys[slot])] = slot;
+        }
+    }
+
+    if (list.size == 0) {
+        FreeNode(index);
+        head = 0;
+        if (--block_it->second->count == 0) {
+            blocks_.erase(block_it);
+        }
+    }
+}
+
+bool DependencyGraph::HasDependents(Position pos) const {
+    return FindNode(pos) != 0;
+}
+
+bool DependencyGraph::IsEmpty() const {
+    return blocks_.empty();
+}
+
+void DependencyGraph::Rebuild(std::vector<std::pair<Position, Position>> edges) {
+    Clear();
+    std::sort(edges.begin(), edges.end(), [](const auto &lhs, const auto &rhs) {
+        return std::pair(Key(lhs.first), Key(lhs.second)) < std::pair(Key(rhs.first), Key(rhs.second));
+    });
+
+    // Первый проход считает место под длинные списки, второй раскладывает их
+    size_t arena_size = 0;
+    for (size_t begin = 0, end; begin < edges.size(); begin = end) {
+        end = begin + 1;
+        while (end < edges.size() && edges[end].first == edges[begin].first) {
+            ++end;
+        }
+        if (end - begin > INLINE_CAPACITY) {
+            arena_size += end - begin;
+        }
+    }
+    arena_.resize(arena_size);
+
+    size_t arena_offset = 0;
+    for (size_t begin = 0, end; begin < edges.size(); begin = end) {
+        end = begin + 1;
+        while (end < edges.size() && edges[end].first == edges[begin].first) {
+            ++end;
+        }
+        const auto size = static_cast<std::uint32_t>(end - begin);
+        const std::uint32_t index = AllocateNode(edges[begin].first) - 1;
+        List &list = nodes_[index];
+        if (size > INLINE_CAPACITY) {
+            list.keys = arena_.data() + arena_offset;
+            list.capacity = size;
+            list.in_arena = 1;
+            arena_offset += size;
+        }
+        std::uint32_t *keys = list.Data();
+        for (std::uint32_t i = 0; i < size; ++i) {
+            keys[i] = Key(edges[begin + i].second);
+        }
+        list.size = size;
+    }
+}
+
+void DependencyGraph::Clear() {
+    for (List &list: nodes_) {
+        ReleaseKeys(list);
+    }
+    blocks_.clear();
+    nodes_.clear();
+    free_nodes_.clear();
+    slots_.clear();
+    std::vector<std::uint32_t>().swap(arena_);
+}
+
+std::uint32_t DependencyGraph::FindNode(Position pos) const {
+    auto it = blocks_.find(BlockKey(pos));
+    if (it == blocks_.end()) {
+        return 0;
+    }
+    return it->second->heads[IndexInBlock(pos)];
+}
+
+std::uint32_t DependencyGraph::AllocateNode(Position pos) {
+    auto &block = blocks_[BlockKey(pos)];
+    if (!block) {
+        block = std::make_unique<Block>();
+    }
+    std::uint32_t index;
+    if (free_nodes_.empty()) {
+        index = static_cast<std::uint32_t>(nodes_.size());
+        nodes_.emplace_back();
+    } else {
+        index = free_nodes_.back();
+        free_nodes_.pop_back();
+    }
+    ++block->count;
+    block->heads[IndexInBlock(pos)] = index + 1;
+    return index + 1;
+}
+
+void DependencyGraph::FreeNode(std::uint32_t node) {
+    ReleaseKeys(nodes_[node]);
+    nodes_[node] = List();
+    free_nodes_.push_back(node);
+}
+
+void DependencyGraph::Grow(List &list) {
+    const std::uint32_t capacity = list.capacity * 2;
+    auto *keys = new std::uint32_t[capacity];
+    std::memcpy(keys, list.Data(), list.size * sizeof(std::uint32_t));
+    ReleaseKeys(list);
+    list.keys = keys;
+    list.capacity = capacity;
+    list.in_arena = 0;
+}
+
+void DependencyGraph::ReleaseKeys(List &list) {
+    if (!list.IsInline() && !list.in_arena) {
+        delete[] list.keys;
+    }
+}
+
+void DependencyGraph::BuildIndex(std::uint32_t node) {
+    List &list = nodes_[node];
+    const std::uint32_t *keys = list.Data();
+    for (std::uint32_t i = 0; i < list.size; ++i) {
+        slots_.emplace(SlotKey(node, keys[i]), i);
+    }
+    list.indexed = 1;
+}
@@ -0,0 +1,156 @@
+#pragma once
+
+#include "common.h"
+
+#include <array>
+#include <cstdint>
+#include <memory>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// Граф обратных зависимостей листа: для каждой ячейки хранит позиции
+// формул, которые на неё ссылаются.
+//
+// Списки зависимых лежат в общем массиве записей, а запись ячейки находится
+// по позиции через разреженные блоки BLOCK_SIZE x BLOCK_SIZE, как ячейки в
+// CellStorage. Короткий список хранится прямо в записи, длинный — в
+// отдельном массиве. Rebuild строит граф целиком: длинные списки при этом
+// лежат подряд в одном массиве, как в формате CSR.
+//
+// Для списка длиннее INDEXED_SIZE при первом удалении из него строится
+// индекс позиций, поэтому удаление ребра у ячейки, на которую ссылаются
+// тысячи формул, не просматривает весь список. Загрузка, в которой рёбра
+// только добавляются, индекс не строит.
+class DependencyGraph {
+public:
+    static const int BLOCK_SIZE = 64;
+    static const std::uint32_t INLINE_CAPACITY = 4;
+    static const std::uint32_t INDEXED_SIZE = 64;
+
+    DependencyGraph() = default;
+
+    DependencyGraph(const DependencyGraph &) = delete;
+
+    DependencyGraph &operator=(const DependencyGraph &) = delete;
+
+    ~DependencyGraph();
+
+    // Добавляет ребро: формула в позиции to ссылается на from. Такого ребра
+    // в графе быть не должно.
+    void AddEdge(Position from, Position to);
+
+    // Удаляет ребро, если оно есть.
+    void RemoveEdge(Position from, Position to);
+
+    [[nodiscard]] bool HasDependents(Position pos) const;
+
+    [[nodiscard]] bool IsEmpty() const;
+
+    // Вызывает func(dependent) для всех формул, ссылающихся на pos, в
+    // произвольном порядке. func не должна менять граф.
+    template<typename Func>
+    void ForEachDependent(Position pos, Func func) const;
+
+    // Заменяет граф графом из рёбер (from, to). Рёбра не должны повторяться.
+    // Списки выделяются сразу нужного размера.
+    void Rebuild(std::vector<std::pair<Position, Position>> edges);
+
+    void Clear();
+
+private:
+    struct List {
+        std::uint32_t size = 0;
+        std::uint32_t capacity: 30;
+        // длинный список лежит в arena_, а не в собственном массиве
+        std::uint32_t in_arena: 1;
+        // позиции списка есть в slots_
+        std::uint32_t indexed: 1;
+        union {
+            std::uint32_t inline_keys[INLINE_CAPACITY];
+            std::uint32_t *keys;
+        };
+
+        List() : capacity(INLINE_CAPACITY), in_arena(0), indexed(0) {
+        }
+
+        [[nodiscard]] bool IsInline() const {
+            return capacity == INLINE_CAPACITY;
+        }
+
+        [[nodiscard]] std::uint32_t *Data() {
+            return IsInline() ? inline_keys : keys;
+        }
+
+        [[nodiscard]] const std::uint32_t *Data() const {
+            return IsInline() ? inline_keys : keys;
+        }
+    };
+
+    struct Block {
+        // Номер записи ячейки в nodes_, увеличенный на единицу; 0 — у ячейки
+        // нет зависимых.
+        std::array<std::uint32_t, BLOCK_SIZE * BLOCK_SIZE> heads{};
+        int count = 0;
+    };
+
+    static const int BLOCKS_PER_ROW = (Position::MAX_COLS + BLOCK_SIZE - 1) / BLOCK_SIZE;
+
+    static int BlockKey(Position pos) {
+        return pos.row / BLOCK_SIZE * BLOCKS_PER_ROW + pos.col / BLOCK_SIZE;
+    }
+
+    static int IndexInBlock(Position pos) {
+        return (pos.row % BLOCK_SIZE) * BLOCK_SIZE + pos.col % BLOCK_SIZE;
+    }
+
+    static std::uint32_t Key(Position pos) {
+        return static_cast<std::uint32_t>(pos.row) * Position::MAX_COLS + static_cast<std::uint32_t>(pos.col);
+    }
+
+    static Position FromKey(std::uint32_t key) {
+        return {static_cast<int>(key / Position::MAX_COLS), static_cast<int>(key % Position::MAX_COLS)};
+    }
+
+    static std::uint64_t SlotKey(std::uint32_t node, std::uint32_t key) {
+        return std::uint64_t{node} << 32 | key;
+    }
+
+    // Возвращает номер записи ячейки в nodes_, увеличенный на единицу, или 0.
+    [[nodiscard]] std::uint32_t FindNode(Position pos) const;
+
+    // Занимает запись для ячейки pos, у которой ещё нет зависимых.
+    std::uint32_t AllocateNode(Position pos);
+
+    void FreeNode(std::uint32_t node);
+
+    static void Grow(List &list);
+
+    static void ReleaseKeys(List &list);
+
+    void BuildIndex(std::uint32_t node);
+
+    std::unordered_map<int, std::unique_ptr<Block>> blocks_;
+    std::vector<List> nodes_;
+    std::vector<std::uint32_t> free_nodes_;
+
+    // Положение позиции в индексированном списке, ключ — SlotKey(node, key).
+    std::unordered_map<std::uint64_t, std::uint32_t> slots_;
+
+    // Длинные списки, построенные Rebuild. Список, выросший после
+    // перестройки, переезжает в собственный массив.
+    std::vector<std::uint32_t> arena_;
+};
+
+template<typename Func>
+void DependencyGraph::ForEachDependent(Position pos, Func func) const {
+    const std::uint32_t node = FindNode(pos);
+    if (node == 0) {
+        return;
+    }
+    const List &list = nodes_[node - 1];
+    const std::uint32_t *keys = list.Data();
+    for (std::uint32_t i = 0; i < list.size; ++i) {
+        func(FromKey(keys[i]));
+    }
+}
@@ -2,8 +2,16 @@
 
 #include "FormulaAST.h"
 
+#include <algorithm>
+#include <charconv>
+#include <cmath>
 #include <functional>
+#include <iterator>
+#include <mutex>
+#include <optional>
 #include <sstream>
+#include <unordered_map>
+#include <utility>
 
 using namespace std::literals;
 
@@ -41,61 +49,321 @@ std::ostream &operator<<(std::ostream &output, FormulaError fe) {
 }
 
 namespace {
+    // Значение ячейки, на которую ссылается формула: пустая ячейка считается
+    // нулём, текст, не являющийся числом, даёт ошибку #VALUE!.
+    double ToOperand(double number) {
+        if (IsEmptyCellValue(number)) {
+            return 0;
+        }
+        if (IsTextCellValue(number)) {
+            return BoxFormulaError(FormulaError(FormulaError::Category::Value));
+        }
+        return number;
+    }
+
+    bool IsDigit(char c) {
+        return c >= '0' && c <= '9';
+    }
+
+    bool IsUpper(char c) {
+        return c >= 'A' && c <= 'Z';
+    }
+
+    // Строит ключ кэша: текст формулы, в котором ссылки на ячейки заменены
+    // смещениями относительно ячейки host. Формулы, отличающиеся только
+    // сдвигом, например =A1*2 в B1 и =A2*2 в B2, получают одинаковый ключ.
+    // Текст делится на лексемы по тем же правилам, что и в грамматике, поэтому
+    // одинаковые ключи означают одинаковые с точностью до сдвига формулы.
+    // Имена функций и разделители диапазонов и аргументов копируются как есть.
+    // Если в тексте есть посторонние символы или некорректные ссылки, ключ не
+    // строится и формула разбирается без кэша.
+    std::optional<std::string> MakeRelativeKey(std::string_view text, Position host) {
+        std::string key;
+        key.reserve(text.size() + 8);
+        size_t i = 0;
+        auto skip_digits = [&] {
+            while (i < text.size() && IsDigit(text[i])) {
+                ++i;
+            }
+        };
+        while (i < text.size()) {
+            const size_t start = i;
+            const char c = text[i];
+            if (IsUpper(c)) {
+                while (i < text.size() && IsUpper(text[i])) {
+                    ++i;
+                }
+                const size_t digits = i;
+                skip_digits();
+                if (digits == i) {
+                    key.append(text.substr(start, i - start));
+                    continue;
+                }
+                const Position pos = Position::FromString(text.substr(start, i - start));
+                if (!pos.IsValid()) {
+                    return std::nullopt;
+                }
+                key += '\x01';
+                key += std::to_string(pos.row - host.row);
+                key += ',';
+                key += std::to_string(pos.col - host.col);
+                key += '\x01';
+            } else if (IsDigit(c) || c == '.') {
+                skip_digits();
+                if (i < text.size() && text[i] == '.') {
+                    ++i;
+                    if (i == text.size() || !IsDigit(text[i])) {
+                        return std::nullopt;
+                    }
+                    skip_digits();
+                }
+                if (i < text.size() && (text[i] == 'e' || text[i] == 'E')) {
+                    size_t exponent = i + 1;
+                    if (exponent < text.size() && (text[exponent] == '+' || text[exponent] == '-')) {
+                        ++exponent;
+                    }
+                    if (exponent < text.size() && IsDigit(text[exponent])) {
+                        i = exponent;
+                        skip_digits();
+                    }
+                }
+                key.append(text.substr(start, i - start));
+            } else if (std::string_view("+-*/(),: \t\n\r").find(c) != std::string_view::npos) {
+                key += c;
+                ++i;
+            } else {
+                return std::nullopt;
+            }
+        }
+        return key;
+    }
+
+    // Кэш разобранных формул. Формулы, которые в сгенерированных таблицах
+    // повторяются тысячи раз, в том числе скопированные вниз по колонке,
+    // разбираются один раз и разделяют одно неизменяемое скомпилированное
+    // тело со ссылками относительно ячейки формулы. Ключом служит
+    // относительная запись текста формулы, а также её канонической записи,
+    // поэтому, например, "(A1)+1" и "A1+1" тоже разделяют одно тело. Записи
+    // хранят weak_ptr: тело живёт, пока на него ссылается хотя бы одна ячейка.
+    //
+    // Каноническая запись округляет числа до шести значащих цифр, поэтому
+    // по ней тело переиспользуется, только если совпадает и программа, а
+    // ключи текстов и канонических записей хранятся в разных таблицах:
+    // текст "1.23457" и каноническая запись "1.2345678" не должны
+    // находить друг друга.
+    class FormulaCache {
+    public:
+        std::shared_ptr<const FormulaAST> Get(std::string_view expression, Position host) {
+            expression = Trim(expression);
+            const auto key = MakeRelativeKey(expression, host);
+            if (key) {
+                std::lock_guard lock(mutex_);
+                if (auto ast = Find(texts_, *key)) {
+                    return ast;
+                }
+            }
+
+            // разбор идёт без блокировки, чтобы не мешать другим потокам
+            auto ast = std::make_shared<const FormulaAST>(ParseFormulaAST(expression, host));
+            if (!key) {
+                return ast;
+            }
+            std::ostringstream canonical;
+            ast->PrintFormula(canonical, host);
+            const auto canonical_key = MakeRelativeKey(canonical.str(), host);
+
+            std::lock_guard lock(mutex_);
+            if (canonical_key) {
+                auto existing = Find(canonicals_, *canonical_key);
+                if (existing && existing->HasSameProgram(*ast)) {
+                    ast = std::move(existing);
+                } else if (!existing) {
+                    canonicals_[*canonical_key] = ast;
+                }
+            }
+            texts_[*key] = ast;
+            PurgeExpired();
+            return ast;
+        }
+
+    private:
+        using Entries = std::unordered_map<std::string, std::weak_ptr<const FormulaAST>>;
+
+        static std::string_view Trim(std::string_view str) {
+            const auto first = str.find_first_not_of(" \t\n\r");
+            if (first == std::string_view::npos) {
+                return {};
+            }
+            const auto last = str.find_last_not_of(" \t\n\r");
+            return str.substr(first, last - first + 1);
+        }
+
+        static std::shared_ptr<const FormulaAST> Find(const Entries &entries, const std::string &key) {
+            auto it = entries.find(key);
+            return it == entries.end() ? nullptr : it->second.lock();
+        }
+
+        // Удаляет записи умерших тел, когда кэш вырос вдвое с прошлой очистки
+        void PurgeExpired() {
+            if (texts_.size() + canonicals_.size() < 2 * purge_threshold_) {
+                return;
+            }
+            for (Entries *entries: {&texts_, &canonicals_}) {
+                for (auto it = entries->begin(); it != entries->end();) {
+                    it = it->second.expired() ? entries->erase(it) : std::next(it);
+                }
+            }
+            purge_threshold_ = std::max(texts_.size() + canonicals_.size(), MIN_PURGE_THRESHOLD);
+        }
+
+        static constexpr size_t MIN_PURGE_THRESHOLD = 1024;
+
+        std::mutex mutex_;
+        // тела по тексту формулы и по её канонической записи
+        Entries texts_;
+        Entries canonicals_;
+        size_t purge_threshold_ = MIN_PURGE_THRESHOLD;
+    };
+
+    FormulaCache &GetFormulaCache() {
+        static FormulaCache cache;
+        return cache;
+    }
+
     class Formula : public FormulaInterface {
     public:
 
-        explicit Formula(const std::string &expression)
-                : ast_(ParseFormulaAST(expression)) {
+        Formula(const std::string &expression, Position host)
+                : ast_(GetFormulaCache().Get(expression, host)), host_(host) {
+        }
+
+        Formula(FormulaBody ast, Position host)
+                : ast_(std::move(ast)), host_(host) {
         }
 
         [[nodiscard]] Value Evaluate(const SheetInterface &sheet) const override {
-            using namespace std;
-            auto accessor = [&sheet](Position pos) -> double {
-                auto value = sheet.GetCell(pos)->GetValue();
-                if (std::holds_alternative<double>(value)) {
-                    return std::get<double>(value);
-                } else if (std::holds_alternative<std::string>(value)) {
-                    std::string str_value = std::get<std::string>(value);
-                    if (str_value.empty()) {
-                        return 0;
-                    }
-                    try {
-                        return std::stod(str_value);
-                    } catch (std::exception &) {
-                        throw FormulaError(FormulaError::Category::Value);
+            // лист этой программы отдаёт значения без CellInterface::Value,
+            // для прочих значения читаются через ячейки
+            const auto *source = dynamic_cast<const NumericSource *>(&sheet);
+            auto get_number = [source, &sheet](Position pos) {
+                if (source) {
+                    return source->GetNumber(pos);
+                }
+                const CellInterface *cell = sheet.GetCell(pos);
+                return cell ? GetNumericValue(cell->GetValue()) : EmptyCellValue();
+            };
+            auto accessor = [&get_number](Position pos) {
+                return ToOperand(get_number(pos));
+            };
+            auto range_accessor = [source, &get_number](Position first, Position last,
+                                                        const FormulaAST::RangeVisitor &visitor) {
+                if (source) {
+                    source->VisitRange(first, last, visitor);
+                    return;
+                }
+                std::vector<double> column(last.row - first.row + 1);
+                for (int col = first.col; col <= last.col; ++col) {
+                    for (int row = first.row; row <= last.row; ++row) {
+                        column[row - first.row] = get_number({row, col});
                     }
-                } else {
-                    throw std::get<FormulaError>(value);
+                    visitor(column.data(), column.size());
                 }
             };
-            try {
-                return ast_.Execute(accessor);
-            } catch (FormulaError &fe) {
-                return fe;
+            double result = ast_->Execute(accessor, host_, range_accessor);
+            if (IsFormulaError(result)) {
+                return UnboxFormulaError(result);
             }
+            return result;
         }
 
         [[nodiscard]] std::string GetExpression() const override {
             std::stringstream ss;
-            ast_.PrintFormula(ss);
+            ast_->PrintFormula(ss, host_);
             return ss.str();
         }
 
         [[nodiscard]] std::vector<Position> GetReferencedCells() const override {
-            auto cells = ast_.GetCells();
-            return std::vector<Position>(cells.cbegin(), cells.cend());
+            std::vector<Position> cells;
+            AppendReferencedCells(cells);
+            return cells;
+        }
+
+        void AppendReferencedCells(std::vector<Position> &cells) const override {
+            for (Position offset: ast_->GetCellReferences()) {
+                cells.push_back(Translate(offset, host_));
+            }
+        }
+
+        void AppendReferencedRanges(std::vector<CellRange> &ranges) const override {
+            for (const auto &range: ast_->GetRanges()) {
+                ranges.push_back({Translate(range.first, host_), Translate(range.last, host_)});
+            }
+        }
+
+        [[nodiscard]] const FormulaBody &GetBody() const {
+            return ast_;
         }
 
     private:
-        FormulaAST ast_;
+        std::shared_ptr<const FormulaAST> ast_;
+        Position host_;
     };
 
 }  // namespace
 
+std::optional<double> ParseNumber(std::string_view text) {
+    const auto first = text.find_first_not_of(" \t\n\r");
+    if (first == std::string_view::npos) {
+        return std::nullopt;
+    }
+    text = text.substr(first, text.find_last_not_of(" \t\n\r") - first + 1);
+    // from_chars не принимает знак плюс
+    if (text.front() == '+') {
+        text.remove_prefix(1);
+        if (text.empty() || text.front() == '-') {
+            return std::nullopt;
+        }
+    }
+    double number = 0;
+    const auto [ptr, ec] = std::from_chars(text.data(), text.data() + text.size(), number);
+    if (ec != std::errc{} || ptr != text.data() + text.size() || !std::isfinite(number)) {
+        return std::nullopt;
+    }
+    return number;
+}
+
+double GetNumericValue(const CellInterface::Value &value) {
+    if (std::holds_alternative<double>(value)) {
+        return std::get<double>(value);
+    } else if (std::holds_alternative<std::string>(value)) {
+        const std::string &str_value = std::get<std::string>(value);
+        if (str_value.empty()) {
+            return EmptyCellValue();
+        }
+        auto number = ParseNumber(str_value);
+        return number ? *number : TextCellValue();
+    } else {
+        return BoxFormulaError(std::get<FormulaError>(value));
+    }
+}
+
 std::unique_ptr<FormulaInterface> ParseFormula(const std::string &expression) {
+    return ParseFormula(expression, Position{0, 0});
+}
+
+std::unique_ptr<FormulaInterface> ParseFormula(const std::string &expression, Position host) {
     try {
-        return std::make_unique<Formula>(expression);
+        return std::make_unique<Formula>(expression, host);
     } catch (FormulaException &fe) {
         throw fe;
     }
 }
+
+FormulaBody GetFormulaBody(const FormulaInterface &formula) {
+    const auto *parsed = dynamic_cast<const Formula *>(&formula);
+    return parsed ? parsed->GetBody() : nullptr;
+}
+
+std::unique_ptr<FormulaInterface> MakeFormula(FormulaBody body, Position host) {
+    return std::make_unique<Formula>(std::move(body), host);
+}
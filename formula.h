@@ -2,9 +2,26 @@
 
 #include "common.h"
 
+#include <functional>
 #include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
 #include <vector>
 
+class FormulaAST;
+
+// Прямоугольный диапазон ячеек: first — левый верхний угол, last — правый
+// нижний.
+struct CellRange {
+    Position first;
+    Position last;
+
+    [[nodiscard]] bool Contains(Position pos) const {
+        return first.row <= pos.row && pos.row <= last.row && first.col <= pos.col && pos.col <= last.col;
+    }
+};
+
 // Формула, позволяющая вычислять и обновлять арифметическое выражение.
 // Поддерживаемые возможности:
 // * Простые бинарные операции и числа, скобки: 1+2*3, 2.5*(2+3.5/7)
@@ -30,12 +47,69 @@ public:
     // Не содержит пробелов и лишних скобок.
     [[nodiscard]] virtual std::string GetExpression() const = 0;
 
-    // Возвращает список ячеек, которые непосредственно задействованы в вычислении
-    // формулы. Список отсортирован по возрастанию и не содержит повторяющихся
-    // ячеек.
+    // Возвращает список ячеек, на которые формула ссылается по отдельности.
+    // Список отсортирован по возрастанию и не содержит повторяющихся ячеек.
+    // Диапазоны в список не разворачиваются: диапазон может покрывать весь
+    // лист, то есть сотни миллионов ячеек. Их возвращает AppendReferencedRanges.
     [[nodiscard]] virtual std::vector<Position> GetReferencedCells() const = 0;
+
+    // Дописывают в конец cells ячейки из GetReferencedCells(), а в конец
+    // ranges — диапазоны, на которые ссылается формула. Позволяют обходить
+    // ссылки многих формул в одних буферах, не выделяя память под каждый
+    // список.
+    virtual void AppendReferencedCells(std::vector<Position> &cells) const {
+        const auto refs = GetReferencedCells();
+        cells.insert(cells.end(), refs.begin(), refs.end());
+    }
+
+    virtual void AppendReferencedRanges(std::vector<CellRange> & /* ranges */) const {
+    }
+};
+
+// Лист, который отдаёт формулам значения ячеек в числовой форме, не создавая
+// CellInterface::Value. Формула пользуется им, если лист его реализует.
+// Числовая форма значения — это число, ошибка, упакованная в NaN, или одна из
+// NaN-меток пустой ячейки и текста, не представляющего число (см. FormulaAST.h).
+class NumericSource {
+public:
+    using Visitor = std::function<void(const double *values, size_t size)>;
+
+    virtual ~NumericSource() = default;
+
+    // Числовая форма значения ячейки pos.
+    virtual double GetNumber(Position pos) const = 0;
+
+    // Вызывает visitor для числовых форм значений ячеек диапазона first:last
+    // по колонкам, каждую колонку сверху вниз, возможно несколькими отрезками.
+    // Отрезки пустых ячеек можно пропускать.
+    virtual void VisitRange(Position first, Position last, const Visitor &visitor) const = 0;
 };
 
+// Число, которое представляет текст ячейки. Текст, кроме пробелов по краям,
+// должен целиком быть десятичной записью конечного числа, возможно со знаком.
+// Разбор не зависит от локали.
+std::optional<double> ParseNumber(std::string_view text);
+
+// Числовая форма значения ячейки. Пустая строка соответствует пустой ячейке.
+double GetNumericValue(const CellInterface::Value &value);
+
 // Парсит переданное выражение и возвращает объект формулы.
 // Бросает FormulaException в случае, если формула синтаксически некорректна.
 std::unique_ptr<FormulaInterface> ParseFormula(const std::string &expression);
+
+// То же для формулы, записанной в ячейке host. Ссылки хранятся относительно
+// host, поэтому формулы, скопированные в соседние ячейки, разделяют одно
+// скомпилированное тело.
+std::unique_ptr<FormulaInterface> ParseFormula(const std::string &expression, Position host);
+
+// Скомпилированное тело формулы со ссылками относительно ячейки формулы.
+// Формулы, которые отличаются только сдвигом ссылок, разделяют одно тело.
+using FormulaBody = std::shared_ptr<const FormulaAST>;
+
+// Тело формулы, созданной ParseFormula; для других формул nullptr.
+FormulaBody GetFormulaBody(const FormulaInterface &formula);
+
+// Формула с телом body в ячейке host. Совпадает с формулой, которую вернул бы
+// разбор записи этой формулы в host, но создаётся без разбора. Ссылки тела,
+// сдвинутые в host, должны оставаться в пределах листа.
+std::unique_ptr<FormulaInterface> MakeFormula(FormulaBody body, Position host);
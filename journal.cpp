@@ -0,0 +1,322 @@
+#include "journal.h"
+
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <charconv>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <system_error>
+#include <utility>
+
+#ifdef _WIN32
+#include <fcntl.h>
+#include <io.h>
+#include <sys/stat.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+namespace fs = std::filesystem;
+
+namespace {
+    const char *const SNAPSHOT_NAME = "snapshot";
+    const char *const JOURNAL_NAME = "journal";
+    // Снимок, который ещё пишется.
+    const char *const TEMP_SNAPSHOT_NAME = "snapshot.tmp";
+
+    // Запись журнала: размер и контрольная сумма данных, затем сами данные —
+    // операция, строка, колонка и текст.
+    const size_t RECORD_HEADER_SIZE = 2 * sizeof(std::uint32_t);
+    const size_t RECORD_FIXED_SIZE = 1 + 2 * sizeof(std::int32_t);
+
+    // CRC-32 с многочленом 0xEDB88320. Продолжает сумму crc предыдущих данных.
+    std::uint32_t Crc32(std::uint32_t crc, const char *data, size_t size) {
+        static const auto TABLE = [] {
+            std::array<std::uint32_t, 256> table{};
+            for (std::uint32_t i = 0; i < table.size(); ++i) {
+                std::uint32_t value = i;
+                for (int bit = 0; bit < 8; ++bit) {
+                    value = value & 1 ? 0xEDB88320u ^ (value >> 1) : value >> 1;
+                }
+                table[i] = value;
+            }
+            return table;
+        }();
+        crc = ~crc;
+        for (size_t i = 0; i < size; ++i) {
+            crc = TABLE[(crc ^ static_cast<unsigned char>(data[i])) & 0xFF] ^ (crc >> 8);
+        }
+        return ~crc;
+    }
+
+    [[noreturn]] void ThrowSystemError(const char *what) {
+        throw std::system_error(errno, std::generic_category(), what);
+    }
+
+    int OpenFile(const std::string &path, int flags) {
+#ifdef _WIN32
+        const int fd = ::_open(path.c_str(), flags | _O_BINARY, _S_IREAD | _S_IWRITE);
+#else
+        const int fd = ::open(path.c_str(), flags | O_CLOEXEC, 0644);
+#endif
+        if (fd < 0) {
+            ThrowSystemError("open");
+        }
+        return fd;
+    }
+
+    void CloseFile(int fd) {
+#ifdef _WIN32
+        ::_close(fd);
+#else
+        ::close(fd);
+#endif
+    }
+
+    // Дожидается, пока данные файла окажутся на диске.
+    void SyncDescriptor(int fd) {
+#ifdef _WIN32
+        const int result = ::_commit(fd);
+#elif defined(__linux__)
+        const int result = ::fdatasync(fd);
+#else
+        const int result = ::fsync(fd);
+#endif
+        if (result != 0) {
+            ThrowSystemError("fsync");
+        }
+    }
+
+    void SyncFile(const std::string &path) {
+        const int fd = OpenFile(path, O_WRONLY);
+        try {
+            SyncDescriptor(fd);
+        } catch (...) {
+            CloseFile(fd);
+            throw;
+        }
+        CloseFile(fd);
+    }
+
+    // Дожидается, пока на диске окажутся созданные, переименованные и
+    // удалённые файлы каталога. На Windows это делает сама файловая система.
+    void SyncDirectory(const std::string &dir) {
+#ifndef _WIN32
+        const int fd = ::open(dir.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            ThrowSystemError("open");
+        }
+        const int result = ::fsync(fd);
+        ::close(fd);
+        if (result != 0) {
+            ThrowSystemError("fsync");
+        }
+#endif
+    }
+
+    // Номер поколения в имени файла вида prefix.N; для других имён nullopt.
+    std::optional<std::uint64_t> ParseGeneration(std::string_view name, std::string_view prefix) {
+        if (name.size() <= prefix.size() + 1 || name.substr(0, prefix.size()) != prefix ||
+            name[prefix.size()] != '.') {
+            return std::nullopt;
+        }
+        name.remove_prefix(prefix.size() + 1);
+        std::uint64_t generation = 0;
+        const auto [ptr, ec] = std::from_chars(name.data(), name.data() + name.size(), generation);
+        if (ec != std::errc{} || ptr != name.data() + name.size()) {
+            return std::nullopt;
+        }
+        return generation;
+    }
+}  // namespace
+
+JournaledSheet::JournaledSheet(std::string dir, JournalOptions options)
+        : dir_(std::move(dir)), options_(options) {
+    fs::create_directories(dir_);
+    Recover();
+    OpenJournal();
+}
+
+JournaledSheet::~JournaledSheet() {
+    try {
+        Sync();
+    } catch (...) {
+        // деструктор не бросает: правки группы теряются, как при сбое
+    }
+    CloseJournal();
+}
+
+void JournaledSheet::SetCell(Position pos, std::string text) {
+    // текст нужен журналу после того, как лист примет правку
+    sheet_->SetCell(pos, text);
+    Append(Operation::Set, pos, text);
+}
+
+const CellInterface *JournaledSheet::GetCell(Position pos) const {
+    return sheet_->GetCell(pos);
+}
+
+CellInterface *JournaledSheet::GetCell(Position pos) {
+    return sheet_->GetCell(pos);
+}
+
+void JournaledSheet::ClearCell(Position pos) {
+    sheet_->ClearCell(pos);
+    Append(Operation::Clear, pos, {});
+}
+
+Size JournaledSheet::GetPrintableSize() const {
+    return sheet_->GetPrintableSize();
+}
+
+void JournaledSheet::PrintValues(std::ostream &output) const {
+    sheet_->PrintValues(output);
+}
+
+void JournaledSheet::PrintTexts(std::ostream &output) const {
+    sheet_->PrintTexts(output);
+}
+
+const Sheet &JournaledSheet::GetSheet() const {
+    return *sheet_;
+}
+
+void JournaledSheet::Sync() {
+    if (pending_edits_ == 0) {
+        return;
+    }
+    buffer_->Flush();
+    if (options_.sync) {
+        SyncDescriptor(fd_);
+    }
+    pending_edits_ = 0;
+}
+
+void JournaledSheet::Checkpoint() {
+    Sync();
+    // Снимок получает своё имя, только когда записан целиком. После этого
+    // поколением считается новое, и журнал прошлого больше не нужен
+    const std::string temp_path = (fs::path(dir_) / TEMP_SNAPSHOT_NAME).string();
+    {
+        std::ofstream output(temp_path, std::ios::binary | std::ios::trunc);
+        sheet_->SaveSnapshot(output);
+    }
+    if (options_.sync) {
+        SyncFile(temp_path);
+    }
+    const std::uint64_t previous = generation_;
+    fs::rename(temp_path, GetPath(SNAPSHOT_NAME, previous + 1));
+    CloseJournal();
+    generation_ = previous + 1;
+    journal_edits_ = 0;
+    OpenJournal();
+    fs::remove(GetPath(JOURNAL_NAME, previous));
+    fs::remove(GetPath(SNAPSHOT_NAME, previous));
+}
+
+std::string JournaledSheet::GetPath(const char *name, std::uint64_t generation) const {
+    return (fs::path(dir_) / (std::string(name) + "." + std::to_string(generation))).string();
+}
+
+void JournaledSheet::Recover() {
+    // Поколение 0 начинается с пустого листа и снимка не имеет
+    std::vector<std::string> names;
+    for (const auto &entry: fs::directory_iterator(dir_)) {
+        names.push_back(entry.path().filename().string());
+        if (auto generation = ParseGeneration(names.back(), SNAPSHOT_NAME)) {
+            generation_ = std::max(generation_, *generation);
+        }
+    }
+    sheet_ = generation_ > 0 ? Sheet::LoadSnapshot(GetPath(SNAPSHOT_NAME, generation_)) : std::make_unique<Sheet>();
+
+    const std::string journal_path = GetPath(JOURNAL_NAME, generation_);
+    std::ifstream input(journal_path, std::ios::binary);
+    if (input) {
+        const std::vector<char> data((std::istreambuf_iterator<char>(input)), std::istreambuf_iterator<char>());
+        input.close();
+        size_t offset = 0;
+        while (data.size() - offset >= RECORD_HEADER_SIZE + RECORD_FIXED_SIZE) {
+            std::uint32_t size;
+            std::uint32_t crc;
+            std::memcpy(&size, data.data() + offset, sizeof(size));
+            std::memcpy(&crc, data.data() + offset + sizeof(size), sizeof(crc));
+            const char *payload = data.data() + offset + RECORD_HEADER_SIZE;
+            if (size < RECORD_FIXED_SIZE || size > data.size() - offset - RECORD_HEADER_SIZE ||
+                Crc32(0, payload, size) != crc) {
+                break;
+            }
+            const auto operation = static_cast<Operation>(payload[0]);
+            std::int32_t row;
+            std::int32_t col;
+            std::memcpy(&row, payload + 1, sizeof(row));
+            std::memcpy(&col, payload + 1 + sizeof(row), sizeof(col));
+            if (operation == Operation::Set) {
+                sheet_->SetCell({row, col}, std::string(payload + RECORD_FIXED_SIZE, size - RECORD_FIXED_SIZE));
+            } else if (operation == Operation::Clear) {
+                sheet_->ClearCell({row, col});
+            } else {
+                break;
+            }
+            offset += RECORD_HEADER_SIZE + size;
+            ++journal_edits_;
+        }
+        if (offset < data.size()) {
+            // запись, недописанная при сбое, и всё после неё
+            fs::resize_file(journal_path, offset);
+        }
+    }
+
+    for (const std::string &name: names) {
+        const auto snapshot = ParseGeneration(name, SNAPSHOT_NAME);
+        const auto journal = ParseGeneration(name, JOURNAL_NAME);
+        if ((snapshot && *snapshot != generation_) || (journal && *journal != generation_) ||
+            name == TEMP_SNAPSHOT_NAME) {
+            fs::remove(fs::path(dir_) / name);
+        }
+    }
+}
+
+void JournaledSheet::OpenJournal() {
+    fd_ = OpenFile(GetPath(JOURNAL_NAME, generation_), O_WRONLY | O_CREAT | O_APPEND);
+    if (options_.sync) {
+        SyncDirectory(dir_);
+    }
+    buffer_.emplace(buffer_storage_, fd_);
+}
+
+void JournaledSheet::CloseJournal() {
+    if (fd_ < 0) {
+        return;
+    }
+    buffer_.reset();
+    CloseFile(fd_);
+    fd_ = -1;
+}
+
+void JournaledSheet::Append(Operation operation, Position pos, std::string_view text) {
+    char record[RECORD_HEADER_SIZE + RECORD_FIXED_SIZE];
+    char *payload = record + RECORD_HEADER_SIZE;
+    payload[0] = static_cast<char>(operation);
+    const std::int32_t row = pos.row;
+    const std::int32_t col = pos.col;
+    std::memcpy(payload + 1, &row, sizeof(row));
+    std::memcpy(payload + 1 + sizeof(row), &col, sizeof(col));
+    const auto size = static_cast<std::uint32_t>(RECORD_FIXED_SIZE + text.size());
+    const std::uint32_t crc = Crc32(Crc32(0, payload, RECORD_FIXED_SIZE), text.data(), text.size());
+    std::memcpy(record, &size, sizeof(size));
+    std::memcpy(record + sizeof(size), &crc, sizeof(crc));
+
+    buffer_->Write({record, sizeof(record)});
+    buffer_->Write(text);
+    ++journal_edits_;
+    if (++pending_edits_ >= options_.group_size) {
+        Sync();
+    }
+    if (options_.checkpoint_edits > 0 && journal_edits_ >= options_.checkpoint_edits) {
+        Checkpoint();
+    }
+}
@@ -0,0 +1,114 @@
+#pragma once
+
+#include "common.h"
+#include "output_buffer.h"
+#include "sheet.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+struct JournalOptions {
+    // Правки фиксируются группами: записи копятся в буфере и уходят в журнал
+    // одной записью с одним fsync, когда их набирается group_size.
+    size_t group_size = 1024;
+    // После стольких правок в журнале делается снимок листа, и журнал
+    // начинается заново. 0 — снимки делаются только вызовом Checkpoint.
+    size_t checkpoint_edits = 1 << 20;
+    // Без fsync зафиксированные правки переживают падение процесса, но не
+    // сбой системы.
+    bool sync = true;
+};
+
+// Лист, правки которого записываются в журнал в каталоге dir. Журнал
+// дополняется только в конец: запись хранит операцию SetCell или ClearCell,
+// позицию и текст и защищена контрольной суммой. Правка попадает в журнал
+// после того, как её принял лист, поэтому отвергнутые правки не пишутся.
+//
+// Правка становится устойчивой к сбою при фиксации своей группы или при
+// вызове Sync; правки незафиксированной группы при сбое теряются. Время от
+// времени лист целиком сохраняется в снимок (см. Sheet::SaveSnapshot), после
+// чего журнал начинается заново, поэтому восстановление загружает последний
+// снимок и проигрывает только правки после него. Снимок и журнал одного
+// поколения называются snapshot.N и journal.N; снимок появляется под своим
+// именем только записанным целиком, а файлы прошлого поколения удаляются
+// после этого.
+//
+// Ошибки ввода-вывода бросают std::system_error, повреждённый снимок —
+// SnapshotError.
+class JournaledSheet : public SheetInterface {
+public:
+    // Открывает лист в каталоге dir, создавая каталог при необходимости.
+    // Недописанная при сбое запись в конце журнала отбрасывается.
+    explicit JournaledSheet(std::string dir, JournalOptions options = {});
+
+    JournaledSheet(const JournaledSheet &) = delete;
+
+    JournaledSheet &operator=(const JournaledSheet &) = delete;
+
+    // Фиксирует накопленные правки.
+    ~JournaledSheet() override;
+
+    void SetCell(Position pos, std::string text) override;
+
+    [[nodiscard]] const CellInterface *GetCell(Position pos) const override;
+
+    CellInterface *GetCell(Position pos) override;
+
+    void ClearCell(Position pos) override;
+
+    [[nodiscard]] Size GetPrintableSize() const override;
+
+    void PrintValues(std::ostream &output) const override;
+
+    void PrintTexts(std::ostream &output) const override;
+
+    // Лист только для чтения; правки должны идти через журнал.
+    [[nodiscard]] const Sheet &GetSheet() const;
+
+    // Фиксирует накопленные правки, не дожидаясь заполнения группы.
+    void Sync();
+
+    // Сохраняет лист в снимок следующего поколения и начинает новый журнал.
+    void Checkpoint();
+
+private:
+    enum class Operation : std::uint8_t {
+        Set,
+        Clear,
+    };
+
+    [[nodiscard]] std::string GetPath(const char *name, std::uint64_t generation) const;
+
+    // Находит последнее поколение, загружает его снимок, проигрывает журнал
+    // и удаляет файлы других поколений.
+    void Recover();
+
+    // Открывает журнал текущего поколения на дозапись.
+    void OpenJournal();
+
+    void CloseJournal();
+
+    // Дописывает правку в буфер и фиксирует группу, если она набралась.
+    void Append(Operation operation, Position pos, std::string_view text);
+
+    const std::string dir_;
+    const JournalOptions options_;
+
+    // Лист создаётся загрузкой снимка, поэтому хранится по указателю.
+    std::unique_ptr<Sheet> sheet_;
+
+    std::uint64_t generation_ = 0;
+    int fd_ = -1;
+    // Буфер записей журнала, см. OutputBuffer.
+    std::vector<char> buffer_storage_;
+    std::optional<OutputBuffer> buffer_;
+    // Правки в буфере, ещё не зафиксированные, и правки в журнале поколения.
+    size_t pending_edits_ = 0;
+    size_t journal_edits_ = 0;
+};
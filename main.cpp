@@ -1,5 +1,28 @@
+#include "FormulaAST.h"
 #include "common.h"
+#include "delimited_import.h"
+#include "dependency_graph.h"
+#include "journal.h"
+#include "profile.h"
+#include "sheet.h"
+#include "snapshot.h"
 #include "test_runner_p.h"
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <random>
+#include <set>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+#include <tuple>
 
 inline std::ostream& operator<<(std::ostream& output, Position pos) {
     return output << "(" << pos.row << ", " << pos.col << ")";
@@ -100,14 +123,1885 @@ namespace {
         ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{2, 1}));
     }
 
+    void TestPrintFormatting() {
+        Sheet sheet;
+        const std::vector<std::string> texts = {
+                "=0.1+0.2", "=1/3", "=-2/3", "=1e20", "=123456789", "=1234567", "=100000", "=0.00001", "=-0",
+                "=1e-300/3", "=1/0", "=B1+Z100", "'=escaped", "'", "text", "", "=A1*1e300*1e10", "=5e-324",
+        };
+        for (size_t i = 0; i < texts.size(); ++i) {
+            sheet.SetCell(Position{int(i / 5), int(i % 5 * 2)}, texts[i]);
+        }
+        // Печать по одной ячейке через поток, как раньше
+        auto print_per_cell = [&sheet](std::ostream &output) {
+            const Size size = sheet.GetPrintableSize();
+            for (int row = 0; row < size.rows; ++row) {
+                for (int col = 0; col < size.cols; ++col) {
+                    if (col > 0) {
+                        output << '\t';
+                    }
+                    if (const CellInterface *cell = sheet.GetCell(Position{row, col})) {
+                        std::visit([&output](const auto &value) { output << value; }, cell->GetValue());
+                    }
+                }
+                output << '\n';
+            }
+        };
+
+        std::ostringstream expected;
+        print_per_cell(expected);
+        std::ostringstream values;
+        sheet.PrintValues(values);
+        ASSERT_EQUAL(values.str(), expected.str());
+
+        // точность и флаги потока учитываются
+        for (auto format: {std::ios_base::fmtflags{}, std::ios_base::fixed, std::ios_base::scientific}) {
+            for (int precision: {0, 3, 17, 30}) {
+                std::ostringstream expected_custom;
+                expected_custom.setf(format, std::ios_base::floatfield);
+                expected_custom.precision(precision);
+                print_per_cell(expected_custom);
+                std::ostringstream custom;
+                custom.setf(format, std::ios_base::floatfield);
+                custom.precision(precision);
+                sheet.PrintValues(custom);
+                ASSERT_EQUAL(custom.str(), expected_custom.str());
+            }
+        }
+
+        // вывод в файловый дескриптор, в том числе больше буфера
+        for (int row = 10; row < 2000; ++row) {
+            sheet.SetCell(Position{row, 0}, "=" + std::to_string(row) + "/7");
+            sheet.SetCell(Position{row, 3}, std::string(200, 'x'));
+        }
+        std::ostringstream expected_texts;
+        sheet.PrintTexts(expected_texts);
+        std::ostringstream expected_values;
+        print_per_cell(expected_values);
+        for (bool print_values: {false, true}) {
+            std::FILE *file = std::tmpfile();
+            ASSERT(file);
+            if (print_values) {
+                sheet.PrintValues(fileno(file));
+            } else {
+                sheet.PrintTexts(fileno(file));
+            }
+            std::rewind(file);
+            std::string written;
+            char chunk[4096];
+            for (size_t size; (size = std::fread(chunk, 1, sizeof(chunk), file)) > 0;) {
+                written.append(chunk, size);
+            }
+            std::fclose(file);
+            ASSERT_EQUAL(written, print_values ? expected_values.str() : expected_texts.str());
+        }
+    }
+
+    void TestParallelPrint() {
+        // Широкая редкая таблица делится на много полос и на несколько групп полос
+        auto fill = [](Sheet &sheet) {
+            sheet.SetCell(Position{0, 63}, "wide");
+            for (int row = 0; row < 5000; ++row) {
+                const std::string n = std::to_string(row + 1);
+                sheet.SetCell(Position{row, 0}, std::to_string(row % 10) + ".5");
+                sheet.SetCell(Position{row, 1 + row % 30}, "=A" + n + "/7");
+                sheet.SetCell(Position{row, 40}, row % 3 ? "'=text" : "=1/(A" + n + "-0.5)");
+            }
+        };
+        Sheet sequential;
+        fill(sequential);
+        std::ostringstream expected;
+        sequential.PrintValues(expected);
+
+        Sheet parallel;
+        fill(parallel);
+        std::ostringstream values;
+        parallel.PrintValues(values, 3);
+        ASSERT_EQUAL(values.str(), expected.str());
+        ASSERT(!static_cast<const Cell *>(parallel.GetCell("B1"_pos))->IsDirty());
+
+        for (auto format: {std::ios_base::fmtflags{}, std::ios_base::fixed}) {
+            std::ostringstream expected_custom;
+            expected_custom.setf(format, std::ios_base::floatfield);
+            expected_custom.precision(12);
+            sequential.PrintValues(expected_custom);
+            std::ostringstream custom;
+            custom.setf(format, std::ios_base::floatfield);
+            custom.precision(12);
+            parallel.PrintValues(custom, 2);
+            ASSERT_EQUAL(custom.str(), expected_custom.str());
+        }
+
+        std::FILE *file = std::tmpfile();
+        ASSERT(file);
+        parallel.PrintValues(fileno(file), 2);
+        std::rewind(file);
+        std::string written;
+        char chunk[4096];
+        for (size_t size; (size = std::fread(chunk, 1, sizeof(chunk), file)) > 0;) {
+            written.append(chunk, size);
+        }
+        std::fclose(file);
+        ASSERT_EQUAL(written, expected.str());
+    }
+
+    void TestSparseStorage() {
+        auto sheet = CreateSheet();
+        const Position far{Position::MAX_ROWS - 1, Position::MAX_COLS - 1};
+
+        sheet->SetCell("Z16000"_pos, "far");
+        sheet->SetCell(far, "=Z16000");
+        ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{Position::MAX_ROWS, Position::MAX_COLS}));
+        ASSERT_EQUAL(sheet->GetCell(far)->GetText(), "=Z16000");
+        ASSERT(sheet->GetCell("A1"_pos) == nullptr);
+
+        sheet->ClearCell(far);
+        ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{16000, 26}));
+        sheet->ClearCell("Z16000"_pos);
+        ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{0, 0}));
+
+        sheet->SetCell("C1"_pos, "x");
+        sheet->SetCell("A70"_pos, "y");
+        std::ostringstream texts;
+        sheet->PrintTexts(texts);
+        std::string expected = "\t\tx\n";
+        for (int row = 1; row < 69; ++row) {
+            expected += "\t\t\n";
+        }
+        expected += "y\t\t\n";
+        ASSERT_EQUAL(texts.str(), expected);
+    }
+
+    void TestPrintableSizeAfterClear() {
+        auto sheet = CreateSheet();
+        sheet->SetCell("A1"_pos, "a");
+        sheet->SetCell("C5"_pos, "b");
+        sheet->SetCell("E2"_pos, "c");
+        ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{5, 5}));
+
+        sheet->ClearCell("E2"_pos);
+        ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{5, 3}));
+        sheet->ClearCell("C5"_pos);
+        ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{1, 1}));
+        sheet->ClearCell("C5"_pos);
+        ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{1, 1}));
+        sheet->ClearCell("A1"_pos);
+        ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{0, 0}));
+
+        // Пустая ячейка, на которую ссылается формула, остаётся в листе, но
+        // в печатную область не входит
+        sheet->SetCell("A1"_pos, "=B5");
+        sheet->SetCell("B5"_pos, "x");
+        ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{5, 2}));
+        sheet->ClearCell("B5"_pos);
+        ASSERT(sheet->GetCell("B5"_pos) != nullptr);
+        ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{1, 1}));
+        sheet->SetCell("A1"_pos, "=C7+SUM(D2:D3)");
+        ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{1, 1}));
+        sheet->SetCell("C7"_pos, "");
+        ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{1, 1}));
+    }
+
+    void TestFormulaEvaluation() {
+        auto sheet = CreateSheet();
+        auto evaluate = [&](std::string expression) {
+            sheet->SetCell("A1"_pos, std::move(expression));
+            return sheet->GetCell("A1"_pos)->GetValue();
+        };
+
+        ASSERT_EQUAL(std::get<double>(evaluate("=1+2*3")), 7.0);
+        ASSERT_EQUAL(std::get<double>(evaluate("=(1+2)*3")), 9.0);
+        ASSERT_EQUAL(std::get<double>(evaluate("=-2*-(3-5)/4")), -1.0);
+        ASSERT_EQUAL(std::get<double>(evaluate("=+1-2-3")), -4.0);
+        ASSERT_EQUAL(std::get<double>(evaluate("=2/4/2")), 0.25);
+
+        sheet->SetCell("B1"_pos, "2");
+        sheet->SetCell("B2"_pos, "'3");
+        sheet->SetCell("B3"_pos, "=B1*B2");
+        sheet->SetCell("B4"_pos, "text");
+        ASSERT_EQUAL(std::get<double>(evaluate("=B1+B2*B3+C1")), 20.0);
+        ASSERT_EQUAL(std::get<FormulaError>(evaluate("=B1/(B2-3)")),
+                     FormulaError(FormulaError::Category::Div0));
+        ASSERT_EQUAL(std::get<FormulaError>(evaluate("=B4+1")),
+                     FormulaError(FormulaError::Category::Value));
+
+        ASSERT_EQUAL(std::get<FormulaError>(evaluate("=B4/0")),
+                     FormulaError(FormulaError::Category::Div0));
+        ASSERT_EQUAL(std::get<FormulaError>(evaluate("=1/0+B4")),
+                     FormulaError(FormulaError::Category::Value));
+        ASSERT_EQUAL(std::get<FormulaError>(evaluate("=-(B4*2)")),
+                     FormulaError(FormulaError::Category::Value));
+
+        sheet->SetCell("C2"_pos, "=1/0");
+        ASSERT_EQUAL(std::get<FormulaError>(evaluate("=B1+C2*2")),
+                     FormulaError(FormulaError::Category::Div0));
+
+        sheet->SetCell("B1"_pos, "5");
+        ASSERT_EQUAL(std::get<double>(sheet->GetCell("B3"_pos)->GetValue()), 15.0);
+
+        ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetText(), "=B1+C2*2");
+        sheet->SetCell("A1"_pos, "=((B1))+(-(B2)) * 2");
+        ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetText(), "=B1+-B2*2");
+        ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetReferencedCells(), (std::vector<Position>{"B1"_pos, "B2"_pos}));
+    }
+
+    void TestLongDependencyChain() {
+        const int length = 100000;
+        const int rows = 10000;
+        auto position = [rows](int i) {
+            return Position{i % rows, i / rows};
+        };
+
+        Sheet sheet;
+        // заполняем с конца, чтобы каждая формула ссылалась на ещё пустую ячейку
+        for (int i = length - 1; i > 0; --i) {
+            sheet.SetCell(position(i), "=" + position(i - 1).ToString() + "+1");
+        }
+        sheet.SetCell(position(0), "1");
+        ASSERT_EQUAL(std::get<double>(sheet.GetCell(position(length - 1))->GetValue()), double(length));
+
+        sheet.SetCell(position(0), "2");
+        ASSERT_EQUAL(sheet.GetInvalidatedCount(), size_t(length - 1));
+        sheet.RecalculateAll();
+        ASSERT(!static_cast<const Cell *>(sheet.GetCell(position(length / 2)))->IsDirty());
+        ASSERT_EQUAL(std::get<double>(sheet.GetCell(position(length - 1))->GetValue()), double(length + 1));
+
+        // цикл через всю цепочку находится без рекурсии
+        try {
+            sheet.SetCell(position(0), "=" + position(length - 1).ToString());
+            ASSERT(false);
+        } catch (const CircularDependencyException &) {
+        }
+        ASSERT_EQUAL(sheet.GetCell(position(0))->GetText(), "2");
+    }
+
+    void TestCircularDependency() {
+        auto sheet = CreateSheet();
+        for (const std::string text: {"=A1", "=B1+A1", "=SUM(A1:B2)"}) {
+            try {
+                sheet->SetCell("A1"_pos, text);
+                ASSERT(false);
+            } catch (const CircularDependencyException &) {
+            }
+        }
+
+        // Случайные правки малого листа сверяются с наивным обходом ссылок
+        const int size = 5;
+        std::mt19937 random(42);
+        auto reaches = [&sheet](Position from, Position to) {
+            std::vector<Position> stack{from};
+            std::set<Position> visited;
+            while (!stack.empty()) {
+                const Position pos = stack.back();
+                stack.pop_back();
+                if (pos == to) {
+                    return true;
+                }
+                const CellInterface *cell = sheet->GetCell(pos);
+                if (cell && visited.insert(pos).second) {
+                    for (Position ref: cell->GetReferencedCells()) {
+                        stack.push_back(ref);
+                    }
+                }
+            }
+            return false;
+        };
+        for (int i = 0; i < 3000; ++i) {
+            const Position pos{int(random() % size), int(random() % size)};
+            std::string text = "=1";
+            std::vector<Position> refs;
+            for (int n = random() % 4; n > 0; --n) {
+                refs.push_back(Position{int(random() % size), int(random() % size)});
+                text += "+" + refs.back().ToString();
+            }
+            if (random() % 5 == 0) {
+                text = random() % 2 ? "1" : "";
+                refs.clear();
+            }
+            const bool cycle = std::any_of(refs.begin(), refs.end(), [&](Position ref) { return reaches(ref, pos); });
+            try {
+                sheet->SetCell(pos, text);
+                ASSERT(!cycle);
+            } catch (const CircularDependencyException &) {
+                ASSERT(cycle);
+            }
+
+            // каждая формула стоит в топологическом порядке после формул,
+            // на которые ссылается
+            for (int row = 0; row < size; ++row) {
+                for (int col = 0; col < size; ++col) {
+                    const auto *cell = static_cast<const Cell *>(sheet->GetCell(Position{row, col}));
+                    if (!cell || !cell->GetFormula()) {
+                        continue;
+                    }
+                    for (Position ref: cell->GetReferencedCells()) {
+                        const auto *ref_cell = static_cast<const Cell *>(sheet->GetCell(ref));
+                        ASSERT(!ref_cell->GetFormula() || ref_cell->GetFormula()->order < cell->GetFormula()->order);
+                    }
+                }
+            }
+        }
+    }
+
+    void TestInvalidationCount() {
+        // Ромбовидная решётка: к ячейке ведёт много путей от первой строки,
+        // но сбрасывается она один раз
+        const int rows = 60;
+        const int cols = 40;
+        Sheet sheet;
+        for (int col = 0; col < cols; ++col) {
+            sheet.SetCell(Position{0, col}, "1");
+        }
+        for (int row = 1; row < rows; ++row) {
+            for (int col = 0; col < cols; ++col) {
+                const Position right{row - 1, std::min(col + 1, cols - 1)};
+                sheet.SetCell(Position{row, col}, "=" + Position{row - 1, col}.ToString() + "+" + right.ToString());
+            }
+        }
+        sheet.RecalculateAll();
+        ASSERT_EQUAL(std::get<double>(sheet.GetCell(Position{10, 0})->GetValue()), 1024.0);
+
+        // от последней колонки первой строки зависят ячейки с col + row >= cols - 1
+        size_t expected = 0;
+        for (int row = 1; row < rows; ++row) {
+            expected += std::min(row + 1, cols);
+        }
+        sheet.SetCell(Position{0, cols - 1}, "2");
+        ASSERT_EQUAL(sheet.GetInvalidatedCount(), expected);
+        sheet.SetCell(Position{0, cols - 1}, "3");
+        ASSERT_EQUAL(sheet.GetInvalidatedCount(), 0u);
+        sheet.SetCell(Position{0, cols - 1}, "3");
+        ASSERT_EQUAL(sheet.GetInvalidatedCount(), 0u);
+
+        ASSERT_EQUAL(std::get<double>(sheet.GetCell(Position{1, cols - 1})->GetValue()), 6.0);
+        sheet.ClearCell(Position{0, cols - 1});
+        ASSERT_EQUAL(sheet.GetInvalidatedCount(), 1u);
+    }
+
+    void TestSetCells() {
+        Sheet sheet;
+        // формула может ссылаться на ячейку, заданную дальше в пакете
+        sheet.SetCells({{"A1"_pos, "=B1+1"}, {"B1"_pos, "2"}, {"C1"_pos, "=A1*2"}, {"A2"_pos, "1"}, {"A2"_pos, "5"}});
+        ASSERT_EQUAL(std::get<double>(sheet.GetCell("C1"_pos)->GetValue()), 6.0);
+        ASSERT_EQUAL(sheet.GetCell("A2"_pos)->GetText(), "5");
+
+        sheet.SetCells({{"B1"_pos, "10"}, {"A2"_pos, "5"}});
+        ASSERT_EQUAL(sheet.GetInvalidatedCount(), 2u);
+        ASSERT_EQUAL(std::get<double>(sheet.GetCell("C1"_pos)->GetValue()), 22.0);
+
+        // при ошибке лист не меняется
+        auto check_unchanged = [&sheet] {
+            ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{2, 3}));
+            ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetText(), "10");
+            ASSERT(!sheet.GetCell("D1"_pos));
+        };
+        try {
+            sheet.SetCells({{"D1"_pos, "=E1"}, {"E1"_pos, "=D1"}});
+            ASSERT(false);
+        } catch (const CircularDependencyException &) {
+        }
+        check_unchanged();
+        try {
+            sheet.SetCells({{"D1"_pos, "1"}, {"B1"_pos, "=C1"}});
+            ASSERT(false);
+        } catch (const CircularDependencyException &) {
+        }
+        check_unchanged();
+        try {
+            sheet.SetCells({{"D1"_pos, "1"}, {"B1"_pos, "=1+"}});
+            ASSERT(false);
+        } catch (const FormulaException &) {
+        }
+        check_unchanged();
+        try {
+            sheet.SetCells({{"D1"_pos, "1"}, {Position{-1, 0}, "1"}});
+            ASSERT(false);
+        } catch (const InvalidPositionException &) {
+        }
+        check_unchanged();
+
+        // проверяется итоговый граф, поэтому пакет может разорвать цикл и
+        // одновременно замкнуть ссылку в обратную сторону
+        sheet.SetCells({{"B1"_pos, "=C1"}, {"A1"_pos, "3"}});
+        ASSERT_EQUAL(std::get<double>(sheet.GetCell("B1"_pos)->GetValue()), 6.0);
+
+        // Случайные пакеты сверяются с листом, заполненным по одной ячейке:
+        // ячейки без цикла можно задать в любом порядке, а при цикле одна из
+        // них будет отвергнута
+        const int size = 5;
+        std::mt19937 random(7);
+        Sheet batched;
+        for (int i = 0; i < 500; ++i) {
+            std::vector<std::pair<Position, std::string>> cells;
+            for (int n = 1 + random() % 5; n > 0; --n) {
+                std::string text = random() % 4 ? "=1" : std::to_string(random() % 10);
+                if (text.front() == '=') {
+                    for (int refs = random() % 3; refs > 0; --refs) {
+                        text += "+" + Position{int(random() % size), int(random() % size)}.ToString();
+                    }
+                }
+                if (random() % 6 == 0) {
+                    text.clear();
+                }
+                cells.emplace_back(Position{int(random() % size), int(random() % size)}, text);
+            }
+
+            std::vector<std::string> texts_before;
+            std::map<Position, std::string> expected;
+            for (int row = 0; row < size; ++row) {
+                for (int col = 0; col < size; ++col) {
+                    const CellInterface *cell = batched.GetCell(Position{row, col});
+                    texts_before.push_back(cell ? cell->GetText() : "");
+                    expected[Position{row, col}] = texts_before.back();
+                }
+            }
+            for (const auto &[pos, text]: cells) {
+                expected[pos] = text;
+            }
+            Sheet reference;
+            bool cycle = false;
+            try {
+                for (const auto &[pos, text]: expected) {
+                    reference.SetCell(pos, text);
+                }
+            } catch (const CircularDependencyException &) {
+                cycle = true;
+            }
+
+            try {
+                batched.SetCells(cells);
+                ASSERT(!cycle);
+            } catch (const CircularDependencyException &) {
+                ASSERT(cycle);
+            }
+            for (int row = 0; row < size; ++row) {
+                for (int col = 0; col < size; ++col) {
+                    const Position pos{row, col};
+                    const CellInterface *cell = batched.GetCell(pos);
+                    const std::string text = cell ? cell->GetText() : "";
+                    if (cycle) {
+                        ASSERT_EQUAL(text, texts_before[row * size + col]);
+                        continue;
+                    }
+                    const CellInterface *reference_cell = reference.GetCell(pos);
+                    ASSERT_EQUAL(text, reference_cell ? reference_cell->GetText() : "");
+                    if (cell) {
+                        ASSERT_EQUAL(cell->GetValue(), reference_cell->GetValue());
+                    }
+                    const auto *formula = cell ? static_cast<const Cell *>(cell)->GetFormula() : nullptr;
+                    if (!formula) {
+                        continue;
+                    }
+                    for (Position ref: cell->GetReferencedCells()) {
+                        const auto *ref_formula = static_cast<const Cell *>(batched.GetCell(ref))->GetFormula();
+                        ASSERT(!ref_formula || ref_formula->order < formula->order);
+                    }
+                }
+            }
+        }
+    }
+
+    void TestClearReferencedCell() {
+        auto sheet = CreateSheet();
+        sheet->SetCell("A1"_pos, "=B1*2");
+        sheet->SetCell("B1"_pos, "=C1");
+        sheet->SetCell("C1"_pos, "4");
+        ASSERT_EQUAL(std::get<double>(sheet->GetCell("A1"_pos)->GetValue()), 8.0);
+
+        sheet->ClearCell("C1"_pos);
+        ASSERT_EQUAL(sheet->GetCell("C1"_pos)->GetText(), "");
+        ASSERT_EQUAL(std::get<double>(sheet->GetCell("A1"_pos)->GetValue()), 0.0);
+
+        sheet->ClearCell("A1"_pos);
+        ASSERT(sheet->GetCell("A1"_pos) == nullptr);
+        sheet->SetCell("C1"_pos, "5");
+        ASSERT_EQUAL(std::get<double>(sheet->GetCell("B1"_pos)->GetValue()), 5.0);
+    }
+
+    void TestParallelRecalculation() {
+        auto fill = [](Sheet &sheet) {
+            for (int row = 0; row < 200; ++row) {
+                const std::string n = std::to_string(row + 1);
+                sheet.SetCell(Position{row, 0}, std::to_string(row));
+                sheet.SetCell(Position{row, 1}, "=A" + n + "*2");
+                sheet.SetCell(Position{row, 2}, "=B" + n + "+A1");
+                sheet.SetCell(Position{row, 3}, row % 7 ? "=C" + n + "/B" + n : "=1/A1");
+            }
+        };
+        Sheet sequential;
+        fill(sequential);
+        Sheet parallel;
+        fill(parallel);
+
+        parallel.RecalculateAll(4);
+        for (int row = 0; row < 200; ++row) {
+            for (int col = 0; col < 4; ++col) {
+                const Position pos{row, col};
+                ASSERT(!static_cast<const Cell *>(parallel.GetCell(pos))->IsDirty());
+                ASSERT_EQUAL(parallel.GetCell(pos)->GetValue(), sequential.GetCell(pos)->GetValue());
+            }
+        }
+
+        parallel.SetCell("A1"_pos, "1");
+        parallel.RecalculateAll(3);
+        ASSERT_EQUAL(std::get<double>(parallel.GetCell("C2"_pos)->GetValue()), 3.0);
+        ASSERT_EQUAL(std::get<double>(parallel.GetCell("D1"_pos)->GetValue()), 1.0);
+    }
+
+    void TestThreadPoolExceptions() {
+        ThreadPool pool(4);
+        // исключение из любого потока доходит до вызывающего, а пул после
+        // него остаётся рабочим
+        for (int attempt = 0; attempt < 20; ++attempt) {
+            std::atomic<size_t> done{0};
+            try {
+                pool.ParallelFor(1000, [&done](size_t begin, size_t end) {
+                    if (begin <= 500 && 500 < end) {
+                        throw std::runtime_error("range failed");
+                    }
+                    done += end - begin;
+                });
+                ASSERT(false);
+            } catch (const std::runtime_error &error) {
+                ASSERT_EQUAL(std::string(error.what()), "range failed");
+            }
+            ASSERT(done < 1000u);
+
+            std::atomic<size_t> sum{0};
+            pool.ParallelFor(1000, [&sum](size_t begin, size_t end) {
+                for (size_t i = begin; i < end; ++i) {
+                    sum += i;
+                }
+            });
+            ASSERT_EQUAL(sum.load(), 999u * 1000u / 2);
+        }
+    }
+
+    void TestParallelSetCells() {
+        std::vector<std::pair<Position, std::string>> cells;
+        for (int row = 0; row < 200; ++row) {
+            const std::string n = std::to_string(row + 1);
+            cells.emplace_back(Position{row, 0}, std::to_string(row));
+            cells.emplace_back(Position{row, 1}, "=A" + n + "*2");
+            cells.emplace_back(Position{row, 2}, "=B" + n + "+A1");
+            cells.emplace_back(Position{row, 3}, row % 7 ? "=C" + n + "/B" + n : "=1/A1");
+        }
+        std::shuffle(cells.begin(), cells.end(), std::mt19937(3));
+        Sheet sequential;
+        sequential.SetCells(cells);
+        Sheet parallel;
+        parallel.SetCells(cells, 4);
+        for (int row = 0; row < 200; ++row) {
+            for (int col = 0; col < 4; ++col) {
+                const Position pos{row, col};
+                ASSERT_EQUAL(parallel.GetCell(pos)->GetText(), sequential.GetCell(pos)->GetText());
+                ASSERT_EQUAL(parallel.GetCell(pos)->GetValue(), sequential.GetCell(pos)->GetValue());
+            }
+        }
+
+        // неверные формулы в разных частях пакета
+        cells[10].second = "=1+";
+        cells[700].second = "=(";
+        Sheet failed;
+        try {
+            failed.SetCells(cells, 3);
+            ASSERT(false);
+        } catch (const FormulaException &) {
+        }
+        ASSERT_EQUAL(failed.GetPrintableSize(), (Size{0, 0}));
+    }
+
+    void TestImportDelimited() {
+        {
+            Sheet sheet;
+            std::istringstream input("1,text,=A1+1\r\n"
+                                     "\"quoted, with \"\"comma\"\"\",,'=escaped\n"
+                                     "\n"
+                                     "\"multi\nline\",=\n"
+                                     "=C1*2");
+            ASSERT_EQUAL(ImportDelimited(sheet, input), 8u);
+            ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{5, 3}));
+            ASSERT_EQUAL(std::get<double>(sheet.GetCell("C1"_pos)->GetValue()), 2.0);
+            ASSERT_EQUAL(sheet.GetCell("A2"_pos)->GetText(), "quoted, with \"comma\"");
+            ASSERT(!sheet.GetCell("B2"_pos));
+            ASSERT_EQUAL(sheet.GetCell("C2"_pos)->GetText(), "'=escaped");
+            ASSERT_EQUAL(std::get<std::string>(sheet.GetCell("C2"_pos)->GetValue()), "=escaped");
+            ASSERT_EQUAL(sheet.GetCell("A4"_pos)->GetText(), "multi\nline");
+            ASSERT_EQUAL(sheet.GetCell("B4"_pos)->GetText(), "=");
+            ASSERT_EQUAL(std::get<double>(sheet.GetCell("A5"_pos)->GetValue()), 4.0);
+        }
+        {
+            // в TSV кавычки — обычные символы
+            Sheet sheet;
+            std::istringstream input("2\t\"x\"\t=A1*3\n");
+            ASSERT_EQUAL(ImportDelimited(sheet, input, TSV_FORMAT), 3u);
+            ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetText(), "\"x\"");
+            ASSERT_EQUAL(std::get<double>(sheet.GetCell("C1"_pos)->GetValue()), 6.0);
+        }
+        {
+            // кавычка не в начале поля — обычный символ и запись не продлевает
+            Sheet sheet;
+            std::istringstream input("a,12\" pipe\nb,2\nc,3\n");
+            ASSERT_EQUAL(ImportDelimited(sheet, input), 6u);
+            ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{3, 2}));
+            ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetText(), "12\" pipe");
+            ASSERT_EQUAL(sheet.GetCell("B3"_pos)->GetText(), "3");
+
+            std::istringstream tails("\"x\"y\",\"\"\"\"\nz,w\n");
+            Sheet other;
+            ASSERT_EQUAL(ImportDelimited(other, tails), 4u);
+            ASSERT_EQUAL(other.GetCell("A1"_pos)->GetText(), "xy\"");
+            ASSERT_EQUAL(other.GetCell("B1"_pos)->GetText(), "\"");
+            ASSERT_EQUAL(other.GetCell("B2"_pos)->GetText(), "w");
+        }
+        {
+            // Ввод больше куска чтения: записи пересекают границы кусков, а
+            // одно поле длиннее куска
+            std::map<Position, std::string> expected;
+            std::string text;
+            for (int row = 0; row < 12000; ++row) {
+                for (int col = 0; col < 3; ++col) {
+                    std::string field = std::to_string(row * 3 + col) + std::string(40, 'a');
+                    if (col == 1 && row % 7 == 0) {
+                        field = "line\n" + field + ", \"quoted\"";
+                    }
+                    if (row == 9000 && col == 2) {
+                        field = std::string(3 << 20, 'x');
+                    }
+                    expected[Position{row, col}] = field;
+                    text += col > 0 ? "," : "";
+                    if (field.find_first_of(",\n\"") == std::string::npos) {
+                        text += field;
+                        continue;
+                    }
+                    text += '"';
+                    for (char c: field) {
+                        text += c == '"' ? "\"\"" : std::string(1, c);
+                    }
+                    text += '"';
+                }
+                text += row % 2 ? "\r\n" : "\n";
+            }
+            Sheet sheet;
+            std::istringstream input(text);
+            ASSERT_EQUAL(ImportDelimited(sheet, input, CSV_FORMAT, 2), expected.size());
+            for (const auto &[pos, field]: expected) {
+                ASSERT_EQUAL(sheet.GetCell(pos)->GetText(), field);
+            }
+        }
+    }
+
+    void TestSnapshot() {
+        const std::string path = (std::filesystem::temp_directory_path() / "spreadsheet_test.snapshot").string();
+        auto save = [&path](const Sheet &sheet, bool with_values) {
+            std::ofstream output(path, std::ios::binary);
+            sheet.SaveSnapshot(output, with_values);
+        };
+        auto print = [](const Sheet &sheet) {
+            std::ostringstream out;
+            sheet.PrintTexts(out);
+            sheet.PrintValues(out);
+            return out.str();
+        };
+
+        Sheet sheet;
+        sheet.SetCell("A1"_pos, "1.5");
+        sheet.SetCell("B1"_pos, "text");
+        sheet.SetCell("C1"_pos, "'=escaped");
+        sheet.SetCell("D1"_pos, std::string(100, 'x'));
+        sheet.SetCell("E1"_pos, "=1/0");
+        for (int row = 1; row < 200; ++row) {
+            const std::string n = std::to_string(row);
+            sheet.SetCell(Position{row, 0}, "=A" + n + "*2");
+            sheet.SetCell(Position{row, 1}, "=SUM(A1:A" + n + ")+B" + n);
+            sheet.SetCell(Position{row, 2}, "text");
+        }
+        // Z50 создаётся пустой ячейкой, а G1 встаёт в порядок перед H1
+        sheet.SetCell("F1"_pos, "=Z50+E1");
+        sheet.SetCell("G1"_pos, "=H1+1");
+        sheet.SetCell("H1"_pos, "=2");
+        (void) sheet.GetCell("B100"_pos)->GetValue();
+
+        for (bool with_values: {true, false}) {
+            save(sheet, with_values);
+            auto loaded = Sheet::LoadSnapshot(path);
+            ASSERT_EQUAL(loaded->GetPrintableSize(), sheet.GetPrintableSize());
+            for (int row = 0; row < 200; ++row) {
+                for (int col = 0; col < 26; ++col) {
+                    const Position pos{row, col};
+                    const CellInterface *expected = sheet.GetCell(pos);
+                    const CellInterface *cell = loaded->GetCell(pos);
+                    ASSERT_EQUAL(cell != nullptr, expected != nullptr);
+                    if (cell) {
+                        ASSERT_EQUAL(cell->GetText(), expected->GetText());
+                        ASSERT_EQUAL(cell->GetReferencedCells(), expected->GetReferencedCells());
+                        ASSERT_EQUAL(loaded->IsValueValid(pos),
+                                     sheet.IsValueValid(pos) && (with_values || !static_cast<const Cell *>(cell)->GetFormula()));
+                    }
+                }
+            }
+            ASSERT_EQUAL(print(*loaded), print(sheet));
+
+            // загруженный граф и порядок формул работают для правок
+            loaded->SetCell("A1"_pos, "3");
+            ASSERT_EQUAL(loaded->GetInvalidatedCount(), 398u);
+            ASSERT_EQUAL(std::get<double>(loaded->GetCell("A11"_pos)->GetValue()), 3072.0);
+            ASSERT_EQUAL(std::get<double>(loaded->GetCell("G1"_pos)->GetValue()), 3.0);
+            for (auto [pos, text]: {std::pair("A1"_pos, "=A5"), std::pair("H1"_pos, "=G1"), std::pair("Z50"_pos, "=F1")}) {
+                try {
+                    loaded->SetCell(pos, text);
+                    ASSERT(false);
+                } catch (const CircularDependencyException &) {
+                }
+            }
+            loaded->SetCell("H1"_pos, "=A2");
+            ASSERT_EQUAL(std::get<double>(loaded->GetCell("G1"_pos)->GetValue()), 7.0);
+        }
+
+        {
+            // Числа в телах формул переживают снимок без округления, даже
+            // когда исходного листа и его тел в кэше формул уже нет
+            {
+                Sheet precise;
+                precise.SetCell("A1"_pos, "=1.2345678");
+                precise.SetCell("A2"_pos, "=A1*1000000");
+                precise.SetCell("B1"_pos, "=0.1+0.2");
+                save(precise, false);
+            }
+            auto loaded = Sheet::LoadSnapshot(path);
+            ASSERT_EQUAL(loaded->GetCell("A1"_pos)->GetText(), "=1.23457");
+            ASSERT_EQUAL(std::get<double>(loaded->GetCell("A2"_pos)->GetValue()), 1.2345678 * 1000000);
+            ASSERT_EQUAL(std::get<double>(loaded->GetCell("B1"_pos)->GetValue()), 0.1 + 0.2);
+        }
+
+        auto load_fails = [&path] {
+            try {
+                (void) Sheet::LoadSnapshot(path);
+            } catch (const SnapshotError &) {
+                return true;
+            }
+            return false;
+        };
+        {
+            std::ofstream(path, std::ios::binary) << "not a snapshot at all, but long enough for a header";
+        }
+        ASSERT(load_fails());
+        std::stringstream snapshot;
+        sheet.SaveSnapshot(snapshot);
+        {
+            std::ofstream(path, std::ios::binary) << snapshot.str().substr(0, snapshot.str().size() / 2);
+        }
+        ASSERT(load_fails());
+
+        // Снимок с верным форматом, но с рёбрами или порядком, которые
+        // расходятся с формулами, тоже отвергается
+        Sheet small;
+        small.SetCell("A1"_pos, "1");
+        small.SetCell("C1"_pos, "=2");
+        small.SetCell("B1"_pos, "=A1+C1");
+        std::stringstream small_snapshot;
+        small.SaveSnapshot(small_snapshot);
+        const std::string original = small_snapshot.str();
+        SnapshotHeader header{};
+        std::memcpy(&header, original.data(), sizeof(header));
+        ASSERT_EQUAL(header.cell_count, 3u);
+        ASSERT_EQUAL(header.edge_count, 2u);
+        auto align = [](size_t offset) {
+            return (offset + 7) / 8 * 8;
+        };
+        const size_t cells = align(sizeof(SnapshotHeader));
+        const size_t edges = align(align(cells + header.cell_count * sizeof(SnapshotCell)) +
+                                   header.body_count * sizeof(SnapshotBody));
+        auto patched_load_fails = [&](size_t offset, auto value) {
+            std::string data = original;
+            std::memcpy(data.data() + offset, &value, sizeof(value));
+            std::ofstream(path, std::ios::binary) << data;
+            return load_fails();
+        };
+        // ячейки лежат по порядку ключей: A1, B1, C1; рёбра — A1->B1, C1->B1
+        const size_t b1 = cells + sizeof(SnapshotCell);
+        const size_t c1 = cells + 2 * sizeof(SnapshotCell);
+        std::int64_t b1_order = 0;
+        std::memcpy(&b1_order, original.data() + b1 + offsetof(SnapshotCell, order), sizeof(b1_order));
+        ASSERT(!patched_load_fails(b1 + offsetof(SnapshotCell, order), b1_order));
+        // ребро от отсутствующей ячейки D1 вместо A1
+        ASSERT(patched_load_fails(edges + offsetof(SnapshotEdge, from), std::uint32_t{3}));
+        // ребро к текстовой ячейке A1 вместо формулы B1
+        ASSERT(patched_load_fails(edges + offsetof(SnapshotEdge, to), std::uint32_t{0}));
+        // C1 стоит в порядке не раньше зависящей от неё B1
+        ASSERT(patched_load_fails(c1 + offsetof(SnapshotCell, order), b1_order));
+        // порядок за пределами свободных мест
+        ASSERT(patched_load_fails(b1 + offsetof(SnapshotCell, order), header.next_last_order));
+        std::filesystem::remove(path);
+        ASSERT(load_fails());
+    }
+
+    void TestJournal() {
+        const auto dir = std::filesystem::temp_directory_path() / "spreadsheet_test_journal";
+        std::filesystem::remove_all(dir);
+        auto texts = [](const SheetInterface &sheet) {
+            std::ostringstream out;
+            sheet.PrintTexts(out);
+            sheet.PrintValues(out);
+            return out.str();
+        };
+        auto files = [&dir] {
+            std::set<std::string> names;
+            for (const auto &entry: std::filesystem::directory_iterator(dir)) {
+                names.insert(entry.path().filename().string());
+            }
+            return names;
+        };
+
+        // Одни и те же правки идут в эталонный лист и в лист с журналом
+        Sheet expected;
+        auto edit = [&](SheetInterface &sheet, int i) {
+            const Position pos{i % 37, i % 5};
+            if (i % 11 == 0) {
+                sheet.ClearCell(pos);
+            } else if (i % 3 == 0) {
+                sheet.SetCell(pos, "=A1+" + std::to_string(i) + "/" + std::to_string(i % 4));
+            } else {
+                sheet.SetCell(pos, i % 7 ? std::to_string(i) : "text " + std::string(i % 50, 'x'));
+            }
+        };
+        {
+            JournaledSheet sheet(dir.string(), {4, 0, true});
+            for (int i = 1; i <= 100; ++i) {
+                edit(sheet, i);
+                edit(expected, i);
+            }
+            // отвергнутые правки в журнал не попадают
+            for (const std::string text: {"=A1", "=1+"}) {
+                try {
+                    sheet.SetCell("A1"_pos, text);
+                    ASSERT(false);
+                } catch (const std::exception &) {
+                }
+            }
+            ASSERT_EQUAL(texts(sheet), texts(expected));
+        }
+        ASSERT_EQUAL(files(), (std::set<std::string>{"journal.0"}));
+        {
+            JournaledSheet sheet(dir.string());
+            ASSERT_EQUAL(texts(sheet), texts(expected));
+        }
+
+        // Запись, недописанная при сбое, отбрасывается
+        const auto journal_size = std::filesystem::file_size(dir / "journal.0");
+        {
+            std::ofstream(dir / "journal.0", std::ios::binary | std::ios::app) << "\x20\0\0\0torn";
+        }
+        {
+            JournaledSheet sheet(dir.string(), {4, 0, true});
+            ASSERT_EQUAL(std::filesystem::file_size(dir / "journal.0"), journal_size);
+            ASSERT_EQUAL(texts(sheet), texts(expected));
+            sheet.SetCell("B2"_pos, "after recovery");
+            expected.SetCell("B2"_pos, "after recovery");
+        }
+
+        // Снимки: после восстановления проигрывается только хвост журнала
+        {
+            JournaledSheet sheet(dir.string(), {16, 30, false});
+            for (int i = 101; i <= 175; ++i) {
+                edit(sheet, i);
+                edit(expected, i);
+            }
+            // первая правка застаёт в журнале 102 правки и делает снимок
+            ASSERT_EQUAL(files(), (std::set<std::string>{"journal.3", "snapshot.3"}));
+            // формула не вычислена, и после восстановления её значение
+            // считается по телу из снимка
+            sheet.SetCell("E40"_pos, "=1.2345678*1000000");
+            expected.SetCell("E40"_pos, "=1.2345678*1000000");
+            sheet.Checkpoint();
+            ASSERT_EQUAL(files(), (std::set<std::string>{"journal.4", "snapshot.4"}));
+            sheet.SetCell("C3"_pos, "abc");
+            expected.SetCell("C3"_pos, "abc");
+        }
+        {
+            // недописанный снимок и файлы прошлых поколений удаляются
+            std::ofstream(dir / "snapshot.tmp") << "partial";
+            std::ofstream(dir / "journal.1") << "stale";
+        }
+        {
+            JournaledSheet sheet(dir.string());
+            ASSERT_EQUAL(files(), (std::set<std::string>{"journal.4", "snapshot.4"}));
+            ASSERT_EQUAL(std::filesystem::file_size(dir / "journal.4"), 4u + 4u + 9u + 3u);
+            ASSERT_EQUAL(texts(sheet), texts(expected));
+            ASSERT_EQUAL(std::get<double>(sheet.GetCell("E40"_pos)->GetValue()), 1.2345678 * 1000000);
+        }
+        std::filesystem::remove_all(dir);
+    }
+
+    void TestFormulaParser() {
+        auto expression = [](const std::string &text) {
+            std::ostringstream out;
+            ParseFormulaAST(text).PrintFormula(out);
+            return out.str();
+        };
+        ASSERT_EQUAL(expression(" 1 + 2 * 3 "), "1+2*3");
+        ASSERT_EQUAL(expression("(1+2)*3"), "(1+2)*3");
+        ASSERT_EQUAL(expression("1-(2-3)"), "1-(2-3)");
+        ASSERT_EQUAL(expression("1-(2+3)*-A1"), "1-(2+3)*-A1");
+        ASSERT_EQUAL(expression("--+1"), "--+1");
+        ASSERT_EQUAL(expression("-(1+2)/ZZ9"), "-(1+2)/ZZ9");
+        ASSERT_EQUAL(expression(".5+1.25e2+3E-1+2e+1"), "0.5+125+0.3+20");
+        ASSERT_EQUAL(expression("1e-400"), "0");
+
+        std::ostringstream cells;
+        ParseFormulaAST("B2+A1*B2+A10").PrintCells(cells);
+        ASSERT_EQUAL(cells.str(), "A1 B2 B2 A10 ");
+
+        for (const std::string bad: {"", " ", "1+", "(1", "1)", "()", "1 2", "A", "a1", "1.", "1.e5", "1e",
+                                     "1e+", "1..2", "A1B", "A1:B2", "1+*2", "$A$1", "1e400", "ZZZZ1",
+                                     "A16385", "A0", "=1"}) {
+            bool failed = false;
+            try {
+                (void) ParseFormulaAST(bad);
+            } catch (const std::exception &) {
+                failed = true;
+            }
+            ASSERT(failed);
+        }
+
+        auto sheet = CreateSheet();
+        try {
+            sheet->SetCell("A1"_pos, "=1+");
+            ASSERT(false);
+        } catch (const FormulaException &) {
+        }
+        ASSERT(sheet->GetCell("A1"_pos) == nullptr || sheet->GetCell("A1"_pos)->GetText().empty());
+    }
+
+    void TestRepeatedFormulas() {
+        auto sheet = CreateSheet();
+        sheet->SetCell("A1"_pos, "1");
+        sheet->SetCell("A2"_pos, "2");
+        for (int row = 0; row < 100; ++row) {
+            sheet->SetCell(Position{row, 1}, row % 2 ? "=(A1)+A2 * 10" : "= A1+A2*10 ");
+        }
+        sheet->SetCell("C1"_pos, "=A1+A2*10");
+        sheet->SetCell("A1"_pos, "3");
+        for (int row = 0; row < 100; ++row) {
+            ASSERT_EQUAL(sheet->GetCell(Position{row, 1})->GetText(), "=A1+A2*10");
+            ASSERT_EQUAL(std::get<double>(sheet->GetCell(Position{row, 1})->GetValue()), 23.0);
+        }
+        for (int row = 0; row < 100; ++row) {
+            sheet->ClearCell(Position{row, 1});
+        }
+        ASSERT_EQUAL(std::get<double>(sheet->GetCell("C1"_pos)->GetValue()), 23.0);
+        sheet->SetCell("B1"_pos, "=A1+A2*10");
+        ASSERT_EQUAL(sheet->GetCell("B1"_pos)->GetReferencedCells(), (std::vector<Position>{"A1"_pos, "A2"_pos}));
+
+        // Каноническая запись округляет числа, но формулы с разными числами
+        // не делят тело ни в каком порядке
+        sheet->SetCell("D1"_pos, "=1.23457");
+        sheet->SetCell("D2"_pos, "=1.2345678");
+        sheet->SetCell("D3"_pos, "=1.23457");
+        sheet->SetCell("E1"_pos, "=2.3456789");
+        sheet->SetCell("E2"_pos, "=2.34568");
+        ASSERT_EQUAL(std::get<double>(sheet->GetCell("D1"_pos)->GetValue()), 1.23457);
+        ASSERT_EQUAL(std::get<double>(sheet->GetCell("D2"_pos)->GetValue()), 1.2345678);
+        ASSERT_EQUAL(std::get<double>(sheet->GetCell("D3"_pos)->GetValue()), 1.23457);
+        ASSERT_EQUAL(std::get<double>(sheet->GetCell("E1"_pos)->GetValue()), 2.3456789);
+        ASSERT_EQUAL(std::get<double>(sheet->GetCell("E2"_pos)->GetValue()), 2.34568);
+    }
+
+    void TestFilledDownFormulas() {
+        auto sheet = CreateSheet();
+        for (int row = 0; row < 100; ++row) {
+            sheet->SetCell(Position{row, 0}, std::to_string(row));
+            const std::string a = Position{row, 0}.ToString();
+            sheet->SetCell(Position{row, 1}, "=" + a + "*2+" + Position{row + 1, 0}.ToString());
+        }
+        for (int row = 0; row < 100; ++row) {
+            const auto *cell = sheet->GetCell(Position{row, 1});
+            ASSERT_EQUAL(cell->GetText(), "=A" + std::to_string(row + 1) + "*2+A" + std::to_string(row + 2));
+            ASSERT_EQUAL(std::get<double>(cell->GetValue()), row * 2.0 + (row + 1 < 100 ? row + 1 : 0));
+            ASSERT_EQUAL(cell->GetReferencedCells(), (std::vector<Position>{Position{row, 0}, Position{row + 1, 0}}));
+        }
+        sheet->SetCell("A1"_pos, "10");
+        ASSERT_EQUAL(std::get<double>(sheet->GetCell("B1"_pos)->GetValue()), 21.0);
+        ASSERT_EQUAL(std::get<double>(sheet->GetCell("B2"_pos)->GetValue()), 4.0);
+
+        // числа, совпадающие после округления при печати, не смешиваются
+        // ни в каком порядке: у текста "1.23457" та же запись, что и у
+        // канонической записи "1.2345678"
+        sheet->SetCell("C1"_pos, "=1.23457");
+        sheet->SetCell("C2"_pos, "=1.2345678");
+        sheet->SetCell("C3"_pos, "=1.23457");
+        ASSERT_EQUAL(std::get<double>(sheet->GetCell("C1"_pos)->GetValue()), 1.23457);
+        ASSERT_EQUAL(std::get<double>(sheet->GetCell("C2"_pos)->GetValue()), 1.2345678);
+        ASSERT_EQUAL(std::get<double>(sheet->GetCell("C3"_pos)->GetValue()), 1.23457);
+        sheet->SetCell("F1"_pos, "=A1*1.2345678");
+        sheet->SetCell("F2"_pos, "=A2*1.23457");
+        sheet->SetCell("F3"_pos, "=A3*1.2345678");
+        ASSERT_EQUAL(std::get<double>(sheet->GetCell("F1"_pos)->GetValue()), 10 * 1.2345678);
+        ASSERT_EQUAL(std::get<double>(sheet->GetCell("F2"_pos)->GetValue()), 1.23457);
+        ASSERT_EQUAL(std::get<double>(sheet->GetCell("F3"_pos)->GetValue()), 2 * 1.2345678);
+
+        // формула, сдвиг которой выходит за пределы листа, остаётся корректной
+        sheet->SetCell("D1"_pos, "=A1");
+        sheet->SetCell("E1"_pos, "=B1");
+        ASSERT_EQUAL(sheet->GetCell("E1"_pos)->GetText(), "=B1");
+        ASSERT_EQUAL(std::get<double>(sheet->GetCell("E1"_pos)->GetValue()), 21.0);
+    }
+
+    void TestRangeFunctions() {
+        auto expression = [](const std::string &text) {
+            std::ostringstream out;
+            ParseFormulaAST(text).PrintFormula(out);
+            return out.str();
+        };
+        ASSERT_EQUAL(expression("SUM( B10:A1 , 2*(A1) )+1"), "SUM(A1:B10,2*A1)+1");
+        ASSERT_EQUAL(expression("-MAX(A1:A1,MIN(C3))"), "-MAX(A1,MIN(C3))");
+        ASSERT_EQUAL(expression("COUNT((A1),(B2)+1)"), "COUNT((A1),B2+1)");
+        for (const std::string bad: {"SUM()", "SUM(A1:)", "SUM(A1:2)", "SUM(1:A2)", "SUM(A1,)", "SUM A1",
+                                     "FOO(A1)", "SUM((A1):B2)", "SUM(A1:B2+1)", "sum(A1)"}) {
+            bool failed = false;
+            try {
+                (void) ParseFormulaAST(bad);
+            } catch (const std::exception &) {
+                failed = true;
+            }
+            ASSERT(failed);
+        }
+
+        auto sheet = CreateSheet();
+        for (int row = 0; row < 100; ++row) {
+            sheet->SetCell(Position{row, 0}, std::to_string(row + 1));
+        }
+        auto value = [&sheet](Position pos) {
+            return sheet->GetCell(pos)->GetValue();
+        };
+        sheet->SetCell("B1"_pos, "=SUM(A1:A100)");
+        sheet->SetCell("B2"_pos, "=MIN(A1:A100)+MAX(A1:A100)");
+        sheet->SetCell("B3"_pos, "=AVERAGE(A1:A100)");
+        sheet->SetCell("B4"_pos, "=COUNT(A1:A100,C1:C10)");
+        sheet->SetCell("B5"_pos, "=SUM(A1:A3,A4*10,100)");
+        ASSERT_EQUAL(std::get<double>(value("B1"_pos)), 5050.0);
+        ASSERT_EQUAL(std::get<double>(value("B2"_pos)), 101.0);
+        ASSERT_EQUAL(std::get<double>(value("B3"_pos)), 50.5);
+        ASSERT_EQUAL(std::get<double>(value("B4"_pos)), 100.0);
+        ASSERT_EQUAL(std::get<double>(value("B5"_pos)), 146.0);
+        ASSERT_EQUAL(sheet->GetCell("B5"_pos)->GetReferencedCells(),
+                     (std::vector<Position>{"A1"_pos, "A2"_pos, "A3"_pos, "A4"_pos}));
+
+        // изменение ячейки внутри диапазона сбрасывает кэш
+        sheet->SetCell("A50"_pos, "1050");
+        ASSERT_EQUAL(std::get<double>(value("B1"_pos)), 6050.0);
+
+        // пустые ячейки и нечисловой текст пропускаются, ошибки распространяются
+        sheet->SetCell("D1"_pos, "header");
+        sheet->SetCell("D3"_pos, "'4");
+        sheet->SetCell("E1"_pos, "=MIN(D1:D5)");
+        sheet->SetCell("E2"_pos, "=AVERAGE(D1:D2)");
+        sheet->SetCell("E3"_pos, "=COUNT(D1:D5)");
+        ASSERT_EQUAL(std::get<double>(value("E1"_pos)), 4.0);
+        ASSERT_EQUAL(std::get<FormulaError>(value("E2"_pos)), FormulaError(FormulaError::Category::Div0));
+        ASSERT_EQUAL(std::get<double>(value("E3"_pos)), 1.0);
+        sheet->SetCell("D2"_pos, "=1/0");
+        ASSERT_EQUAL(std::get<FormulaError>(value("E1"_pos)), FormulaError(FormulaError::Category::Div0));
+        ASSERT_EQUAL(std::get<double>(value("E3"_pos)), 1.0);
+        sheet->SetCell("D2"_pos, "=D6+1");
+        ASSERT_EQUAL(std::get<double>(value("E1"_pos)), 1.0);
+
+        try {
+            sheet->SetCell("D6"_pos, "=SUM(D1:D5)");
+            ASSERT(false);
+        } catch (const CircularDependencyException &) {
+        }
+
+        // диапазоны сдвигаются вместе с формулой
+        sheet->SetCell("F1"_pos, "=SUM(A1:A2)");
+        sheet->SetCell("F2"_pos, "=SUM(A2:A3)");
+        ASSERT_EQUAL(sheet->GetCell("F2"_pos)->GetText(), "=SUM(A2:A3)");
+        ASSERT_EQUAL(std::get<double>(value("F2"_pos)), 5.0);
+
+        // ячейка в скобках остаётся ячейкой, а не диапазоном из одной ячейки,
+        // и формула, заданная своим текстом, вычисляется так же
+        for (const std::string text: {"=COUNT((G1))", "=COUNT(G1)", "=SUM((D1))", "=COUNT(G1,(A1))"}) {
+            sheet->SetCell("H1"_pos, text);
+            sheet->SetCell("H2"_pos, sheet->GetCell("H1"_pos)->GetText());
+            ASSERT_EQUAL(sheet->GetCell("H2"_pos)->GetText(), sheet->GetCell("H1"_pos)->GetText());
+            ASSERT_EQUAL(value("H2"_pos), value("H1"_pos));
+        }
+        ASSERT_EQUAL(std::get<double>(value("H1"_pos)), 1.0);
+        sheet->SetCell("H1"_pos, "=COUNT((G1))");
+        ASSERT_EQUAL(std::get<double>(value("H1"_pos)), 1.0);
+        sheet->SetCell("H1"_pos, "=SUM((D1))");
+        ASSERT_EQUAL(std::get<FormulaError>(value("H1"_pos)), FormulaError(FormulaError::Category::Value));
+    }
+
+    void TestLargeRanges() {
+        auto sheet = std::make_unique<Sheet>();
+        auto value = [&sheet](Position pos) {
+            return std::get<double>(sheet->GetCell(pos)->GetValue());
+        };
+
+        // диапазон не создаёт свои ячейки, поэтому размер листа не растёт
+        sheet->SetCell("A1"_pos, "=SUM(A2:XFD16384)");
+        sheet->SetCell("B1"_pos, "=SUM(B2:CV10000)");
+        ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{1, 2}));
+        ASSERT(sheet->GetCell("XFD16384"_pos) == nullptr);
+        ASSERT_EQUAL(value("A1"_pos), 0.0);
+
+        // изменения внутри диапазонов сбрасывают значения
+        sheet->SetCell("C3"_pos, "5");
+        sheet->SetCell("D100"_pos, "=2*C3");
+        ASSERT_EQUAL(value("A1"_pos), 15.0);
+        ASSERT_EQUAL(value("B1"_pos), 15.0);
+        sheet->SetCell("C3"_pos, "7");
+        ASSERT_EQUAL(sheet->GetInvalidatedCount(), 3u);
+        ASSERT_EQUAL(value("A1"_pos), 21.0);
+        // в списке ссылок диапазон представлен только существующими ячейками
+        ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetReferencedCells(), (std::vector<Position>{"C3"_pos, "D100"_pos}));
+        ASSERT(ParseFormula("SUM(A2:XFD16384)+B1")->GetReferencedCells() == std::vector<Position>{"B1"_pos});
+
+        sheet->ClearCell("D100"_pos);
+        ASSERT_EQUAL(value("A1"_pos), 7.0);
+        ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{3, 3}));
+
+        // циклы через диапазоны находятся и по одной ячейке, и пакетом
+        for (const auto &[pos, text]: std::vector<std::pair<Position, std::string>>{
+                {"A1"_pos,       "=SUM(A1:B2)"},
+                {"E5"_pos,       "=A1"},
+                {"XFD16384"_pos, "=A1+1"}}) {
+            try {
+                sheet->SetCell(pos, text);
+                ASSERT(false);
+            } catch (const CircularDependencyException &) {
+            }
+        }
+        try {
+            sheet->SetCells({{"C3"_pos, "=SUM(C5:C6)"}, {"C6"_pos, "=C3"}});
+            ASSERT(false);
+        } catch (const CircularDependencyException &) {
+        }
+        ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{3, 3}));
+
+        // формула, на которую ссылается диапазон, встаёт в порядке раньше
+        // ссылающейся на неё формулы, в том числе при перестановке
+        sheet->SetCell("E5"_pos, "=F5+1");
+        sheet->SetCell("F5"_pos, "=C3*10");
+        ASSERT_EQUAL(value("A1"_pos), 7.0 + 71.0 + 70.0);
+        sheet->SetCells({{"G7"_pos, "=H7"}, {"H7"_pos, "=SUM(C1:C9)"}});
+        ASSERT_EQUAL(value("A1"_pos), 7.0 + 71.0 + 70.0 + 14.0);
+        sheet->RecalculateAll(4);
+        sheet->SetCell("C3"_pos, "1");
+        sheet->RecalculateAll(4);
+        ASSERT_EQUAL(value("A1"_pos), 1.0 + 11.0 + 10.0 + 2.0);
+
+        // зависимости от диапазонов восстанавливаются из снимка
+        const std::string path = (std::filesystem::temp_directory_path() / "spreadsheet_ranges.snapshot").string();
+        {
+            std::ofstream output(path, std::ios::binary);
+            sheet->SaveSnapshot(output);
+        }
+        auto loaded = Sheet::LoadSnapshot(path);
+        std::filesystem::remove(path);
+        ASSERT_EQUAL(loaded->GetPrintableSize(), sheet->GetPrintableSize());
+        loaded->SetCell("Z9"_pos, "100");
+        ASSERT_EQUAL(std::get<double>(loaded->GetCell("A1"_pos)->GetValue()), 124.0);
+    }
+
+    void TestRangeValueStore() {
+        Sheet sheet;
+        // диапазон пересекает границы блоков по строкам и колонкам
+        for (int row = 60; row < 200; ++row) {
+            sheet.SetCell(Position{row, 63}, std::to_string(row));
+            sheet.SetCell(Position{row, 64}, "=" + Position{row, 63}.ToString() + "*2");
+        }
+        sheet.SetCell("A1"_pos, "=SUM(BK61:BM200)");
+        sheet.SetCell("A2"_pos, "=COUNT(BK1:BM300)");
+        sheet.SetCell("A3"_pos, "=SUM(A1,BL61:BL200)");
+        sheet.RecalculateAll(2);
+        const double sum = (60 + 199) * 140 / 2.0;
+        ASSERT_EQUAL(std::get<double>(sheet.GetCell("A1"_pos)->GetValue()), sum * 3);
+        ASSERT_EQUAL(std::get<double>(sheet.GetCell("A2"_pos)->GetValue()), 280.0);
+        ASSERT_EQUAL(std::get<double>(sheet.GetCell("A3"_pos)->GetValue()), sum * 4);
+
+        // изменённые и удалённые ячейки не оставляют устаревших значений
+        sheet.SetCell(Position{100, 63}, "=1/0");
+        ASSERT_EQUAL(std::get<FormulaError>(sheet.GetCell("A1"_pos)->GetValue()),
+                     FormulaError(FormulaError::Category::Div0));
+        ASSERT_EQUAL(std::get<double>(sheet.GetCell("A2"_pos)->GetValue()), 278.0);
+        sheet.ClearCell(Position{100, 64});
+        sheet.SetCell(Position{100, 63}, "text");
+        ASSERT_EQUAL(std::get<double>(sheet.GetCell("A1"_pos)->GetValue()), sum * 3 - 300);
+        ASSERT_EQUAL(std::get<double>(sheet.GetCell("A2"_pos)->GetValue()), 278.0);
+        for (int row = 60; row < 200; ++row) {
+            sheet.ClearCell(Position{row, 63});
+        }
+        ASSERT_EQUAL(std::get<double>(sheet.GetCell("A2"_pos)->GetValue()), 139.0);
+        ASSERT_EQUAL(std::get<double>(sheet.GetCell("A1"_pos)->GetValue()), 0.0);
+    }
+
+    void TestNumericText() {
+        ASSERT_EQUAL(ParseNumber("42").value(), 42.0);
+        ASSERT_EQUAL(ParseNumber(" -1.5e3 ").value(), -1500.0);
+        ASSERT_EQUAL(ParseNumber("+.25").value(), 0.25);
+        for (const std::string bad: {"", " ", "+", "+-1", "--1", "1e", "12abc", "0x10", "1,5", "inf", "nan",
+                                     "1e400", "- 1"}) {
+            ASSERT(!ParseNumber(bad).has_value());
+        }
+
+        auto sheet = CreateSheet();
+        sheet->SetCell("A1"_pos, " 3.5");
+        sheet->SetCell("A2"_pos, "'4");
+        sheet->SetCell("A3"_pos, "3D");
+        sheet->SetCell("B1"_pos, "=A1+A2");
+        sheet->SetCell("B2"_pos, "=A3*1");
+        sheet->SetCell("B3"_pos, "=A4+1");
+        ASSERT_EQUAL(std::get<double>(sheet->GetCell("B1"_pos)->GetValue()), 7.5);
+        ASSERT_EQUAL(std::get<FormulaError>(sheet->GetCell("B2"_pos)->GetValue()),
+                     FormulaError(FormulaError::Category::Value));
+        ASSERT_EQUAL(std::get<double>(sheet->GetCell("B3"_pos)->GetValue()), 1.0);
+        sheet->SetCell("A3"_pos, "1e2");
+        ASSERT_EQUAL(std::get<double>(sheet->GetCell("B2"_pos)->GetValue()), 100.0);
+    }
+
+    void TestDependencyGraph() {
+        auto dependents = [](const DependencyGraph &graph, Position pos) {
+            std::vector<Position> result;
+            graph.ForEachDependent(pos, [&result](Position dependent) { result.push_back(dependent); });
+            std::sort(result.begin(), result.end());
+            return result;
+        };
+
+        DependencyGraph graph;
+        // список A1 переходит из записи в отдельный массив, а затем в индекс
+        for (int row = 0; row < 100; ++row) {
+            graph.AddEdge("A1"_pos, Position{row, 1});
+        }
+        graph.AddEdge("C3"_pos, "D4"_pos);
+        for (int row = 0; row < 100; row += 2) {
+            graph.RemoveEdge("A1"_pos, Position{row, 1});
+        }
+        graph.RemoveEdge("A1"_pos, "Z1"_pos);
+        std::vector<Position> expected;
+        for (int row = 1; row < 100; row += 2) {
+            expected.push_back(Position{row, 1});
+        }
+        ASSERT_EQUAL(dependents(graph, "A1"_pos), expected);
+        ASSERT_EQUAL(dependents(graph, "C3"_pos), std::vector<Position>{"D4"_pos});
+
+        graph.RemoveEdge("C3"_pos, "D4"_pos);
+        ASSERT(!graph.HasDependents("C3"_pos));
+        ASSERT(dependents(graph, "C3"_pos).empty());
+
+        std::vector<std::pair<Position, Position>> edges;
+        for (int col = 0; col < 10; ++col) {
+            edges.emplace_back("A1"_pos, Position{1, col});
+        }
+        edges.emplace_back("B2"_pos, "C3"_pos);
+        graph.Rebuild(edges);
+        ASSERT_EQUAL(dependents(graph, "A1"_pos).size(), 10u);
+        ASSERT_EQUAL(dependents(graph, "B2"_pos), std::vector<Position>{"C3"_pos});
+        // список из общего массива при росте переезжает в собственный
+        graph.AddEdge("A1"_pos, "Z9"_pos);
+        graph.RemoveEdge("A1"_pos, "A2"_pos);
+        ASSERT_EQUAL(dependents(graph, "A1"_pos).size(), 10u);
+        ASSERT_EQUAL(dependents(graph, "A1"_pos).back(), "Z9"_pos);
+    }
+
+#ifdef SPREADSHEET_WITH_ANTLR
+    void TestParserMatchesAntlr() {
+        auto describe = [](auto parse, const std::string &text) {
+            std::ostringstream out;
+            try {
+                auto ast = parse(text);
+                ast.PrintFormula(out);
+                out << " | ";
+                ast.PrintCells(out);
+            } catch (const FormulaException &) {
+                out << "FormulaException";
+            } catch (const std::exception &) {
+                out << "error";
+            }
+            return out.str();
+        };
+        auto ours = [](const std::string &text) { return ParseFormulaAST(text); };
+        auto antlr = [](const std::string &text) { return ParseFormulaASTWithAntlr(text); };
+
+        for (const std::string text: {"1+2*3", "(1+2)*3", "1-(2-3)", "1-(2+3)*-A1", "--+1", "-(1+2)/ZZ9",
+                                      ".5+1.25e2+3E-1+2e+1", "1e-400", "B2+A1*B2+A10", " 1 +\t2\n",
+                                      "", " ", "1+", "(1", "1)", "()", "1 2", "A", "a1", "1.", "1.e5", "1e",
+                                      "1e+", "1..2", "A1B", "A1:B2", "1+*2", "$A$1", "1e400", "ZZZZ1",
+                                      "A16385", "A0", "=1", "((A1))", "+(A1+B1)/C1"}) {
+            ASSERT_EQUAL(describe(ours, text), describe(antlr, text));
+        }
+    }
+#endif
+
+}  // namespace
+
+namespace {
+
+    void BenchmarkClearReverse() {
+        const int rows = 12500;
+        const int cols = 8;
+        auto sheet = CreateSheet();
+        for (int row = 0; row < rows; ++row) {
+            for (int col = 0; col < cols; ++col) {
+                sheet->SetCell(Position{row, col}, "x");
+            }
+        }
+        {
+            LOG_DURATION("Clear 100k cells in reverse order");
+            for (int row = rows - 1; row >= 0; --row) {
+                for (int col = cols - 1; col >= 0; --col) {
+                    sheet->ClearCell(Position{row, col});
+                }
+            }
+        }
+        ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{0, 0}));
+    }
+
+    void BenchmarkErrorRecalc() {
+        const int rows = 10000;
+        auto sheet = CreateSheet();
+        sheet->SetCell("A1"_pos, "0");
+        sheet->SetCell("D1"_pos, "text");
+        for (int row = 0; row < rows; ++row) {
+            const std::string n = std::to_string(row + 1);
+            sheet->SetCell(Position{row, 1}, "=1/A1");
+            sheet->SetCell(Position{row, 2}, "=B" + n + "+D1*2");
+        }
+        LOG_DURATION("Recalculate 20k error cells 50 times");
+        for (int round = 0; round < 50; ++round) {
+            sheet->SetCell("A1"_pos, round % 2 ? "0" : "0.0");
+            for (int row = 0; row < rows; ++row) {
+                ASSERT(std::holds_alternative<FormulaError>(sheet->GetCell(Position{row, 2})->GetValue()));
+            }
+        }
+    }
+
+    void BenchmarkParallelRecalc() {
+        const int rows = 10000;
+        const int cols = 20;
+        auto fill = [&](Sheet &sheet) {
+            for (int row = 0; row < rows; ++row) {
+                const std::string n = std::to_string(row + 1);
+                sheet.SetCell(Position{row, 0}, std::to_string(row));
+                for (int col = 1; col <= cols; ++col) {
+                    sheet.SetCell(Position{row, col}, "=A" + n + "*" + std::to_string(col) + "+A1");
+                }
+            }
+        };
+        Sheet sequential;
+        fill(sequential);
+        Sheet parallel;
+        fill(parallel);
+
+        const size_t threads = std::max(2u, std::thread::hardware_concurrency());
+        {
+            LOG_DURATION("Recalculate 200k formulas on 1 thread");
+            sequential.RecalculateAll();
+        }
+        {
+            LOG_DURATION("Recalculate 200k formulas on " + std::to_string(threads) + " threads");
+            parallel.RecalculateAll(threads);
+        }
+    }
+
+    void BenchmarkParseFormulas() {
+        std::vector<std::string> formulas;
+        for (int i = 0; i < 200000; ++i) {
+            const std::string n = std::to_string(i % 16384 + 1);
+            formulas.push_back("(A" + n + "+B" + n + ")*1.5-C" + n + "/2+-D" + n);
+        }
+        LOG_DURATION("Parse 200k formulas");
+        size_t cells = 0;
+        for (const auto &formula: formulas) {
+            auto ast = ParseFormulaAST(formula);
+            cells += std::distance(ast.GetCells().begin(), ast.GetCells().end());
+        }
+        ASSERT_EQUAL(cells, 800000u);
+    }
+
+    void BenchmarkRepeatedFormulas() {
+        Sheet sheet;
+        LOG_DURATION("Load 160k cells with 16 distinct formulas");
+        for (int row = 0; row < 10000; ++row) {
+            for (int col = 0; col < 16; ++col) {
+                sheet.SetCell(Position{row, col + 1}, "=(A1+A2)*" + std::to_string(col) + "-A3/2");
+            }
+        }
+    }
+
+    void BenchmarkFilledDownFormulas() {
+        Sheet sheet;
+        LOG_DURATION("Load 160k filled-down formulas");
+        for (int row = 0; row < 10000; ++row) {
+            const std::string a = Position{row, 0}.ToString();
+            for (int col = 0; col < 16; ++col) {
+                sheet.SetCell(Position{row, col + 1}, "=(" + a + "+A1)*" + std::to_string(col) + "-" + a + "/2");
+            }
+        }
+    }
+
+    void BenchmarkPrintTexts() {
+        Sheet sheet;
+        for (int row = 0; row < 1000; ++row) {
+            for (int col = 0; col < 20; ++col) {
+                sheet.SetCell(Position{row, col + 1},
+                              "=(" + Position{row, 0}.ToString() + "+" + std::to_string(col) + ")*A1/(A2-3.5)");
+            }
+        }
+        LOG_DURATION("PrintTexts of 20k formulas x 20");
+        for (int i = 0; i < 20; ++i) {
+            std::ostringstream out;
+            sheet.PrintTexts(out);
+        }
+    }
+
+    void BenchmarkRangeSum() {
+        Sheet sheet;
+        for (int row = 0; row < 10000; ++row) {
+            sheet.SetCell(Position{row, 0}, std::to_string(row % 100));
+            sheet.SetCell(Position{row, 1}, "=" + Position{row, 0}.ToString() + "/2");
+        }
+        sheet.SetCell("C1"_pos, "=SUM(A1:B10000)");
+        sheet.SetCell("C2"_pos, "=AVERAGE(A1:B10000)");
+        sheet.RecalculateAll();
+        LOG_DURATION("SUM and AVERAGE of 20k cells x 100");
+        for (int i = 0; i < 100; ++i) {
+            sheet.SetCell("A1"_pos, std::to_string(i));
+            ASSERT_EQUAL(std::get<double>(sheet.GetCell("C1"_pos)->GetValue()), 742500.0 + i * 1.5);
+            (void) sheet.GetCell("C2"_pos)->GetValue();
+        }
+    }
+
+    void BenchmarkLargeRanges() {
+        Sheet sheet;
+        LOG_DURATION("Sum whole-sheet and 1M-cell ranges over 1k edits");
+        sheet.SetCell("A1"_pos, "=SUM(A2:XFD16384)");
+        sheet.SetCell("B1"_pos, "=SUM(B2:CV10000)");
+        for (int i = 0; i < 1000; ++i) {
+            sheet.SetCell(Position{i % 100 + 1, i % 50 + 1}, std::to_string(i));
+            (void) sheet.GetCell("A1"_pos)->GetValue();
+            (void) sheet.GetCell("B1"_pos)->GetValue();
+        }
+        ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{101, 51}));
+    }
+
+    void BenchmarkLineRanges() {
+        // A1:A500 суммируют колонки C:SH целиком, B601:B1100 — строки 2:501
+        // от B до последней колонки, а правки попадают в пересечения
+        Sheet sheet;
+        const int lines = 500;
+        {
+            LOG_DURATION("Add 500 whole-column and 500 whole-row ranges");
+            for (int i = 0; i < lines; ++i) {
+                const Position column_first{0, i + 2};
+                const Position column_last{Position::MAX_ROWS - 1, i + 2};
+                sheet.SetCell(Position{i, 0}, "=SUM(" + column_first.ToString() + ":" + column_last.ToString() + ")");
+                const Position row_first{i + 1, 1};
+                const Position row_last{i + 1, Position::MAX_COLS - 1};
+                sheet.SetCell(Position{600 + i, 1}, "=SUM(" + row_first.ToString() + ":" + row_last.ToString() + ")");
+            }
+        }
+        double column_sum = 0;
+        double row_sum = 0;
+        {
+            LOG_DURATION("Edit 250k cells under whole-column and whole-row ranges");
+            for (int i = 0; i < lines * lines; ++i) {
+                const Position pos{i % lines + 1, i / lines + 2};
+                sheet.SetCell(pos, std::to_string(i % 7));
+                column_sum += pos.col == 2 ? i % 7 : 0;
+                row_sum += pos.row == 1 ? i % 7 : 0;
+            }
+        }
+        ASSERT_EQUAL(std::get<double>(sheet.GetCell("A1"_pos)->GetValue()), column_sum);
+        ASSERT_EQUAL(std::get<double>(sheet.GetCell("B601"_pos)->GetValue()), row_sum);
+    }
+
+    void BenchmarkNumericText() {
+        Sheet sheet;
+        for (int row = 0; row < 16000; ++row) {
+            sheet.SetCell(Position{row, 0}, std::to_string(row * 0.25));
+            sheet.SetCell(Position{row, 1}, "=" + Position{row, 0}.ToString() + "*2+A1");
+        }
+        LOG_DURATION("Recalculate 16k formulas over numeric text x 50");
+        for (int i = 0; i < 50; ++i) {
+            sheet.SetCell("A1"_pos, std::to_string(i));
+            sheet.RecalculateAll();
+        }
+    }
+
+    void BenchmarkHubDependents() {
+        Sheet sheet;
+        const int rows = 16000;
+        const int cols = 10;
+        {
+            LOG_DURATION("Load 160k formulas referencing one cell");
+            for (int row = 0; row < rows; ++row) {
+                for (int col = 1; col <= cols; ++col) {
+                    sheet.SetCell(Position{row, col}, "=A1+" + std::to_string(col));
+                }
+            }
+        }
+        sheet.RecalculateAll();
+        {
+            LOG_DURATION("Invalidate 160k dependents of one cell x 20");
+            for (int i = 0; i < 20; ++i) {
+                sheet.SetCell("A1"_pos, std::to_string(i));
+                sheet.SetCell("A1"_pos, "");
+            }
+        }
+        {
+            LOG_DURATION("Clear 160k formulas referencing one cell");
+            for (int row = 0; row < rows; ++row) {
+                for (int col = 1; col <= cols; ++col) {
+                    sheet.ClearCell(Position{row, col});
+                }
+            }
+        }
+        // сама A1 остаётся пустой ячейкой
+        ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{1, 1}));
+    }
+
+    void BenchmarkDeepChainInsert() {
+        const int length = 1000000;
+        const int rows = 16000;
+        auto position = [rows](int i) {
+            return Position{i % rows, i / rows};
+        };
+
+        Sheet sheet;
+        for (int i = length - 1; i > 0; --i) {
+            sheet.SetCell(position(i), "=" + position(i - 1).ToString() + "+1");
+        }
+        sheet.SetCell(position(0), "1");
+        {
+            LOG_DURATION("Insert formula at head of 1M-deep chain x 20");
+            for (int i = 0; i < 20; ++i) {
+                sheet.SetCell(Position{i, 100}, "=" + position(length - 1).ToString() + "*2");
+            }
+        }
+        {
+            LOG_DURATION("Edit formula in the middle of 1M-deep chain x 20");
+            for (int i = 0; i < 20; ++i) {
+                const int middle = length / 2 + i;
+                sheet.SetCell(position(middle), "=" + position(middle - 1).ToString() + "+2");
+            }
+        }
+    }
+
+    void BenchmarkInvalidation() {
+        {
+            const int length = 1000000;
+            const int rows = 16000;
+            auto position = [rows](int i) {
+                return Position{i % rows, i / rows};
+            };
+            Sheet sheet;
+            for (int i = 1; i < length; ++i) {
+                sheet.SetCell(position(i), "=" + position(i - 1).ToString() + "+1");
+            }
+            sheet.SetCell(position(0), "1");
+            sheet.RecalculateAll();
+            LOG_DURATION("Invalidate 1M-cell chain");
+            sheet.SetCell(position(0), "2");
+            ASSERT_EQUAL(sheet.GetInvalidatedCount(), size_t(length - 1));
+        }
+        {
+            const int rows = 1000;
+            const int cols = 200;
+            Sheet sheet;
+            for (int col = 0; col < cols; ++col) {
+                sheet.SetCell(Position{0, col}, "1");
+            }
+            for (int row = 1; row < rows; ++row) {
+                for (int col = 0; col < cols; ++col) {
+                    const Position left{row - 1, std::max(col - 1, 0)};
+                    const Position right{row - 1, std::min(col + 1, cols - 1)};
+                    sheet.SetCell(Position{row, col}, "=" + left.ToString() + "+" + Position{row - 1, col}.ToString() +
+                                                      "+" + right.ToString());
+                }
+            }
+            sheet.RecalculateAll();
+            // сброс расходится от середины первой строки на колонку в каждую
+            // сторону за строку
+            size_t expected = 0;
+            for (int row = 1; row < rows; ++row) {
+                expected += std::min(cols / 2 + row, cols - 1) - std::max(cols / 2 - row, 0) + 1;
+            }
+            LOG_DURATION("Invalidate 200k-cell diamond lattice");
+            sheet.SetCell(Position{0, cols / 2}, "2");
+            ASSERT_EQUAL(sheet.GetInvalidatedCount(), expected);
+        }
+    }
+
+    void BenchmarkBatchLoad() {
+        // Заполненные вниз формулы в случайном порядке: по одной ячейке
+        // формула часто ссылается на ещё не заданную, и порядок формул
+        // приходится перестраивать. Разобранные формулы кешируются, поэтому
+        // у каждого замера свой множитель
+        auto make_cells = [](int factor) {
+            std::vector<std::pair<Position, std::string>> cells;
+            for (int row = 0; row < 8000; ++row) {
+                for (int col = 0; col < 20; ++col) {
+                    cells.emplace_back(Position{row, col},
+                                       row == 0 ? std::to_string(col)
+                                                : "=" + Position{row - 1, col}.ToString() + "*" +
+                                                  std::to_string(factor) + "+A1");
+                }
+            }
+            std::shuffle(cells.begin(), cells.end(), std::mt19937(factor));
+            return cells;
+        };
+        {
+            Sheet sheet;
+            auto cells = make_cells(2);
+            LOG_DURATION("Load 160k shuffled cells with SetCell");
+            for (const auto &[pos, text]: cells) {
+                sheet.SetCell(pos, text);
+            }
+        }
+        {
+            Sheet sheet;
+            auto cells = make_cells(3);
+            LOG_DURATION("Load 160k shuffled cells with SetCells");
+            sheet.SetCells(std::move(cells));
+        }
+        {
+            const size_t threads = std::max(2u, std::thread::hardware_concurrency());
+            Sheet sheet;
+            auto cells = make_cells(6);
+            LOG_DURATION("Load 160k shuffled cells with SetCells on " + std::to_string(threads) + " threads");
+            sheet.SetCells(std::move(cells), threads);
+        }
+        {
+            Sheet sheet;
+            sheet.SetCells(make_cells(4));
+            auto cells = make_cells(5);
+            LOG_DURATION("Replace 160k shuffled cells with SetCells");
+            sheet.SetCells(std::move(cells));
+        }
+    }
+
+    void BenchmarkImportDelimited() {
+        // TSV из чисел, текста и формул. Разобранные формулы кешируются,
+        // поэтому у каждого замера свой множитель
+        auto make_text = [](int factor) {
+            std::string text;
+            for (int row = 0; row < 16000; ++row) {
+                const std::string n = std::to_string(row + 1);
+                text += std::to_string(row) + "\titem " + n;
+                for (int col = 2; col < 64; ++col) {
+                    text += "\t=A" + n + "*" + std::to_string(factor) + "+" + std::to_string(col);
+                }
+                text += '\n';
+            }
+            return text;
+        };
+        {
+            std::istringstream input(make_text(2));
+            Sheet sheet;
+            LOG_DURATION("Load 1M-cell TSV with getline and SetCell");
+            std::string line;
+            for (int row = 0; std::getline(input, line); ++row) {
+                std::istringstream fields(line);
+                std::string field;
+                for (int col = 0; std::getline(fields, field, '\t'); ++col) {
+                    sheet.SetCell(Position{row, col}, field);
+                }
+            }
+        }
+        {
+            std::istringstream input(make_text(3));
+            Sheet sheet;
+            LOG_DURATION("Import 1M-cell TSV");
+            ImportDelimited(sheet, input, TSV_FORMAT);
+        }
+    }
+
+    void BenchmarkSnapshot() {
+        // Тот же лист, что в BenchmarkImportDelimited. Исходный лист
+        // удаляется до загрузки, чтобы тела его формул ушли из кэша
+        const std::string path = (std::filesystem::temp_directory_path() / "spreadsheet_bench.snapshot").string();
+        auto make_text = [](int factor) {
+            std::string text;
+            for (int row = 0; row < 16000; ++row) {
+                const std::string n = std::to_string(row + 1);
+                text += std::to_string(row) + "\titem " + n;
+                for (int col = 2; col < 64; ++col) {
+                    text += "\t=A" + n + "*" + std::to_string(factor) + "+" + std::to_string(col);
+                }
+                text += '\n';
+            }
+            return text;
+        };
+        {
+            std::istringstream input(make_text(4));
+            Sheet sheet;
+            LOG_DURATION("Import 1M-cell TSV and compute values");
+            ImportDelimited(sheet, input, TSV_FORMAT);
+            sheet.RecalculateAll();
+        }
+        {
+            std::istringstream input(make_text(5));
+            Sheet sheet;
+            ImportDelimited(sheet, input, TSV_FORMAT);
+            sheet.RecalculateAll();
+            LOG_DURATION("Save snapshot of 1M cells");
+            std::ofstream output(path, std::ios::binary);
+            sheet.SaveSnapshot(output);
+        }
+        std::unique_ptr<Sheet> loaded;
+        {
+            LOG_DURATION("Load snapshot of 1M cells with values");
+            loaded = Sheet::LoadSnapshot(path);
+        }
+        std::filesystem::remove(path);
+    }
+
+    void BenchmarkJournal() {
+        // 200k правок: числа и формулы в области 4000 x 50. Разобранные
+        // формулы кешируются, поэтому у каждого замера свой множитель
+        const auto dir = std::filesystem::temp_directory_path() / "spreadsheet_bench_journal";
+        auto edit = [](SheetInterface &sheet, int i, int factor) {
+            const Position pos{i / 50 % 4000, i % 50};
+            if (i % 2) {
+                sheet.SetCell(pos, std::to_string(i));
+            } else {
+                sheet.SetCell(pos, "=B" + std::to_string(pos.row + 1) + "*" + std::to_string(factor) + "+" +
+                                   std::to_string(i));
+            }
+        };
+        const int edits = 200000;
+        {
+            Sheet sheet;
+            LOG_DURATION("200k edits without journal");
+            for (int i = 0; i < edits; ++i) {
+                edit(sheet, i, 2);
+            }
+        }
+        for (auto [name, options, factor]: {
+                std::tuple("200k edits with journal, no fsync", JournalOptions{1024, 0, false}, 3),
+                std::tuple("200k edits with journal, fsync per 1024 edits", JournalOptions{1024, 0, true}, 4),
+                std::tuple("200k edits with journal, snapshot per 50k edits", JournalOptions{1024, 50000, true}, 5)}) {
+            std::filesystem::remove_all(dir);
+            JournaledSheet sheet(dir.string(), options);
+            LOG_DURATION(name);
+            for (int i = 0; i < edits; ++i) {
+                edit(sheet, i, factor);
+            }
+            sheet.Sync();
+        }
+        std::unique_ptr<JournaledSheet> recovered;
+        {
+            LOG_DURATION("Recover 200k-edit sheet from snapshot and journal tail");
+            recovered = std::make_unique<JournaledSheet>(dir.string());
+        }
+        recovered.reset();
+        std::filesystem::remove_all(dir);
+    }
+
+    void BenchmarkPrintValues() {
+        Sheet sheet;
+        for (int row = 0; row < 16000; ++row) {
+            const std::string n = std::to_string(row + 1);
+            sheet.SetCell(Position{row, 0}, std::to_string(row) + ".25");
+            for (int col = 1; col < 64; ++col) {
+                sheet.SetCell(Position{row, col}, "=A" + n + "*" + std::to_string(col) + "/7");
+            }
+        }
+        sheet.RecalculateAll();
+        {
+            LOG_DURATION("Print 1M values cell by cell through ostream");
+            std::ostringstream out;
+            for (int row = 0; row < 16000; ++row) {
+                for (int col = 0; col < 64; ++col) {
+                    if (col > 0) {
+                        out << '\t';
+                    }
+                    std::visit([&out](const auto &value) { out << value; }, sheet.GetCell(Position{row, col})->GetValue());
+                }
+                out << '\n';
+            }
+        }
+        {
+            LOG_DURATION("PrintValues of 1M cells to ostringstream");
+            std::ostringstream out;
+            sheet.PrintValues(out);
+        }
+        {
+            std::FILE *file = std::tmpfile();
+            LOG_DURATION("PrintValues of 1M cells to a file descriptor");
+            sheet.PrintValues(fileno(file));
+            std::fclose(file);
+        }
+        const size_t threads = std::max(2u, std::thread::hardware_concurrency());
+        {
+            LOG_DURATION("PrintValues of 1M cells to ostringstream on " + std::to_string(threads) + " threads");
+            std::ostringstream out;
+            sheet.PrintValues(out, threads);
+        }
+    }
+
+    void RunBenchmarks(TestRunner &tr) {
+        RUN_TEST(tr, BenchmarkClearReverse);
+        RUN_TEST(tr, BenchmarkErrorRecalc);
+        RUN_TEST(tr, BenchmarkParallelRecalc);
+        RUN_TEST(tr, BenchmarkParseFormulas);
+        RUN_TEST(tr, BenchmarkRepeatedFormulas);
+        RUN_TEST(tr, BenchmarkFilledDownFormulas);
+        RUN_TEST(tr, BenchmarkPrintTexts);
+        RUN_TEST(tr, BenchmarkRangeSum);
+        RUN_TEST(tr, BenchmarkLargeRanges);
+        RUN_TEST(tr, BenchmarkLineRanges);
+        RUN_TEST(tr, BenchmarkNumericText);
+        RUN_TEST(tr, BenchmarkHubDependents);
+        RUN_TEST(tr, BenchmarkDeepChainInsert);
+        RUN_TEST(tr, BenchmarkInvalidation);
+        RUN_TEST(tr, BenchmarkBatchLoad);
+        RUN_TEST(tr, BenchmarkImportDelimited);
+        RUN_TEST(tr, BenchmarkSnapshot);
+        RUN_TEST(tr, BenchmarkJournal);
+        RUN_TEST(tr, BenchmarkPrintValues);
+    }
+
 }  // namespace
 
-int main() {
+int main(int argc, char *argv[]) {
     TestRunner tr;
     RUN_TEST(tr, TestEmpty);
     RUN_TEST(tr, TestInvalidPosition);
     RUN_TEST(tr, TestSetCellPlainText);
     RUN_TEST(tr, TestClearCell);
     RUN_TEST(tr, TestPrint);
+    RUN_TEST(tr, TestPrintFormatting);
+    RUN_TEST(tr, TestParallelPrint);
+    RUN_TEST(tr, TestSparseStorage);
+    RUN_TEST(tr, TestPrintableSizeAfterClear);
+    RUN_TEST(tr, TestFormulaEvaluation);
+    RUN_TEST(tr, TestLongDependencyChain);
+    RUN_TEST(tr, TestCircularDependency);
+    RUN_TEST(tr, TestInvalidationCount);
+    RUN_TEST(tr, TestSetCells);
+    RUN_TEST(tr, TestClearReferencedCell);
+    RUN_TEST(tr, TestParallelRecalculation);
+    RUN_TEST(tr, TestThreadPoolExceptions);
+    RUN_TEST(tr, TestParallelSetCells);
+    RUN_TEST(tr, TestImportDelimited);
+    RUN_TEST(tr, TestSnapshot);
+    RUN_TEST(tr, TestJournal);
+    RUN_TEST(tr, TestFormulaParser);
+    RUN_TEST(tr, TestRepeatedFormulas);
+    RUN_TEST(tr, TestFilledDownFormulas);
+    RUN_TEST(tr, TestRangeFunctions);
+    RUN_TEST(tr, TestLargeRanges);
+    RUN_TEST(tr, TestRangeValueStore);
+    RUN_TEST(tr, TestNumericText);
+    RUN_TEST(tr, TestDependencyGraph);
+#ifdef SPREADSHEET_WITH_ANTLR
+    RUN_TEST(tr, TestParserMatchesAntlr);
+#endif
+    if (argc > 1 && std::string(argv[1]) == "--bench") {
+        RunBenchmarks(tr);
+    }
     return 0;
 }
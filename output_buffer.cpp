@@ -0,0 +1,108 @@
+#include "output_buffer.h"
+
+#include <cerrno>
+#include <charconv>
+#include <cstring>
+#include <locale>
+#include <system_error>
+
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+namespace {
+    // Пишет данные в дескриптор целиком, повторяя прерванные и неполные записи.
+    void WriteAll(int fd, const char *data, size_t size) {
+        while (size > 0) {
+#ifdef _WIN32
+            const auto written = ::_write(fd, data, static_cast<unsigned>(size));
+#else
+            const auto written = ::write(fd, data, size);
+#endif
+            if (written < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                throw std::system_error(errno, std::generic_category(), "write");
+            }
+            data += written;
+            size -= static_cast<size_t>(written);
+        }
+    }
+}  // namespace
+
+OutputBuffer::OutputBuffer(std::vector<char> &storage, std::ostream &output)
+        : storage_(storage), output_(&output), precision_(static_cast<int>(output.precision())) {
+    const auto number_flags = std::ios_base::floatfield | std::ios_base::showpoint | std::ios_base::showpos |
+                              std::ios_base::uppercase;
+    stream_numbers_ = (output.flags() & number_flags) || output.getloc() != std::locale::classic() ||
+                      precision_ > MAX_PRECISION;
+    storage_.resize(CAPACITY);
+}
+
+OutputBuffer::OutputBuffer(std::vector<char> &storage, int fd)
+        : storage_(storage), fd_(fd) {
+    storage_.resize(CAPACITY);
+}
+
+OutputBuffer::OutputBuffer(std::vector<char> &storage, const OutputBuffer &format)
+        : storage_(storage), precision_(format.precision_), stream_numbers_(format.stream_numbers_) {
+    if (storage_.size() < CAPACITY) {
+        storage_.resize(CAPACITY);
+    }
+}
+
+void OutputBuffer::Write(std::string_view text) {
+    if (text.size() > storage_.size() - size_) {
+        Flush();
+    }
+    if (text.size() > storage_.size() - size_) {
+        if (!IsMemory()) {
+            // длинный текст записывается в обход буфера
+            if (output_) {
+                output_->write(text.data(), static_cast<std::streamsize>(text.size()));
+            } else {
+                WriteAll(fd_, text.data(), text.size());
+            }
+            return;
+        }
+        storage_.resize(size_ + text.size());
+    }
+    std::memcpy(storage_.data() + size_, text.data(), text.size());
+    size_ += text.size();
+}
+
+void OutputBuffer::WriteNumber(double value) {
+    if (stream_numbers_) {
+        Flush();
+        *output_ << value;
+        return;
+    }
+    if (storage_.size() - size_ < MAX_NUMBER_SIZE) {
+        Flush();
+    }
+    char *first = storage_.data() + size_;
+    const auto result = std::to_chars(first, first + MAX_NUMBER_SIZE, value, std::chars_format::general,
+                                      precision_);
+    size_ += result.ptr - first;
+}
+
+void OutputBuffer::Flush() {
+    if (IsMemory()) {
+        if (storage_.size() - size_ < MAX_NUMBER_SIZE) {
+            storage_.resize(storage_.size() * 2);
+        }
+        return;
+    }
+    if (size_ == 0) {
+        return;
+    }
+    if (output_) {
+        output_->write(storage_.data(), static_cast<std::streamsize>(size_));
+    } else {
+        WriteAll(fd_, storage_.data(), size_);
+    }
+    size_ = 0;
+}
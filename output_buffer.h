@@ -0,0 +1,77 @@
+#pragma once
+
+#include <cstddef>
+#include <ostream>
+#include <string_view>
+#include <vector>
+
+// Буфер вывода: данные копируются в массив storage и сбрасываются в поток
+// или файловый дескриптор одной записью, когда массив заполнится. Массив
+// принадлежит вызывающему, поэтому его можно переиспользовать между
+// выводами.
+//
+// Числа записываются так же, как их вывел бы поток output с его точностью:
+// в формате %g без учёта флагов потока. Если флаги или локаль потока меняют
+// вывод чисел или точность больше MAX_PRECISION, числа форматируются самим
+// потоком.
+class OutputBuffer {
+public:
+    static const size_t CAPACITY = 1 << 18;
+
+    static const int MAX_PRECISION = 64;
+
+    OutputBuffer(std::vector<char> &storage, std::ostream &output);
+
+    // Запись в файловый дескриптор. При ошибке записи Flush бросает
+    // std::system_error.
+    OutputBuffer(std::vector<char> &storage, int fd);
+
+    // Запись в память: storage растёт, а числа пишутся так же, как в буфер
+    // format. Записанное занимает первые GetSize() байт storage.
+    OutputBuffer(std::vector<char> &storage, const OutputBuffer &format);
+
+    OutputBuffer(const OutputBuffer &) = delete;
+
+    OutputBuffer &operator=(const OutputBuffer &) = delete;
+
+    void Put(char c) {
+        if (size_ == storage_.size()) {
+            Flush();
+        }
+        storage_[size_++] = c;
+    }
+
+    void Write(std::string_view text);
+
+    void WriteNumber(double value);
+
+    // Отдаёт накопленные данные потоку или дескриптору. При записи в память
+    // освобождает место, увеличивая storage.
+    void Flush();
+
+    [[nodiscard]] size_t GetSize() const {
+        return size_;
+    }
+
+    // Числа форматирует сам буфер, а не поток.
+    [[nodiscard]] bool FormatsNumbers() const {
+        return !stream_numbers_;
+    }
+
+private:
+    // Места, которого хватает на любое число в формате %g с точностью до
+    // MAX_PRECISION.
+    static const size_t MAX_NUMBER_SIZE = MAX_PRECISION + 16;
+
+    [[nodiscard]] bool IsMemory() const {
+        return !output_ && fd_ < 0;
+    }
+
+    std::vector<char> &storage_;
+    size_t size_ = 0;
+    std::ostream *output_ = nullptr;
+    int fd_ = -1;
+    int precision_ = 6;
+    // числа форматирует поток
+    bool stream_numbers_ = false;
+};
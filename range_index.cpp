@@ -0,0 +1,97 @@
+#include "range_index.h"
+
+#include <algorithm>
+
+void RangeIndex::Add(CellRange range, Position dependent) {
+    std::uint32_t index;
+    if (free_entries_.empty()) {
+        index = static_cast<std::uint32_t>(entries_.size());
+        entries_.push_back({range, dependent});
+    } else {
+        index = free_entries_.back();
+        free_entries_.pop_back();
+        entries_[index] = {range, dependent};
+    }
+    ++size_;
+    ++grid_sizes_[GridOf(range)];
+
+    ForEachBucket(range, true, [index](std::vector<std::uint32_t> &bucket) {
+        bucket.push_back(index);
+    });
+}
+
+void RangeIndex::Remove(CellRange range, Position dependent) {
+    auto is_pair = [&](std::uint32_t index) {
+        const Entry &entry = entries_[index];
+        return entry.range.first == range.first && entry.range.last == range.last && entry.dependent == dependent;
+    };
+
+    const int grid = GridOf(range);
+    auto first = buckets_.find(BucketKey(grid, range.first));
+    if (first == buckets_.end()) {
+        return;
+    }
+    // записи чаще удаляются вскоре после добавления, поэтому ищем с конца
+    auto found = std::find_if(first->second.rbegin(), first->second.rend(), is_pair);
+    if (found == first->second.rend()) {
+        return;
+    }
+    const std::uint32_t index = *found;
+    ForEachBucket(range, false, [index](std::vector<std::uint32_t> &bucket) {
+        auto it = std::find(bucket.rbegin(), bucket.rend(), index);
+        *it = bucket.back();
+        bucket.pop_back();
+    });
+    free_entries_.push_back(index);
+    --grid_sizes_[grid];
+    --size_;
+}
+
+bool RangeIndex::Contains(Position pos) const {
+    bool found = false;
+    ForEachDependent(pos, [&found](Position) {
+        found = true;
+    });
+    return found;
+}
+
+bool RangeIndex::IsEmpty() const {
+    return size_ == 0;
+}
+
+void RangeIndex::Clear() {
+    entries_.clear();
+    free_entries_.clear();
+    buckets_.clear();
+    grid_sizes_.fill(0);
+    size_ = 0;
+}
+
+int RangeIndex::SpanLevel(int first, int last) {
+    int level = 0;
+    while (level + 1 < LEVELS && last / Side(level) - first / Side(level) > 1) {
+        ++level;
+    }
+    return level;
+}
+
+template<typename Func>
+void RangeIndex::ForEachBucket(CellRange range, bool create, Func func) {
+    const int grid = GridOf(range);
+    const int row_side = Side(grid / LEVELS);
+    const int col_side = Side(grid % LEVELS);
+    for (int bucket_row = range.first.row / row_side; bucket_row <= range.last.row / row_side; ++bucket_row) {
+        for (int bucket_col = range.first.col / col_side; bucket_col <= range.last.col / col_side; ++bucket_col) {
+            const int key = BucketKey(grid, bucket_row, bucket_col);
+            if (create) {
+                func(buckets_[key]);
+                continue;
+            }
+            auto it = buckets_.find(key);
+            func(it->second);
+            if (it->second.empty()) {
+                buckets_.erase(it);
+            }
+        }
+    }
+}
@@ -0,0 +1,116 @@
+#pragma once
+
+#include "common.h"
+#include "formula.h"
+
+#include <array>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+// Зависимости формул от диапазонов: пары (диапазон, формула), по которым
+// находятся формулы, диапазоны которых содержат ячейку. Диапазон хранится
+// одной записью, сколько бы ячеек он ни покрывал, поэтому для его ячеек не
+// нужны ни записи в DependencyGraph, ни сами ячейки в листе.
+//
+// Записи разложены по сеткам корзин. Сторона корзины по строкам и по
+// колонкам выбирается независимо из BUCKET_SIZE * 4^k, k < LEVELS, так что
+// всего сеток LEVELS * LEVELS. Диапазон попадает в сетку с наименьшими
+// сторонами, в которой он задевает не больше двух корзин по каждому
+// измерению, то есть лежит не больше чем в четырёх корзинах. В корзине
+// поэтому оказываются диапазоны, соизмеримые с ней по размеру: узкие
+// диапазоны во всю колонку или во всю строку не смешиваются с соседними
+// колонками и строками. Поиск просматривает по одной корзине в каждой
+// непустой сетке.
+class RangeIndex {
+public:
+    static const int BUCKET_SIZE = 64;
+    static const int LEVELS = 5;
+
+    // Добавляет зависимость формулы в позиции dependent от диапазона range.
+    // Такой пары в индексе быть не должно.
+    void Add(CellRange range, Position dependent);
+
+    // Удаляет пару, если она есть.
+    void Remove(CellRange range, Position dependent);
+
+    // true, если ячейка pos входит в какой-нибудь диапазон.
+    [[nodiscard]] bool Contains(Position pos) const;
+
+    [[nodiscard]] bool IsEmpty() const;
+
+    // Вызывает func(dependent) для формул, диапазоны которых содержат pos.
+    // Формула, у которой pos входит в несколько диапазонов, встречается
+    // несколько раз. func не должна менять индекс.
+    template<typename Func>
+    void ForEachDependent(Position pos, Func func) const;
+
+    void Clear();
+
+private:
+    struct Entry {
+        CellRange range;
+        Position dependent;
+    };
+
+    static const int GRIDS = LEVELS * LEVELS;
+
+    static_assert((BUCKET_SIZE << (2 * (LEVELS - 1))) >= Position::MAX_ROWS &&
+                  (BUCKET_SIZE << (2 * (LEVELS - 1))) >= Position::MAX_COLS,
+                  "the coarsest grid must hold any range in one bucket");
+    static_assert(Position::MAX_ROWS / BUCKET_SIZE <= 256 && Position::MAX_COLS / BUCKET_SIZE <= 256,
+                  "bucket coordinates are packed into 8 bits");
+
+    static int Side(int level) {
+        return BUCKET_SIZE << (2 * level);
+    }
+
+    // Наименьший уровень, на котором отрезок [first, last] задевает не
+    // больше двух корзин.
+    static int SpanLevel(int first, int last);
+
+    static int GridOf(CellRange range) {
+        return SpanLevel(range.first.row, range.last.row) * LEVELS + SpanLevel(range.first.col, range.last.col);
+    }
+
+    static int BucketKey(int grid, int bucket_row, int bucket_col) {
+        return (grid << 16) | (bucket_row << 8) | bucket_col;
+    }
+
+    static int BucketKey(int grid, Position pos) {
+        return BucketKey(grid, pos.row / Side(grid / LEVELS), pos.col / Side(grid % LEVELS));
+    }
+
+    // Вызывает func(bucket) для всех корзин диапазона в его сетке, создавая
+    // их при необходимости, если create.
+    template<typename Func>
+    void ForEachBucket(CellRange range, bool create, Func func);
+
+    std::vector<Entry> entries_;
+    std::vector<std::uint32_t> free_entries_;
+    std::unordered_map<int, std::vector<std::uint32_t>> buckets_;
+    // Число записей в каждой сетке: пустые сетки поиск пропускает.
+    std::array<size_t, GRIDS> grid_sizes_{};
+    size_t size_ = 0;
+};
+
+template<typename Func>
+void RangeIndex::ForEachDependent(Position pos, Func func) const {
+    if (size_ == 0) {
+        return;
+    }
+    for (int grid = 0; grid < GRIDS; ++grid) {
+        if (grid_sizes_[grid] == 0) {
+            continue;
+        }
+        auto it = buckets_.find(BucketKey(grid, pos));
+        if (it == buckets_.end()) {
+            continue;
+        }
+        for (std::uint32_t index: it->second) {
+            if (entries_[index].range.Contains(pos)) {
+                func(entries_[index].dependent);
+            }
+        }
+    }
+}
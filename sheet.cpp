@@ -3,22 +3,345 @@
 #include "cell.h"
 #include "common.h"
 
+#include <algorithm>
+#include <exception>
 #include <iostream>
+#include <limits>
+#include <mutex>
 #include <optional>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
 
 using namespace std::literals;
 
+namespace {
+    // Примерное число ячеек в полосе строк, которую печатает один поток.
+    const size_t PRINT_BAND_CELLS = 1 << 14;
+
+    std::uint32_t PositionKey(Position pos) {
+        return static_cast<std::uint32_t>(pos.row) * Position::MAX_COLS + static_cast<std::uint32_t>(pos.col);
+    }
+
+    Position KeyPosition(std::uint32_t key) {
+        return {static_cast<int>(key / Position::MAX_COLS), static_cast<int>(key % Position::MAX_COLS)};
+    }
+
+    // Числовая форма значения текстовой ячейки, см. NumericSource.
+    double GetTextNumber(std::string_view text) {
+        if (!text.empty() && text.front() == ESCAPE_SIGN) {
+            text.remove_prefix(1);
+        }
+        auto number = ParseNumber(text);
+        return number ? *number : TextCellValue();
+    }
+}
+
 void Sheet::SetCell(Position pos, std::string text) {
     if (!pos.IsValid()) {
         throw InvalidPositionException{"InvalidPosition"};
     }
-    Increase(pos);
-    auto &cell_interface = cells_[pos.row][pos.col];
-    if (cell_interface == nullptr) {
-        cell_interface = std::make_unique<Cell>(*this);
+    invalidated_count_ = 0;
+    const Cell *existing = cells_.Get(pos);
+    if (existing && text == existing->GetTextView()) {
+        return;
+    }
+
+    // Отвергнутая формула не оставляет после себя пустую ячейку, иначе
+    // ячейка внутри большого диапазона раздувала бы размер листа
+    auto formula = ParseCellFormula(pos, text);
+    Cell &cell = cells_.Emplace(pos);
+    if (formula && !PlaceInOrder(pos, *formula->formula, formula->order)) {
+        if (!existing) {
+            cells_.Erase(pos);
+        }
+        throw CircularDependencyException{"Circular dependency"};
+    }
+
+    const bool is_formula = formula != nullptr;
+    Replace(pos, cell, text, std::move(formula));
+    if (is_formula) {
+        AddDependencies(pos, cell);
+    }
+    invalidated_count_ = InvalidateDependents(pos);
+}
+
+void Sheet::SetCells(std::vector<std::pair<Position, std::string>> cells, size_t threads) {
+    for (const auto &[pos, text]: cells) {
+        if (!pos.IsValid()) {
+            throw InvalidPositionException{"InvalidPosition"};
+        }
+    }
+    invalidated_count_ = 0;
+
+    // Из пар с одной позицией остаётся последняя, пары, которые не меняют
+    // ячейку, отбрасываются. Загрузчики обычно задают ячейки по строкам, и
+    // тогда повторов нет и искать их не нужно
+    const bool ordered = std::adjacent_find(cells.begin(), cells.end(), [](const auto &lhs, const auto &rhs) {
+        return PositionKey(lhs.first) >= PositionKey(rhs.first);
+    }) == cells.end();
+    std::vector<BatchEntry> entries;
+    std::unordered_set<std::uint32_t> seen;
+    if (!ordered) {
+        seen.reserve(cells.size());
+    }
+    entries.reserve(cells.size());
+    for (auto it = cells.rbegin(); it != cells.rend(); ++it) {
+        if (!ordered && !seen.insert(PositionKey(it->first)).second) {
+            continue;
+        }
+        const Cell *cell = cells_.Get(it->first);
+        if (cell && it->second == cell->GetTextView()) {
+            continue;
+        }
+        entries.push_back({it->first, std::move(it->second), nullptr});
+    }
+    std::reverse(entries.begin(), entries.end());
+
+    ParseBatch(entries, threads);
+    std::vector<Position> order;
+    if (!SortBatch(entries, order)) {
+        throw CircularDependencyException{"Circular dependency"};
+    }
+
+    // Дальше лист меняется и ошибок, кроме нехватки памяти, быть не может.
+    // В пустой граф рёбра пакета добавляются одной перестройкой
+    const bool rebuild = dependents_.IsEmpty() && range_dependents_.IsEmpty();
+    std::vector<std::pair<Position, Position>> edges;
+    std::vector<Position> roots;
+    for (auto &entry: entries) {
+        Cell &cell = cells_.Emplace(entry.pos);
+        Replace(entry.pos, cell, entry.text, std::move(entry.formula));
+        if (const FormulaCell *formula = cell.GetFormula()) {
+            GetReferences(*formula->formula, refs_buffer_, ranges_buffer_);
+            for (Position ref: refs_buffer_) {
+                cells_.Emplace(ref);
+                if (rebuild) {
+                    edges.emplace_back(ref, entry.pos);
+                } else {
+                    dependents_.AddEdge(ref, entry.pos);
+                }
+            }
+            for (const CellRange &range: ranges_buffer_) {
+                range_dependents_.Add(range, entry.pos);
+            }
+        }
+        if (!rebuild) {
+            roots.push_back(entry.pos);
+        }
+    }
+    if (rebuild) {
+        dependents_.Rebuild(std::move(edges));
+    }
+
+    // Формулы пакета и зависящие от них встают в конец топологического
+    // порядка: от остальных формул ничего из них не зависит
+    for (Position pos: order) {
+        cells_.Get(pos)->GetFormula()->order = next_last_order_++;
+    }
+    // Если граф строился заново, зависимыми ячеек пакета могут быть только
+    // формулы пакета, а их значения уже не вычислены
+    if (!rebuild) {
+        invalidated_count_ = InvalidateDependents(roots);
+    }
+}
+
+std::unique_ptr<FormulaCell> Sheet::ParseCellFormula(Position pos, const std::string &text) const {
+    if (text.size() <= 1 || text.front() != FORMULA_SIGN) {
+        return nullptr;
+    }
+    std::unique_ptr<FormulaCell> formula;
+    try {
+        formula.reset(new FormulaCell{*this, pos, ParseFormula(text.substr(1), pos), {}});
+    } catch (std::bad_alloc &) {
+        throw;
+    } catch (std::exception &) {
+        throw FormulaException("Formula error");
+    }
+    formula->text = FORMULA_SIGN + formula->formula->GetExpression();
+    return formula;
+}
+
+void Sheet::ParseBatch(std::vector<BatchEntry> &entries, size_t threads) const {
+    if (threads <= 1) {
+        for (auto &entry: entries) {
+            entry.formula = ParseCellFormula(entry.pos, entry.text);
+        }
+        return;
+    }
+
+    // Разбор не обращается к листу, поэтому формулы разбираются независимо.
+    // Из ошибок запоминается ошибка первой по порядку формулы, чтобы
+    // исключение не зависело от распределения работы между потоками
+    std::mutex mutex;
+    size_t failed = entries.size();
+    std::exception_ptr error;
+    GetThreadPool(threads).ParallelFor(entries.size(), [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) {
+            try {
+                entries[i].formula = ParseCellFormula(entries[i].pos, entries[i].text);
+            } catch (...) {
+                std::lock_guard lock(mutex);
+                if (i < failed) {
+                    failed = i;
+                    error = std::current_exception();
+                }
+                return;
+            }
+        }
+    });
+    if (error) {
+        std::rethrow_exception(error);
+    }
+}
+
+void Sheet::Replace(Position pos, Cell &cell, const std::string &text, std::unique_ptr<FormulaCell> formula) {
+    // Удалим старые зависимости
+    RemoveDependencies(pos, cell);
+
+    if (formula) {
+        cell.SetFormula(std::move(formula));
+        cells_.InvalidateValue(pos);
+    } else if (text.empty()) {
+        cell.Clear();
+        cells_.StoreValue(pos, EmptyCellValue());
+    } else {
+        cell.SetText(text);
+        cells_.StoreValue(pos, GetTextNumber(text));
+    }
+    cells_.SetPrintable(pos, !text.empty());
+}
+
+bool Sheet::SortBatch(const std::vector<BatchEntry> &entries, std::vector<Position> &order) const {
+    // Цикл итогового графа проходит через формулу пакета, а кроме формул
+    // пакета в нём могут быть только формулы, которые от них зависят:
+    // остальные ячейки обратно к пакету не ведут. Поэтому проверяется только
+    // подграф из формул пакета и всех их зависимых
+    static const std::uint32_t NO_NODE = std::numeric_limits<std::uint32_t>::max();
+    std::vector<std::pair<std::uint32_t, std::uint32_t>> batch_nodes;
+    std::vector<Position> nodes;
+    std::vector<const FormulaInterface *> formulas;
+    for (const auto &entry: entries) {
+        if (entry.formula) {
+            batch_nodes.emplace_back(PositionKey(entry.pos), static_cast<std::uint32_t>(nodes.size()));
+            nodes.push_back(entry.pos);
+            formulas.push_back(entry.formula->formula.get());
+        } else if (const Cell *cell = cells_.Get(entry.pos); cell && cell->GetFormula()) {
+            // Заменяемая формула ещё числится зависимой от своих ссылок, но
+            // исходящих ссылок у ячейки больше не будет. Остальные ячейки
+            // пакета без формулы зависимыми не бывают
+            batch_nodes.emplace_back(PositionKey(entry.pos), NO_NODE);
+        }
+    }
+
+    // Ячейки пакета ищутся двоичным поиском по ключу, а зависимые формулы
+    // вне пакета, которых обычно немного, — в хеш-таблице
+    std::sort(batch_nodes.begin(), batch_nodes.end());
+    std::unordered_map<std::uint32_t, std::uint32_t> other_nodes;
+    auto find_node = [&](Position pos, std::uint32_t &node) {
+        const std::uint32_t key = PositionKey(pos);
+        auto it = std::lower_bound(batch_nodes.begin(), batch_nodes.end(), std::pair(key, std::uint32_t{0}));
+        if (it != batch_nodes.end() && it->first == key) {
+            node = it->second;
+            return true;
+        }
+        auto other = other_nodes.find(key);
+        if (other != other_nodes.end()) {
+            node = other->second;
+            return true;
+        }
+        return false;
+    };
+
+    // Зависимые ячейки пакета в списке уже есть, поэтому по старым ссылкам
+    // заменяемых формул обход не идёт
+    for (size_t i = 0; i < nodes.size(); ++i) {
+        ForEachDependent(nodes[i], [&](Position dependent) {
+            std::uint32_t node;
+            if (!find_node(dependent, node)) {
+                other_nodes.emplace(PositionKey(dependent), static_cast<std::uint32_t>(nodes.size()));
+                nodes.push_back(dependent);
+                formulas.push_back(cells_.Get(dependent)->GetFormula()->formula.get());
+            }
+        });
+    }
+
+    // Рёбра подграфа от формулы к формулам, на которые она ссылается
+    std::vector<std::uint32_t> offsets{0};
+    std::vector<std::uint32_t> targets;
+    offsets.reserve(nodes.size() + 1);
+    for (const FormulaInterface *formula: formulas) {
+        GetReferences(*formula, refs_buffer_, ranges_buffer_);
+        for (Position ref: refs_buffer_) {
+            std::uint32_t node;
+            if (find_node(ref, node) && node != NO_NODE) {
+                targets.push_back(node);
+            }
+        }
+        // Ячейки пакета в диапазоне перебираются по строкам, а пустые строки
+        // пропускаются двоичным поиском, поэтому размер диапазона неважен.
+        // Формул вне пакета немного, и они проверяются все
+        for (const CellRange &range: ranges_buffer_) {
+            for (int row = range.first.row; row <= range.last.row; ++row) {
+                auto it = std::lower_bound(batch_nodes.begin(), batch_nodes.end(),
+                                           std::pair(PositionKey({row, range.first.col}), std::uint32_t{0}));
+                if (it == batch_nodes.end()) {
+                    break;
+                }
+                if (KeyPosition(it->first).row > row) {
+                    row = KeyPosition(it->first).row - 1;
+                    continue;
+                }
+                const std::uint32_t last_key = PositionKey({row, range.last.col});
+                for (; it != batch_nodes.end() && it->first <= last_key; ++it) {
+                    if (it->second != NO_NODE) {
+                        targets.push_back(it->second);
+                    }
+                }
+            }
+            for (const auto &[key, node]: other_nodes) {
+                if (range.Contains(KeyPosition(key))) {
+                    targets.push_back(node);
+                }
+            }
+        }
+        offsets.push_back(static_cast<std::uint32_t>(targets.size()));
+    }
+
+    // Обход в глубину с явным стеком: серая вершина на пути обхода означает
+    // цикл, а чёрные вершины выходят в топологическом порядке
+    enum Color : std::uint8_t { WHITE, GRAY, BLACK };
+    std::vector<Color> colors(nodes.size(), WHITE);
+    std::vector<std::pair<std::uint32_t, std::uint32_t>> stack;
+    order.clear();
+    order.reserve(nodes.size());
+    for (std::uint32_t root = 0; root < nodes.size(); ++root) {
+        if (colors[root] != WHITE) {
+            continue;
+        }
+        colors[root] = GRAY;
+        stack.emplace_back(root, offsets[root]);
+        while (!stack.empty()) {
+            const std::uint32_t node = stack.back().first;
+            const std::uint32_t edge = stack.back().second;
+            if (edge == offsets[node + 1]) {
+                colors[node] = BLACK;
+                order.push_back(nodes[node]);
+                stack.pop_back();
+                continue;
+            }
+            ++stack.back().second;
+            const std::uint32_t target = targets[edge];
+            if (colors[target] == GRAY) {
+                return false;
+            }
+            if (colors[target] == WHITE) {
+                colors[target] = GRAY;
+                stack.emplace_back(target, offsets[target]);
+            }
+        }
     }
-    Cell *cell = dynamic_cast<Cell *>(cell_interface.get());
-    cell->Set(std::move(text));
+    return true;
 }
 
 const CellInterface *Sheet::GetCell(Position pos) const {
@@ -29,98 +352,449 @@ CellInterface *Sheet::GetCell(Position pos) {
     if (!pos.IsValid()) {
         throw InvalidPositionException{"InvalidPosition"};
     }
-    if (!IsPrintable(pos)) {
-        return nullptr;
-    }
-    return cells_[pos.row][pos.col].get();
+    return cells_.Get(pos);
 }
 
 void Sheet::ClearCell(Position pos) {
     if (!pos.IsValid()) {
         throw InvalidPositionException{"InvalidPosition"};
     }
-    if (!IsPrintable(pos)) {
+    if (!cells_.Get(pos)) {
+        invalidated_count_ = 0;
         return;
     }
-    cells_[pos.row][pos.col].reset();
-    Decrease(pos);
+    // Снимем зависимости ячейки и сбросим значения зависимых от неё ячеек
+    SetCell(pos, "");
+    // На пустую ячейку, на которую ссылаются формулы, хранятся обратные
+    // зависимости, поэтому такую ячейку оставляем
+    if (!dependents_.HasDependents(pos)) {
+        cells_.Erase(pos);
+    }
 }
 
 Size Sheet::GetPrintableSize() const {
-    return size_;
+    return cells_.GetSize();
 }
 
 void Sheet::PrintValues(std::ostream &output) const {
-    auto printer = [](const std::unique_ptr<CellInterface> &cell, std::ostream &output) {
-        std::visit([&output](auto &&arg) { output << arg; }, cell->GetValue());
-    };
-    PrintTable(printer, output);
+    PrintValues(output, 1);
 }
 
 void Sheet::PrintTexts(std::ostream &output) const {
-    auto printer = [](const std::unique_ptr<CellInterface> &cell, std::ostream &output) {
-        output << cell->GetText();
+    OutputBuffer buffer(print_buffer_, output);
+    WriteTexts(buffer);
+}
+
+void Sheet::PrintValues(std::ostream &output, size_t threads) const {
+    OutputBuffer buffer(print_buffer_, output);
+    WriteValues(buffer, threads);
+}
+
+void Sheet::PrintValues(int fd, size_t threads) const {
+    OutputBuffer buffer(print_buffer_, fd);
+    WriteValues(buffer, threads);
+}
+
+void Sheet::PrintTexts(int fd) const {
+    OutputBuffer buffer(print_buffer_, fd);
+    WriteTexts(buffer);
+}
+
+void Sheet::WriteValues(OutputBuffer &output, size_t threads) const {
+    auto printer = [this](const Cell &cell, OutputBuffer &output) {
+        WriteValue(cell, output);
+    };
+    if (threads <= 1 || !output.FormatsNumbers()) {
+        PrintTable(printer, output);
+        return;
+    }
+
+    // После вычисления печать только читает значения, поэтому полосы строк
+    // форматируются независимо. Полосы обрабатываются группами, чтобы в
+    // памяти не держать весь вывод сразу
+    RecalculateAll(threads);
+    const Size size = GetPrintableSize();
+    const int band_rows = std::max(1, static_cast<int>(PRINT_BAND_CELLS) / std::max(size.cols, 1));
+    ThreadPool &pool = GetThreadPool(threads);
+    std::vector<std::vector<char>> bands(threads * 4);
+    std::vector<size_t> band_sizes(bands.size());
+    for (int first_row = 0; first_row < size.rows; first_row += band_rows * static_cast<int>(bands.size())) {
+        const auto rest = static_cast<size_t>((size.rows - first_row + band_rows - 1) / band_rows);
+        const size_t count = std::min(bands.size(), rest);
+        pool.ParallelFor(count, [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; ++i) {
+                OutputBuffer band(bands[i], output);
+                const int band_first = first_row + static_cast<int>(i) * band_rows;
+                PrintRows(printer, band, size, band_first, std::min(band_first + band_rows, size.rows));
+                band_sizes[i] = band.GetSize();
+            }
+        });
+        for (size_t i = 0; i < count; ++i) {
+            output.Write(std::string_view(bands[i].data(), band_sizes[i]));
+        }
+    }
+    output.Flush();
+}
+
+void Sheet::WriteValue(const Cell &cell, OutputBuffer &output) const {
+    // Значение пишется без копирования в CellInterface::Value: число формулы
+    // берётся из хранилища, текст — из ячейки
+    if (const FormulaCell *formula = cell.GetFormula()) {
+        const double number = cells_.GetNumber(formula->pos);
+        if (IsFormulaError(number)) {
+            output.Write(UnboxFormulaError(number).ToString());
+        } else {
+            output.WriteNumber(number);
+        }
+        return;
+    }
+    std::string_view text = cell.GetTextView();
+    if (!text.empty() && text.front() == ESCAPE_SIGN) {
+        text.remove_prefix(1);
+    }
+    output.Write(text);
+}
+
+void Sheet::WriteTexts(OutputBuffer &output) const {
+    auto printer = [](const Cell &cell, OutputBuffer &output) {
+        output.Write(cell.GetTextView());
     };
     PrintTable(printer, output);
 }
 
-bool Sheet::IsPrintable(Position pos) const {
-    if (SizeOf(cells_) <= pos.row) {
+double Sheet::GetNumber(Position pos) const {
+    return cells_.GetNumber(pos);
+}
+
+void Sheet::VisitRange(Position first, Position last, const Visitor &visitor) const {
+    cells_.VisitRange(first, last, visitor);
+}
+
+void Sheet::StoreValue(Position pos, double value) const {
+    cells_.StoreValue(pos, value);
+}
+
+void Sheet::InvalidateValue(Position pos) const {
+    cells_.InvalidateValue(pos);
+}
+
+size_t Sheet::GetInvalidatedCount() const {
+    return invalidated_count_;
+}
+
+bool Sheet::IsValueValid(Position pos) const {
+    return cells_.IsValueValid(pos);
+}
+
+bool Sheet::PlaceInOrder(Position pos, const FormulaInterface &formula, std::int64_t &order) {
+    // Текст и пустые ячейки ни на что не ссылаются и в порядке не участвуют,
+    // поэтому рёбра от них порядок не нарушают
+    const FormulaCell *old = cells_.Get(pos)->GetFormula();
+    GetReferences(formula, new_refs_, new_ranges_);
+    if (std::find(new_refs_.begin(), new_refs_.end(), pos) != new_refs_.end() ||
+        std::any_of(new_ranges_.begin(), new_ranges_.end(), [pos](const CellRange &range) {
+            return range.Contains(pos);
+        })) {
         return false;
     }
-    if (SizeOf(cells_[pos.row]) <= pos.col) {
+
+    if (old) {
+        // формула заменяется на своём месте
+        order = old->order;
+    } else if (!dependents_.HasDependents(pos) && !range_dependents_.Contains(pos)) {
+        // новая ячейка, на которую никто не ссылается, встаёт в конец
+        order = next_last_order_++;
+        return true;
+    } else {
+        // на ячейку уже ссылаются, поэтому она встаёт в начало
+        order = next_first_order_--;
+    }
+
+    bool placed = true;
+    ForEachExistingCell(new_refs_, new_ranges_, [&](Position ref, const Cell &cell) {
+        if (placed && cell.GetFormula() && cell.GetFormula()->order > order && !Reorder(pos, order, ref)) {
+            placed = false;
+        }
+    });
+    if (old) {
+        old->order = order;
+    }
+    return placed;
+}
+
+bool Sheet::Reorder(Position pos, std::int64_t &pos_order, Position source) {
+    auto order_of = [this, pos, &pos_order](Position cell) -> std::int64_t & {
+        return cell == pos ? pos_order : cells_.Get(cell)->GetFormula()->order;
+    };
+    const std::int64_t lower = pos_order;
+    const std::int64_t upper = order_of(source);
+    const std::uint32_t forward_mark = StartVisit();
+    const std::uint32_t backward_mark = forward_mark + 1;
+
+    // Вперёд от pos по зависимым формулам, стоящим раньше source. Если
+    // среди них есть сама source, ребро замкнуло бы цикл
+    forward_region_.assign(1, pos);
+    stack_.assign(1, pos);
+    bool cycle = false;
+    while (!stack_.empty() && !cycle) {
+        const Position current = stack_.back();
+        stack_.pop_back();
+        ForEachDependent(current, [&](Position dependent) {
+            if (dependent == source) {
+                cycle = true;
+                return;
+            }
+            const Cell *cell = cells_.Get(dependent);
+            if (cell->GetVisitMark() != forward_mark && cell->GetFormula()->order < upper) {
+                cell->SetVisitMark(forward_mark);
+                forward_region_.push_back(dependent);
+                stack_.push_back(dependent);
+            }
+        });
+    }
+    if (cycle) {
         return false;
     }
+
+    // Назад от source по ссылкам на формулы, стоящие позже pos
+    cells_.Get(source)->SetVisitMark(backward_mark);
+    backward_region_.assign(1, source);
+    stack_.assign(1, source);
+    while (!stack_.empty()) {
+        const Position current = stack_.back();
+        stack_.pop_back();
+        GetReferences(*cells_.Get(current)->GetFormula()->formula, refs_buffer_, ranges_buffer_);
+        ForEachExistingCell(refs_buffer_, ranges_buffer_, [&](Position ref, const Cell &cell) {
+            if (ref == pos || !cell.GetFormula()) {
+                return;
+            }
+            if (cell.GetVisitMark() != backward_mark && cell.GetFormula()->order > lower) {
+                cell.SetVisitMark(backward_mark);
+                backward_region_.push_back(ref);
+                stack_.push_back(ref);
+            }
+        });
+    }
+
+    // Формулы, от которых зависит source, занимают места области первыми,
+    // за ними идут формулы, зависящие от pos. Внутри каждой группы
+    // относительный порядок сохраняется
+    auto by_order = [&order_of](Position lhs, Position rhs) {
+        return order_of(lhs) < order_of(rhs);
+    };
+    std::sort(backward_region_.begin(), backward_region_.end(), by_order);
+    std::sort(forward_region_.begin(), forward_region_.end(), by_order);
+    region_orders_.clear();
+    for (Position cell: backward_region_) {
+        region_orders_.push_back(order_of(cell));
+    }
+    for (Position cell: forward_region_) {
+        region_orders_.push_back(order_of(cell));
+    }
+    std::sort(region_orders_.begin(), region_orders_.end());
+    size_t next = 0;
+    for (Position cell: backward_region_) {
+        order_of(cell) = region_orders_[next++];
+    }
+    for (Position cell: forward_region_) {
+        order_of(cell) = region_orders_[next++];
+    }
     return true;
 }
 
-void Sheet::Increase(Position pos) {
-    if (size_.rows <= pos.row) {
-        size_.rows = pos.row + 1;
-        cells_.resize(size_.rows);
+std::uint32_t Sheet::StartVisit() const {
+    if (visit_epoch_ >= std::numeric_limits<std::uint32_t>::max() - 2) {
+        // номера обходов пошли по кругу, старые метки надо снять
+        cells_.ForEach([](const Cell &cell) {
+            if (cell.GetFormula()) {
+                cell.SetVisitMark(0);
+            }
+        });
+        visit_epoch_ = 0;
+    }
+    visit_epoch_ += 2;
+    return visit_epoch_;
+}
+
+void Sheet::RemoveDependencies(Position pos, const Cell &cell) {
+    const FormulaCell *formula = cell.GetFormula();
+    if (!formula) {
+        return;
     }
-    if (SizeOf(cells_[pos.row]) <= pos.col) {
-        cells_[pos.row].resize(pos.col + 1);
+    GetReferences(*formula->formula, refs_buffer_, ranges_buffer_);
+    for (Position ref: refs_buffer_) {
+        dependents_.RemoveEdge(ref, pos);
     }
-    if (size_.cols <= pos.col) {
-        size_.cols = pos.col + 1;
+    for (const CellRange &range: ranges_buffer_) {
+        range_dependents_.Remove(range, pos);
     }
 }
 
-void Sheet::Decrease(Position pos) {
+void Sheet::AddDependencies(Position pos, const Cell &cell) {
+    GetReferences(*cell.GetFormula()->formula, refs_buffer_, ranges_buffer_);
+    for (Position ref: refs_buffer_) {
+        cells_.Emplace(ref);
+        dependents_.AddEdge(ref, pos);
+    }
+    for (const CellRange &range: ranges_buffer_) {
+        range_dependents_.Add(range, pos);
+    }
+}
 
-    // Удалим лишние пустые ячейки в строке
-    int curr_size = SizeOf(cells_[pos.row]);
-    if (curr_size == pos.col + 1) {
-        int new_size = curr_size;
-        while (new_size != 0 && cells_[pos.row][new_size - 1] == nullptr) {
-            --new_size;
-        }
-        cells_[pos.row].resize(new_size);
+std::vector<Position> Sheet::GetReferencedCells(const FormulaInterface &formula) const {
+    std::vector<Position> cells;
+    std::vector<CellRange> ranges;
+    formula.AppendReferencedCells(cells);
+    formula.AppendReferencedRanges(ranges);
+    if (ranges.empty()) {
+        return cells;
+    }
+    for (const CellRange &range: ranges) {
+        cells_.ForEachInRange(range.first, range.last, [&cells](Position pos, const Cell &) {
+            cells.push_back(pos);
+        });
+    }
+    std::sort(cells.begin(), cells.end());
+    cells.erase(std::unique(cells.begin(), cells.end()), cells.end());
+    return cells;
+}
+
+void Sheet::GetReferences(const FormulaInterface &formula, std::vector<Position> &cells,
+                          std::vector<CellRange> &ranges) {
+    cells.clear();
+    ranges.clear();
+    formula.AppendReferencedCells(cells);
+    formula.AppendReferencedRanges(ranges);
+}
+
+size_t Sheet::InvalidateDependents(Position pos) {
+    stack_.assign(1, pos);
+    return InvalidateStacked();
+}
+
+size_t Sheet::InvalidateDependents(const std::vector<Position> &roots) {
+    stack_.assign(roots.begin(), roots.end());
+    return InvalidateStacked();
+}
+
+size_t Sheet::InvalidateStacked() {
+    // Обход списком работ. Ячейка попадает в список только тогда, когда её
+    // значение из вычисленного становится невычисленным, поэтому за одно
+    // изменение каждая ячейка обрабатывается не больше одного раза, сколько
+    // бы путей к ней ни вело. Зависимые невычисленной ячейки уже не вычислены,
+    // и обход на ней останавливается
+    size_t count = 0;
+    while (!stack_.empty()) {
+        const Position current = stack_.back();
+        stack_.pop_back();
+        ForEachDependent(current, [this, &count](Position dependent) {
+            if (cells_.InvalidateValue(dependent)) {
+                ++count;
+                stack_.push_back(dependent);
+            }
+        });
     }
+    return count;
+}
 
-    // Удалим лишние пустые строки
-    if (cells_[pos.row].empty() && size_.rows == pos.row + 1) {
-        int new_size = size_.rows;
-        while (new_size != 0 && cells_[new_size - 1].empty()) {
-            --new_size;
+void Sheet::RecalculateAll(size_t threads) const {
+    std::vector<const Cell *> roots;
+    cells_.ForEach([&roots](const Cell &cell) {
+        if (cell.IsDirty()) {
+            roots.push_back(&cell);
         }
-        size_.rows = new_size;  // обновим количество строк в печатной области
-        cells_.resize(size_.rows);
+    });
+    if (threads > 1) {
+        RecalculateParallel(std::move(roots), threads);
+    } else {
+        Recalculate(std::move(roots));
+    }
+}
+
+void Sheet::Recalculate(const Cell &cell) const {
+    Recalculate(std::vector<const Cell *>{&cell});
+}
+
+void Sheet::Recalculate(std::vector<const Cell *> roots) const {
+    for (const Cell *cell: SortDirty(std::move(roots))) {
+        cell->Evaluate();
     }
+}
 
-    // Обновим количество колонок в печатной области
-    if (size_.cols == pos.col + 1) {
-        int max_size = 0;
-        for (const auto &row: cells_) {
-            if (max_size < SizeOf(row)) {
-                max_size = SizeOf(row);
+void Sheet::RecalculateParallel(std::vector<const Cell *> roots, size_t threads) const {
+    ThreadPool &pool = GetThreadPool(threads);
+    for (const auto &level: SplitIntoLevels(SortDirty(std::move(roots)))) {
+        // Ячейки уровня читают только значения предыдущих уровней и пишут
+        // только своё значение, поэтому их можно вычислять одновременно
+        pool.ParallelFor(level.size(), [&level](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; ++i) {
+                level[i]->Evaluate();
             }
+        });
+    }
+}
+
+ThreadPool &Sheet::GetThreadPool(size_t threads) const {
+    if (!thread_pool_ || thread_pool_->GetThreadCount() != std::max<size_t>(threads, 1)) {
+        thread_pool_.reset();
+        thread_pool_ = std::make_unique<ThreadPool>(threads);
+    }
+    return *thread_pool_;
+}
+
+std::vector<std::vector<const Cell *>> Sheet::SplitIntoLevels(const std::vector<const Cell *> &order) const {
+    std::vector<std::vector<const Cell *>> levels;
+    std::unordered_map<const Cell *, size_t> level_of;
+    level_of.reserve(order.size());
+    for (const Cell *cell: order) {
+        size_t level = 0;
+        ForEachDirtyReference(*cell->GetFormula()->formula, [&](const Cell &ref) {
+            auto it = level_of.find(&ref);
+            if (it != level_of.end()) {
+                level = std::max(level, it->second + 1);
+            }
+        });
+        level_of[cell] = level;
+        if (levels.size() == level) {
+            levels.emplace_back();
         }
-        size_.cols = max_size;
+        levels[level].push_back(cell);
     }
+    return levels;
 }
 
+std::vector<const Cell *> Sheet::SortDirty(std::vector<const Cell *> roots) const {
+    // Обход в глубину с явным стеком: ячейка попадает в порядок после того,
+    // как в него попали все невычисленные ячейки, на которые она ссылается.
+    // Посещённые ячейки отмечаются номером обхода
+    const std::uint32_t mark = StartVisit();
+    std::vector<const Cell *> order;
+    std::vector<std::pair<const Cell *, bool>> stack;
+    for (auto it = roots.rbegin(); it != roots.rend(); ++it) {
+        if ((*it)->IsDirty()) {
+            stack.emplace_back(*it, false);
+        }
+    }
+    while (!stack.empty()) {
+        auto [cell, expanded] = stack.back();
+        stack.pop_back();
+        if (expanded) {
+            order.push_back(cell);
+            continue;
+        }
+        if (cell->GetVisitMark() == mark) {
+            continue;
+        }
+        cell->SetVisitMark(mark);
+        stack.emplace_back(cell, true);
+        ForEachDirtyReference(*cell->GetFormula()->formula, [&](const Cell &ref) {
+            if (ref.GetVisitMark() != mark) {
+                stack.emplace_back(&ref, false);
+            }
+        });
+    }
+    return order;
+}
 
 std::unique_ptr<SheetInterface> CreateSheet() {
     return std::make_unique<Sheet>();
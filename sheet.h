@@ -1,15 +1,36 @@
 #pragma once
 
 #include "cell.h"
+#include "cell_storage.h"
 #include "common.h"
+#include "dependency_graph.h"
+#include "output_buffer.h"
+#include "range_index.h"
+#include "thread_pool.h"
 
+#include <cstdint>
 #include <iostream>
 #include <functional>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
 
-class Sheet : public SheetInterface {
+class Sheet : public SheetInterface, public NumericSource {
 public:
     void SetCell(Position pos, std::string text) override;
 
+    // Задаёт содержимое многих ячеек сразу. Итог тот же, что у вызовов
+    // SetCell для пар по порядку (из пар с одной позицией действует
+    // последняя), но граф зависимостей обновляется, а значения сбрасываются
+    // один раз на весь пакет, и циклы ищутся одной проверкой итогового графа.
+    // Если среди пар есть некорректная позиция или формула либо итоговый граф
+    // содержит цикл, бросается то же исключение, что и у SetCell, а лист не
+    // меняется. При threads > 1 формулы разбираются параллельно на заданном
+    // числе потоков, а в лист их вписывает вызывающий поток; если неверных
+    // формул несколько, исключение относится к первой из них.
+    void SetCells(std::vector<std::pair<Position, std::string>> cells, size_t threads = 1);
+
     [[nodiscard]] const CellInterface *GetCell(Position pos) const override;
 
     CellInterface *GetCell(Position pos) override;
@@ -22,41 +43,266 @@ public:
 
     void PrintTexts(std::ostream &output) const override;
 
+    // При threads > 1 невычисленные ячейки сначала вычисляются
+    // RecalculateAll(threads), затем полосы строк форматируются параллельно
+    // в отдельные буферы и выводятся по порядку. Вывод совпадает с выводом
+    // на одном потоке байт в байт.
+    void PrintValues(std::ostream &output, size_t threads) const;
+
+    // То же с записью в файловый дескриптор fd. При ошибке записи бросается
+    // std::system_error.
+    void PrintValues(int fd, size_t threads = 1) const;
+
+    void PrintTexts(int fd) const;
+
+    // Вычисляет за один проход все ячейки, значения которых ещё не вычислены.
+    // Удобно вызывать перед выгрузкой таблицы, чтобы вычислить все значения.
+    // При threads > 1 независимые ячейки одного уровня зависимостей
+    // вычисляются параллельно на заданном числе потоков.
+    void RecalculateAll(size_t threads = 1) const;
+
+    // Вычисляет ячейку и все ещё не вычисленные ячейки, от которых она зависит.
+    // Ячейки вычисляются итеративно в топологическом порядке, поэтому длина
+    // цепочки зависимостей не ограничена глубиной стека.
+    void Recalculate(const Cell &cell) const;
+
+    // Значения читаются прямо из колоночных копий в блоках хранилища.
+    [[nodiscard]] double GetNumber(Position pos) const override;
+
+    void VisitRange(Position first, Position last, const Visitor &visitor) const override;
+
+    // Обновляют колоночную копию значения ячейки, см. CellStorage.
+    void StoreValue(Position pos, double value) const;
+
+    void InvalidateValue(Position pos) const;
+
+    [[nodiscard]] bool IsValueValid(Position pos) const;
+
+    // Ячейки, на которые ссылается формула листа: ячейки, на которые она
+    // ссылается по отдельности, и существующие ячейки её диапазонов, по
+    // возрастанию и без повторов. Отсутствующие ячейки диапазона не
+    // перечисляются, поэтому список не длиннее числа ячеек листа, каким бы
+    // большим ни был диапазон.
+    [[nodiscard]] std::vector<Position> GetReferencedCells(const FormulaInterface &formula) const;
+
+    // Количество зависимых ячеек, значения которых сбросило последнее
+    // изменение ячейки.
+    [[nodiscard]] size_t GetInvalidatedCount() const;
+
+    // Записывает лист в двоичный снимок, см. snapshot.h. Если with_values,
+    // в снимок попадают и уже вычисленные значения формул, иначе после
+    // загрузки формулы вычисляются заново. При ошибке записи бросается
+    // SnapshotError.
+    void SaveSnapshot(std::ostream &output, bool with_values = true) const;
+
+    // Создаёт лист из снимка в файле path. Файл отображается в память, ячейки,
+    // граф зависимостей и порядок формул переносятся в лист как есть, без
+    // поиска циклов, а разбирается только одна запись на каждое тело формулы.
+    // Граф и порядок только сверяются с формулами за линейное время.
+    // Бросает SnapshotError, если файл не читается, не является снимком или
+    // повреждён.
+    static std::unique_ptr<Sheet> LoadSnapshot(const std::string &path);
+
 private:
-    [[nodiscard]] bool IsPrintable(Position pos) const;
+    // Новое содержимое ячейки из пакета SetCells.
+    struct BatchEntry {
+        Position pos;
+        std::string text;
+        std::unique_ptr<FormulaCell> formula;
+    };
+
+    // Заполняет пустой лист снимком data.
+    void RestoreSnapshot(const char *data, size_t size);
+
+    // Разбирает формулу, заданную текстом ячейки pos. Для текста, который не
+    // является формулой, возвращает nullptr.
+    std::unique_ptr<FormulaCell> ParseCellFormula(Position pos, const std::string &text) const;
+
+    // Разбирает формулы пакета, см. SetCells.
+    void ParseBatch(std::vector<BatchEntry> &entries, size_t threads) const;
+
+    // Заменяет содержимое ячейки cell в позиции pos: снимает зависимости
+    // старой формулы и обновляет значение в хранилище. Зависимости новой
+    // формулы добавляет вызывающий.
+    void Replace(Position pos, Cell &cell, const std::string &text, std::unique_ptr<FormulaCell> formula);
+
+    // Проверяет на циклы граф, который получится после замены ячеек пакета.
+    // Если циклов нет, записывает в order формулы пакета и все зависящие от
+    // них формулы в топологическом порядке.
+    bool SortBatch(const std::vector<BatchEntry> &entries, std::vector<Position> &order) const;
+
+    // Находит место формулы formula, которую ставят в ячейку pos, в
+    // топологическом порядке формул (см. FormulaCell::order) и записывает его
+    // в order. Возвращает false, если формула создала бы цикл; порядок
+    // остальных формул при этом может измениться, но остаётся корректным.
+    bool PlaceInOrder(Position pos, const FormulaInterface &formula, std::int64_t &order);
+
+    // Восстанавливает порядок после появления ребра source -> pos, где
+    // формула source стоит позже pos (алгоритм Пирса — Келли). Переставляются
+    // только формулы между pos и source. Возвращает false, если source
+    // зависит от pos.
+    bool Reorder(Position pos, std::int64_t &pos_order, Position source);
+
+    // Снимают и добавляют обратные зависимости от ячеек и диапазонов, на
+    // которые ссылается формула cell в позиции pos. Отсутствующие ячейки, на
+    // которые формула ссылается по отдельности, при добавлении создаются
+    // пустыми; ячейки диапазонов не создаются.
+    void RemoveDependencies(Position pos, const Cell &cell);
+
+    void AddDependencies(Position pos, const Cell &cell);
+
+    // Записывает в cells и ranges ссылки формулы, см.
+    // FormulaInterface::AppendReferencedCells.
+    static void GetReferences(const FormulaInterface &formula, std::vector<Position> &cells,
+                              std::vector<CellRange> &ranges);
+
+    // Вызывает func(pos, cell) для существующих ячеек из cells и из диапазонов
+    // ranges. Ячейка, попавшая в несколько диапазонов, встречается несколько раз.
+    template<typename Func>
+    void ForEachExistingCell(const std::vector<Position> &cells, const std::vector<CellRange> &ranges,
+                             Func func) const;
+
+    // Вызывает func(cell) для невычисленных ячеек, на которые ссылается
+    // formula, возможно по нескольку раз.
+    template<typename Func>
+    void ForEachDirtyReference(const FormulaInterface &formula, Func func) const;
+
+    // Вызывает func(dependent) для формул, которые ссылаются на pos по
+    // отдельности или через диапазон, возможно по нескольку раз.
+    template<typename Func>
+    void ForEachDependent(Position pos, Func func) const;
+
+    // Сбрасывают значения всех вычисленных ячеек, транзитивно зависящих от
+    // pos или от ячеек roots, и возвращают их количество.
+    size_t InvalidateDependents(Position pos);
+
+    size_t InvalidateDependents(const std::vector<Position> &roots);
+
+    // Сбрасывает значения ячеек, зависящих от позиций в stack_.
+    size_t InvalidateStacked();
 
-    void Increase(Position pos);
+    // Возвращает невычисленные ячейки, достижимые по ссылкам из roots, в
+    // топологическом порядке: каждая ячейка идёт после всех, от которых зависит.
+    std::vector<const Cell *> SortDirty(std::vector<const Cell *> roots) const;
 
-    void Decrease(Position pos);
+    void Recalculate(std::vector<const Cell *> roots) const;
 
+    // Разбивает ячейки, упорядоченные топологически, на уровни: ячейка уровня k
+    // ссылается только на ячейки уровней меньше k и уже вычисленные ячейки.
+    std::vector<std::vector<const Cell *>> SplitIntoLevels(const std::vector<const Cell *> &order) const;
+
+    void RecalculateParallel(std::vector<const Cell *> roots, size_t threads) const;
+
+    // Таблица печатается через буфер, который копит вывод и сбрасывает его
+    // большими записями.
+    void WriteValues(OutputBuffer &output, size_t threads) const;
+
+    void WriteValue(const Cell &cell, OutputBuffer &output) const;
+
+    void WriteTexts(OutputBuffer &output) const;
+
+    template<typename Printer>
+    void PrintTable(Printer printer, OutputBuffer &output) const;
+
+    // Печатает строки [first_row, last_row) таблицы размера size.
     template<typename Printer>
-    void PrintTable(Printer printer, std::ostream &output) const;
+    void PrintRows(Printer printer, OutputBuffer &output, Size size, int first_row, int last_row) const;
+
+    CellStorage cells_;
+
+    // Обратные зависимости: позиции формул, которые ссылаются на ячейку по
+    // отдельности, и формул, которые ссылаются на диапазоны.
+    DependencyGraph dependents_;
+    RangeIndex range_dependents_;
+
+    // Возвращает новый номер обхода. Обход может пользоваться метками
+    // epoch и epoch + 1, см. Cell::GetVisitMark.
+    std::uint32_t StartVisit() const;
+
+    // Номер последнего обхода и буферы обходов, которые переиспользуются
+    // между вызовами.
+    mutable std::uint32_t visit_epoch_ = 0;
+    std::vector<Position> stack_;
+    std::vector<Position> new_refs_;
+    std::vector<CellRange> new_ranges_;
+    std::vector<Position> forward_region_;
+    std::vector<Position> backward_region_;
+    std::vector<std::int64_t> region_orders_;
+    mutable std::vector<Position> refs_buffer_;
+    mutable std::vector<CellRange> ranges_buffer_;
+
+    size_t invalidated_count_ = 0;
+
+    // Память буфера печати, переиспользуется между выводами.
+    mutable std::vector<char> print_buffer_;
+
+    // Пул потоков параллельных операций листа. Создаётся при первой из них и
+    // пересоздаётся, только если изменилось число потоков, чтобы потоки не
+    // запускались заново при каждом вычислении или выводе.
+    ThreadPool &GetThreadPool(size_t threads) const;
+
+    mutable std::unique_ptr<ThreadPool> thread_pool_;
 
-    std::vector<std::vector<std::unique_ptr<CellInterface>>> cells_;
-    Size size_;
+    // Следующие свободные места в конце и в начале топологического порядка.
+    std::int64_t next_last_order_ = 0;
+    std::int64_t next_first_order_ = -1;
 };
 
-template<typename Container>
-int SizeOf(const Container &c) {
-    return static_cast<int>(c.size());
+template<typename Func>
+void Sheet::ForEachExistingCell(const std::vector<Position> &cells, const std::vector<CellRange> &ranges,
+                                Func func) const {
+    for (Position pos: cells) {
+        if (const Cell *cell = cells_.Get(pos)) {
+            func(pos, *cell);
+        }
+    }
+    for (const CellRange &range: ranges) {
+        cells_.ForEachInRange(range.first, range.last, func);
+    }
+}
+
+template<typename Func>
+void Sheet::ForEachDirtyReference(const FormulaInterface &formula, Func func) const {
+    GetReferences(formula, refs_buffer_, ranges_buffer_);
+    for (Position pos: refs_buffer_) {
+        const Cell *cell = cells_.Get(pos);
+        if (cell && cell->IsDirty()) {
+            func(*cell);
+        }
+    }
+    for (const CellRange &range: ranges_buffer_) {
+        cells_.ForEachInvalidInRange(range.first, range.last, [&func](Position, const Cell &cell) {
+            func(cell);
+        });
+    }
+}
+
+template<typename Func>
+void Sheet::ForEachDependent(Position pos, Func func) const {
+    dependents_.ForEachDependent(pos, func);
+    range_dependents_.ForEachDependent(pos, func);
 }
 
 template<typename Printer>
-void Sheet::PrintTable(Printer printer, std::ostream &output) const {
-    for (const auto &rows: cells_) {
-        int col = 0;
-        int min_cols = std::min(SizeOf(rows), size_.cols);
-        for (; col < min_cols; ++col) {
-            if (rows[col]) {
-                printer(rows[col], output);
-            }
-            if (col < size_.cols - 1) {
-                output << '\t';
+void Sheet::PrintTable(Printer printer, OutputBuffer &output) const {
+    const Size size = GetPrintableSize();
+    PrintRows(printer, output, size, 0, size.rows);
+    output.Flush();
+}
+
+template<typename Printer>
+void Sheet::PrintRows(Printer printer, OutputBuffer &output, Size size, int first_row, int last_row) const {
+    for (int row = first_row; row < last_row; ++row) {
+        int tabs = 0;
+        cells_.ForEachInRow(row, size.cols, [&](int col, const Cell &cell) {
+            for (; tabs < col; ++tabs) {
+                output.Put('\t');
             }
+            printer(cell, output);
+        });
+        for (; tabs < size.cols - 1; ++tabs) {
+            output.Put('\t');
         }
-        for (; col < size_.cols - 1; ++col) {
-            output << '\t';
-        }
-        output << '\n';
+        output.Put('\n');
     }
 }
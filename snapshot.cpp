@@ -0,0 +1,376 @@
+#include "snapshot.h"
+
+#include "FormulaAST.h"
+#include "sheet.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <exception>
+#include <limits>
+#include <sstream>
+#include <string_view>
+#include <system_error>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#ifdef _WIN32
+#include <fstream>
+#include <iterator>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace {
+    const std::uint64_t KEY_COUNT = std::uint64_t{Position::MAX_ROWS} * Position::MAX_COLS;
+
+    const size_t SECTION_ALIGNMENT = 8;
+
+    std::uint32_t PositionKey(Position pos) {
+        return static_cast<std::uint32_t>(pos.row) * Position::MAX_COLS + static_cast<std::uint32_t>(pos.col);
+    }
+
+    Position KeyPosition(std::uint32_t key) {
+        return {static_cast<int>(key / Position::MAX_COLS), static_cast<int>(key % Position::MAX_COLS)};
+    }
+
+    size_t AlignSection(size_t offset) {
+        return (offset + SECTION_ALIGNMENT - 1) / SECTION_ALIGNMENT * SECTION_ALIGNMENT;
+    }
+
+    // Записи читаются копированием: секции выровнены, но отображение файла
+    // не создаёт в памяти объектов этих типов.
+    template<typename Record>
+    Record ReadRecord(const char *data) {
+        Record record;
+        std::memcpy(&record, data, sizeof(record));
+        return record;
+    }
+
+    // Смещения секций снимка от его начала.
+    struct Layout {
+        size_t cells;
+        size_t bodies;
+        size_t edges;
+        size_t strings;
+        size_t end;
+    };
+
+    Layout GetLayout(const SnapshotHeader &header) {
+        Layout layout{};
+        layout.cells = AlignSection(sizeof(SnapshotHeader));
+        layout.bodies = AlignSection(layout.cells + size_t{header.cell_count} * sizeof(SnapshotCell));
+        layout.edges = AlignSection(layout.bodies + size_t{header.body_count} * sizeof(SnapshotBody));
+        layout.strings = AlignSection(layout.edges + header.edge_count * sizeof(SnapshotEdge));
+        layout.end = layout.strings + header.string_size;
+        return layout;
+    }
+
+    void WriteSection(std::ostream &output, const void *data, size_t size) {
+        static const char PADDING[SECTION_ALIGNMENT] = {};
+        output.write(static_cast<const char *>(data), static_cast<std::streamsize>(size));
+        output.write(PADDING, static_cast<std::streamsize>(AlignSection(size) - size));
+    }
+
+    SnapshotError Corrupted() {
+        return SnapshotError("Corrupted snapshot");
+    }
+
+    // Файл, отображённый в память только для чтения. Там, где отображения
+    // нет, файл читается в память целиком.
+    class MappedFile {
+    public:
+        explicit MappedFile(const std::string &path) {
+#ifdef _WIN32
+            std::ifstream input(path, std::ios::binary);
+            if (!input) {
+                throw SnapshotError("Cannot open snapshot " + path);
+            }
+            buffer_.assign(std::istreambuf_iterator<char>(input), std::istreambuf_iterator<char>());
+            data_ = buffer_.data();
+            size_ = buffer_.size();
+#else
+            const int fd = ::open(path.c_str(), O_RDONLY);
+            if (fd < 0) {
+                throw Error(path);
+            }
+            struct stat info{};
+            if (::fstat(fd, &info) != 0) {
+                const auto error = Error(path);
+                ::close(fd);
+                throw error;
+            }
+            size_ = static_cast<size_t>(info.st_size);
+            if (size_ > 0) {
+                void *data = ::mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+                if (data == MAP_FAILED) {
+                    const auto error = Error(path);
+                    ::close(fd);
+                    throw error;
+                }
+                // секции читаются подряд от начала к концу
+                ::madvise(data, size_, MADV_SEQUENTIAL);
+                data_ = static_cast<const char *>(data);
+            }
+            ::close(fd);
+#endif
+        }
+
+        MappedFile(const MappedFile &) = delete;
+
+        MappedFile &operator=(const MappedFile &) = delete;
+
+        ~MappedFile() {
+#ifndef _WIN32
+            if (data_) {
+                ::munmap(const_cast<char *>(data_), size_);
+            }
+#endif
+        }
+
+        [[nodiscard]] const char *Data() const {
+            return data_;
+        }
+
+        [[nodiscard]] size_t Size() const {
+            return size_;
+        }
+
+    private:
+#ifndef _WIN32
+        static SnapshotError Error(const std::string &path) {
+            return SnapshotError("Cannot read snapshot " + path + ": " +
+                                 std::generic_category().message(errno));
+        }
+#endif
+
+        const char *data_ = nullptr;
+        size_t size_ = 0;
+#ifdef _WIN32
+        std::vector<char> buffer_;
+#endif
+    };
+}  // namespace
+
+void Sheet::SaveSnapshot(std::ostream &output, bool with_values) const {
+    std::vector<SnapshotCell> cells;
+    std::vector<SnapshotBody> bodies;
+    std::vector<SnapshotEdge> edges;
+    std::string strings;
+    // Тексты ячеек живут, пока пишется снимок, поэтому ключами служат они сами
+    std::unordered_map<std::string_view, std::uint64_t> string_offsets;
+    std::unordered_map<const FormulaAST *, std::uint32_t> body_numbers;
+    std::vector<Position> refs;
+
+    // Пустые ячейки, на которые ссылаются формулы, тоже сохраняются, хотя в
+    // печатную область не входят
+    cells_.ForEachOrdered([&](Position pos, const Cell &cell) {
+        SnapshotCell record{};
+        record.key = PositionKey(pos);
+        record.body = SnapshotCell::NO_BODY;
+
+        const std::string_view text = cell.GetTextView();
+        if (!text.empty()) {
+            const auto [it, inserted] = string_offsets.emplace(text, strings.size());
+            if (inserted) {
+                strings.append(text);
+            }
+            record.text_offset = it->second;
+            record.text_size = static_cast<std::uint32_t>(text.size());
+        }
+
+        const FormulaCell *formula = cell.GetFormula();
+        if (formula) {
+            const auto body = GetFormulaBody(*formula->formula);
+            const auto [it, inserted] = body_numbers.emplace(body.get(), bodies.size());
+            if (inserted) {
+                std::ostringstream expression;
+                expression.precision(std::numeric_limits<double>::max_digits10);
+                body->PrintFormula(expression, pos);
+                const std::string body_text = expression.str();
+                bodies.push_back({static_cast<std::uint32_t>(cells.size()),
+                                  static_cast<std::uint32_t>(body_text.size()), strings.size()});
+                strings.append(body_text);
+            }
+            record.body = it->second;
+            record.order = formula->order;
+
+            refs.clear();
+            formula->formula->AppendReferencedCells(refs);
+            for (Position ref: refs) {
+                edges.push_back({PositionKey(ref), record.key});
+            }
+        }
+        if (!formula || (with_values && cells_.IsValueValid(pos))) {
+            record.flags = SnapshotCell::VALUE_VALID;
+            record.value = cells_.GetNumber(pos);
+        }
+        cells.push_back(record);
+    });
+    std::sort(edges.begin(), edges.end(), [](const SnapshotEdge &lhs, const SnapshotEdge &rhs) {
+        return std::pair(lhs.from, lhs.to) < std::pair(rhs.from, rhs.to);
+    });
+
+    SnapshotHeader header{};
+    std::memcpy(header.magic, SnapshotHeader::MAGIC, sizeof(header.magic));
+    header.version = SnapshotHeader::VERSION;
+    header.cell_count = static_cast<std::uint32_t>(cells.size());
+    header.body_count = static_cast<std::uint32_t>(bodies.size());
+    header.edge_count = edges.size();
+    header.string_size = strings.size();
+    header.next_last_order = next_last_order_;
+    header.next_first_order = next_first_order_;
+
+    WriteSection(output, &header, sizeof(header));
+    WriteSection(output, cells.data(), cells.size() * sizeof(SnapshotCell));
+    WriteSection(output, bodies.data(), bodies.size() * sizeof(SnapshotBody));
+    WriteSection(output, edges.data(), edges.size() * sizeof(SnapshotEdge));
+    output.write(strings.data(), static_cast<std::streamsize>(strings.size()));
+    output.flush();
+    if (!output) {
+        throw SnapshotError("Cannot write snapshot");
+    }
+}
+
+std::unique_ptr<Sheet> Sheet::LoadSnapshot(const std::string &path) {
+    MappedFile file(path);
+    auto sheet = std::make_unique<Sheet>();
+    sheet->RestoreSnapshot(file.Data(), file.Size());
+    return sheet;
+}
+
+void Sheet::RestoreSnapshot(const char *data, size_t size) {
+    if (size < sizeof(SnapshotHeader)) {
+        throw SnapshotError("Not a sheet snapshot");
+    }
+    const auto header = ReadRecord<SnapshotHeader>(data);
+    if (std::memcmp(header.magic, SnapshotHeader::MAGIC, sizeof(header.magic)) != 0) {
+        throw SnapshotError("Not a sheet snapshot");
+    }
+    if (header.version != SnapshotHeader::VERSION) {
+        throw SnapshotError("Unsupported snapshot version");
+    }
+    // Размеры проверяются до сложения смещений, чтобы оно не переполнилось
+    if (header.edge_count > size / sizeof(SnapshotEdge) || header.string_size > size ||
+        GetLayout(header).end > size) {
+        throw Corrupted();
+    }
+    const Layout layout = GetLayout(header);
+
+    auto read_cell = [&](std::uint32_t index) {
+        const auto record = ReadRecord<SnapshotCell>(data + layout.cells + index * sizeof(SnapshotCell));
+        if (record.key >= KEY_COUNT || record.text_offset > header.string_size ||
+            record.text_size > header.string_size - record.text_offset) {
+            throw Corrupted();
+        }
+        return record;
+    };
+    auto get_text = [&](const SnapshotCell &record) {
+        return std::string_view(data + layout.strings + record.text_offset, record.text_size);
+    };
+
+    // Каждое тело разбирается один раз, в ячейке, для которой записано
+    std::vector<FormulaBody> bodies(header.body_count);
+    for (std::uint32_t i = 0; i < header.body_count; ++i) {
+        const auto body = ReadRecord<SnapshotBody>(data + layout.bodies + i * sizeof(SnapshotBody));
+        if (body.cell >= header.cell_count || body.text_offset > header.string_size ||
+            body.text_size > header.string_size - body.text_offset) {
+            throw Corrupted();
+        }
+        const auto record = read_cell(body.cell);
+        if (record.body != i) {
+            throw Corrupted();
+        }
+        const std::string_view text(data + layout.strings + body.text_offset, body.text_size);
+        try {
+            bodies[i] = GetFormulaBody(*ParseFormula(std::string(text), KeyPosition(record.key)));
+        } catch (std::exception &) {
+            throw Corrupted();
+        }
+    }
+
+    // Рёбра и порядок формул переносятся в лист как есть, поэтому сверяются
+    // с формулами: рёбра должны совпадать с их ссылками, а порядок — идти
+    // вдоль рёбер и диапазонов. Иначе граф разошёлся бы с формулами, а
+    // вычисление по порядку прочитало бы невычисленные значения
+    std::vector<std::pair<Position, Position>> expected_edges;
+    expected_edges.reserve(header.edge_count);
+    std::vector<Position> formulas;
+    std::uint32_t previous_key = 0;
+    for (std::uint32_t i = 0; i < header.cell_count; ++i) {
+        const auto record = read_cell(i);
+        if (i > 0 && record.key <= previous_key) {
+            throw Corrupted();
+        }
+        previous_key = record.key;
+        const Position pos = KeyPosition(record.key);
+        const std::string_view text = get_text(record);
+        const bool valid = record.flags & SnapshotCell::VALUE_VALID;
+        Cell &cell = cells_.Emplace(pos);
+        if (record.body != SnapshotCell::NO_BODY) {
+            if (record.body >= header.body_count || record.order <= header.next_first_order ||
+                record.order >= header.next_last_order) {
+                throw Corrupted();
+            }
+            cell.SetFormula(std::unique_ptr<FormulaCell>(new FormulaCell{
+                    *this, pos, MakeFormula(bodies[record.body], pos), std::string(text), record.order}));
+            GetReferences(*cell.GetFormula()->formula, refs_buffer_, ranges_buffer_);
+            for (Position ref: refs_buffer_) {
+                expected_edges.emplace_back(ref, pos);
+            }
+            for (const CellRange &range: ranges_buffer_) {
+                range_dependents_.Add(range, pos);
+            }
+            formulas.push_back(pos);
+        } else if (!valid) {
+            // значение текста и пустой ячейки вычислено всегда
+            throw Corrupted();
+        } else if (!text.empty()) {
+            cell.SetText(text);
+        }
+        cells_.SetPrintable(pos, !text.empty());
+        if (valid) {
+            cells_.StoreValue(pos, record.value);
+        } else {
+            cells_.InvalidateValue(pos);
+        }
+    }
+
+    std::vector<std::pair<Position, Position>> edges;
+    edges.reserve(header.edge_count);
+    for (std::uint64_t i = 0; i < header.edge_count; ++i) {
+        const auto edge = ReadRecord<SnapshotEdge>(data + layout.edges + i * sizeof(SnapshotEdge));
+        if (edge.from >= KEY_COUNT || edge.to >= KEY_COUNT) {
+            throw Corrupted();
+        }
+        edges.emplace_back(KeyPosition(edge.from), KeyPosition(edge.to));
+    }
+    std::sort(expected_edges.begin(), expected_edges.end());
+    if (edges != expected_edges) {
+        throw Corrupted();
+    }
+    auto get_order = [this](Position pos) {
+        return cells_.Get(pos)->GetFormula()->order;
+    };
+    for (const auto &[from, to]: edges) {
+        const Cell *cell = cells_.Get(from);
+        if (!cell || (cell->GetFormula() && get_order(from) >= get_order(to))) {
+            throw Corrupted();
+        }
+    }
+    for (Position pos: formulas) {
+        range_dependents_.ForEachDependent(pos, [&](Position dependent) {
+            if (get_order(pos) >= get_order(dependent)) {
+                throw Corrupted();
+            }
+        });
+    }
+    dependents_.Rebuild(std::move(edges));
+
+    next_last_order_ = header.next_last_order;
+    next_first_order_ = header.next_first_order;
+}
@@ -0,0 +1,72 @@
+#pragma once
+
+#include <cstdint>
+#include <stdexcept>
+
+// Двоичный снимок листа, см. Sheet::SaveSnapshot и Sheet::LoadSnapshot.
+//
+// Снимок состоит из заголовка и четырёх секций, каждая из которых начинается
+// с границы 8 байт: таблицы ячеек, тел формул, рёбер графа зависимостей и
+// таблицы строк. Числа записаны в порядке байтов машины, которая создала
+// снимок; снимок с другим порядком байтов отвергается по версии. Тексты
+// ячеек интернированы: одинаковые тексты хранятся в таблице строк один раз.
+//
+// Формулы, отличающиеся только сдвигом ссылок, разделяют одно тело (см.
+// FormulaBody). Тело хранится записью для одной из ячеек с ним: при
+// загрузке запись разбирается один раз, а остальные формулы получают
+// готовое тело. Текст ячейки формулы округляет числа, поэтому запись тела
+// печатает их со всеми значащими цифрами и разбирается в то же тело.
+class SnapshotError : public std::runtime_error {
+public:
+    using std::runtime_error::runtime_error;
+};
+
+struct SnapshotHeader {
+    static constexpr char MAGIC[8] = {'S', 'H', 'E', 'E', 'T', 'S', 'N', 'P'};
+    static const std::uint32_t VERSION = 3;
+
+    char magic[8];
+    std::uint32_t version;
+    std::uint32_t cell_count;
+    std::uint32_t body_count;
+    std::uint32_t reserved;
+    std::uint64_t edge_count;
+    std::uint64_t string_size;
+    // Следующие свободные места топологического порядка формул.
+    std::int64_t next_last_order;
+    std::int64_t next_first_order;
+};
+
+// Ячейка снимка. Ключ позиции — row * Position::MAX_COLS + col.
+struct SnapshotCell {
+    static const std::uint32_t NO_BODY = UINT32_MAX;
+    static const std::uint32_t VALUE_VALID = 1;
+
+    std::uint32_t key;
+    // номер тела формулы или NO_BODY для текста и пустой ячейки
+    std::uint32_t body;
+    // текст ячейки (для формулы — каноническая запись) в таблице строк
+    std::uint64_t text_offset;
+    std::uint32_t text_size;
+    std::uint32_t flags;
+    // числовая форма значения, если установлен VALUE_VALID
+    double value;
+    // место формулы в топологическом порядке
+    std::int64_t order;
+};
+
+// Тело формулы: номер ячейки и запись формулы в этой ячейке без знака
+// формулы, в таблице строк.
+struct SnapshotBody {
+    std::uint32_t cell;
+    std::uint32_t text_size;
+    std::uint64_t text_offset;
+};
+
+// Ребро графа зависимостей: формула to ссылается на ячейку from по
+// отдельности. Рёбра отсортированы по from, затем по to. Зависимости от
+// диапазонов в снимок не пишутся: их дают тела формул.
+struct SnapshotEdge {
+    std::uint32_t from;
+    std::uint32_t to;
+};
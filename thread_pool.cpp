@@ -0,0 +1,129 @@
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <utility>
+
+ThreadPool::ThreadPool(size_t threads)
+        : queues_(std::max<size_t>(threads, 1)) {
+    for (size_t i = 1; i < queues_.size(); ++i) {
+        workers_.emplace_back([this, i] { WorkerLoop(i); });
+    }
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard lock(mutex_);
+        stop_ = true;
+    }
+    work_ready_.notify_all();
+    for (auto &worker: workers_) {
+        worker.join();
+    }
+}
+
+size_t ThreadPool::GetThreadCount() const {
+    return queues_.size();
+}
+
+void ThreadPool::ParallelFor(size_t count, const std::function<void(size_t, size_t)> &body) {
+    if (count == 0) {
+        return;
+    }
+    if (queues_.size() == 1) {
+        body(0, count);
+        return;
+    }
+
+    // Диапазонов больше, чем потоков, чтобы было что забирать при дисбалансе
+    const size_t grain = std::max<size_t>(1, count / (queues_.size() * 8));
+    {
+        std::lock_guard lock(mutex_);
+        body_ = &body;
+        pending_ = (count + grain - 1) / grain;
+    }
+    // Задача становится видна потокам только вместе с body_, поэтому поток,
+    // ещё не вышедший из предыдущего вызова, может сразу её забрать
+    size_t chunk = 0;
+    for (size_t begin = 0; begin < count; begin += grain, ++chunk) {
+        Queue &queue = queues_[chunk % queues_.size()];
+        std::lock_guard lock(queue.mutex);
+        queue.ranges.push_back({begin, std::min(begin + grain, count)});
+    }
+    {
+        std::lock_guard lock(mutex_);
+        ++generation_;
+    }
+    work_ready_.notify_all();
+
+    Work(0);
+
+    std::unique_lock lock(mutex_);
+    work_done_.wait(lock, [this] { return pending_ == 0; });
+    body_ = nullptr;
+    failed_ = false;
+    if (error_) {
+        std::rethrow_exception(std::exchange(error_, nullptr));
+    }
+}
+
+void ThreadPool::WorkerLoop(size_t index) {
+    size_t seen_generation = 0;
+    while (true) {
+        {
+            std::unique_lock lock(mutex_);
+            work_ready_.wait(lock, [&] { return stop_ || generation_ != seen_generation; });
+            if (stop_) {
+                return;
+            }
+            seen_generation = generation_;
+        }
+        Work(index);
+    }
+}
+
+void ThreadPool::Work(size_t index) {
+    Range range;
+    while (Pop(index, range) || Steal(index, range)) {
+        // Диапазон считается обработанным и после исключения, иначе
+        // вызывающий поток ждал бы его вечно
+        if (!failed_) {
+            try {
+                (*body_)(range.begin, range.end);
+            } catch (...) {
+                std::lock_guard lock(mutex_);
+                if (!error_) {
+                    error_ = std::current_exception();
+                }
+                failed_ = true;
+            }
+        }
+        if (--pending_ == 0) {
+            std::lock_guard lock(mutex_);
+            work_done_.notify_all();
+        }
+    }
+}
+
+bool ThreadPool::Pop(size_t index, Range &range) {
+    Queue &queue = queues_[index];
+    std::lock_guard lock(queue.mutex);
+    if (queue.ranges.empty()) {
+        return false;
+    }
+    range = queue.ranges.back();
+    queue.ranges.pop_back();
+    return true;
+}
+
+bool ThreadPool::Steal(size_t index, Range &range) {
+    for (size_t i = 1; i < queues_.size(); ++i) {
+        Queue &victim = queues_[(index + i) % queues_.size()];
+        std::lock_guard lock(victim.mutex);
+        if (!victim.ranges.empty()) {
+            range = victim.ranges.front();
+            victim.ranges.pop_front();
+            return true;
+        }
+    }
+    return false;
+}
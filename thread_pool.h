@@ -0,0 +1,72 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Пул потоков с планировщиком на основе захвата работы (work stealing).
+// Работа делится на диапазоны индексов, которые раздаются в очереди потоков.
+// Поток берёт диапазоны из своей очереди с конца, а опустев, забирает их
+// с начала очередей других потоков.
+class ThreadPool {
+public:
+    // threads - общее число потоков, включая вызывающий.
+    explicit ThreadPool(size_t threads);
+
+    ThreadPool(const ThreadPool &) = delete;
+
+    ThreadPool &operator=(const ThreadPool &) = delete;
+
+    ~ThreadPool();
+
+    [[nodiscard]] size_t GetThreadCount() const;
+
+    // Вызывает body(begin, end) для непересекающихся диапазонов, покрывающих
+    // [0, count). Вызывающий поток тоже выполняет работу и возвращается,
+    // когда обработаны все диапазоны. Если body бросает исключение, остальные
+    // диапазоны пропускаются, а первое исключение после завершения всех
+    // потоков бросается в вызывающем потоке. body не должна вызывать
+    // ParallelFor того же пула.
+    void ParallelFor(size_t count, const std::function<void(size_t, size_t)> &body);
+
+private:
+    struct Range {
+        size_t begin = 0;
+        size_t end = 0;
+    };
+
+    struct Queue {
+        std::mutex mutex;
+        std::deque<Range> ranges;
+    };
+
+    void WorkerLoop(size_t index);
+
+    void Work(size_t index);
+
+    bool Pop(size_t index, Range &range);
+
+    bool Steal(size_t index, Range &range);
+
+    std::vector<Queue> queues_;
+    std::vector<std::thread> workers_;
+
+    std::mutex mutex_;
+    std::condition_variable work_ready_;
+    std::condition_variable work_done_;
+    size_t generation_ = 0;
+    bool stop_ = false;
+
+    const std::function<void(size_t, size_t)> *body_ = nullptr;
+    std::atomic<size_t> pending_{0};
+
+    // Первое исключение body в текущем вызове ParallelFor.
+    std::exception_ptr error_;
+    std::atomic<bool> failed_{false};
+};